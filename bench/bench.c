@@ -0,0 +1,266 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "debug.h"
+#include "eeprom.h"
+#include "hal.h"
+#include "lora.h"
+#include "motor.h"
+#include "settings.h"
+#include "stepper.h"
+#include "timer.h"
+#include "trace.h"
+#include "watchdog.h"
+
+/// Benchmarks of the operations the firmware spends its time in, built as
+/// pill-dispenser-bench in place of main.c. Every result is printed as a
+/// line of comma separated values, see compare_bench.py
+
+/// Prefix of every line of results
+#define BENCH_LINE_PREFIX "#B"
+
+/// Bumped whenever the columns of a result change
+#define BENCH_FORMAT_VERSION 1
+
+#define BENCH_MAX_SAMPLES 256
+
+/// Time given to anything an operation set off in the background before the
+/// next sample is taken
+#define BENCH_SETTLE_MS 10
+
+/// Time the LoRa UART needs to send a command at 9600 baud, plus its answer
+#define BENCH_LORA_SETTLE_MS 50
+
+/// Rewritten with what it already holds
+#define BENCH_EEPROM_ADDR EEPROM_SCRATCH_ADDRESS
+
+#define BENCH_NS_PER_US 1000
+
+typedef struct {
+    const char* name;
+    /// Runs the operation once
+    void (*run)(void);
+    /// Runs before every sample, outside of the measurement. May be NULL
+    void (*settle)(void);
+    uint32_t samples;
+    /// Runs timed together in each sample, for operations that take less
+    /// than the microsecond the timer resolves
+    uint32_t batch;
+} bench_t;
+
+/// Takes the samples of a benchmark and prints its results
+static void bench_run(const bench_t* bench);
+
+/// Gets the sample at or below which `percent` of the sorted samples are
+static uint64_t bench_percentile(const uint64_t* sorted, uint32_t samples,
+                                 uint32_t percent);
+
+static int bench_compare(const void* a, const void* b);
+
+static void bench_settle(void);
+static void bench_settle_lora(void);
+static void bench_settle_trace(void);
+
+static void bench_motor_step_single(void);
+static void bench_step(void);
+static void bench_calibrate(void);
+static void bench_eeprom_read_byte(void);
+static void bench_eeprom_read_long(void);
+static void bench_eeprom_write_long(void);
+static void bench_lora_send_command(void);
+static void bench_timer_expired(void);
+static void bench_timer_add_cancel(void);
+static void bench_feed_watchdog(void);
+static void bench_watchdog_update(void);
+static void bench_trace_record(void);
+static void bench_log_line(void);
+
+static void bench_timer_callback(timer_id_t id, void* user_data);
+
+/// Calibration comes before the moves that need it
+static const bench_t benches[] = {
+    {"timer_expired", bench_timer_expired, NULL, 100, 1000},
+    {"timer_add_cancel", bench_timer_add_cancel, NULL, 100, 100},
+    {"feed_watchdog", bench_feed_watchdog, bench_settle_trace, 100, 16},
+    {"watchdog_update", bench_watchdog_update, NULL, 100, 100},
+    {"trace_record", bench_trace_record, bench_settle_trace, 100, 16},
+    {"log_line", bench_log_line, bench_settle, 20, 1},
+    {"eeprom_read_byte", bench_eeprom_read_byte, NULL, 100, 1},
+    {"eeprom_read_long", bench_eeprom_read_long, NULL, 100, 1},
+    {"eeprom_write_long", bench_eeprom_write_long, NULL, 20, 1},
+    {"lora_send_command", bench_lora_send_command, bench_settle_lora, 20, 1},
+    {"motor_step_single", bench_motor_step_single, bench_settle, 100, 1},
+    {"calibrate", bench_calibrate, NULL, 3, 1},
+    {"step", bench_step, bench_settle, 8, 1},
+};
+
+static uint64_t bench_samples[BENCH_MAX_SAMPLES];
+
+/// What the EEPROM holds at BENCH_EEPROM_ADDR, if it could be read
+static uint32_t bench_eeprom_value;
+static bool bench_eeprom_read = false;
+
+static void bench_run(const bench_t* bench) {
+    uint32_t samples = bench->samples;
+    uint64_t total = 0;
+    uint64_t start;
+    uint32_t i;
+    uint32_t j;
+
+    if (samples > BENCH_MAX_SAMPLES) {
+        samples = BENCH_MAX_SAMPLES;
+    }
+
+    for (i = 0; i < samples; ++i) {
+        feed_watchdog(WATCHDOG_FEED_OTHER);
+        if (bench->settle != NULL) {
+            bench->settle();
+        }
+
+        start = hal_time_us();
+        for (j = 0; j < bench->batch; ++j) {
+            bench->run();
+        }
+        bench_samples[i] =
+            (hal_time_us() - start) * BENCH_NS_PER_US / bench->batch;
+        total += bench_samples[i];
+    }
+
+    qsort(bench_samples, samples, sizeof(bench_samples[0]), bench_compare);
+
+    printf(BENCH_LINE_PREFIX "%s,%u,%u,%llu,%llu,%llu,%llu,%llu,%llu\n",
+           bench->name, samples, bench->batch, bench_samples[0],
+           total / samples,
+           bench_percentile(bench_samples, samples, 50),
+           bench_percentile(bench_samples, samples, 90),
+           bench_percentile(bench_samples, samples, 99),
+           bench_samples[samples - 1]);
+}
+
+static uint64_t bench_percentile(const uint64_t* sorted, uint32_t samples,
+                                 uint32_t percent) {
+    // Nearest rank
+    uint32_t rank = (samples * percent + 99) / 100;
+
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static int bench_compare(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+static void bench_settle() { hal_sleep_ms(BENCH_SETTLE_MS); }
+
+static void bench_settle_lora() {
+    hal_sleep_ms(BENCH_LORA_SETTLE_MS);
+    lora_poll();
+
+    // Only the framing is timed, not waiting for whatever lora_poll() sent
+    while (!lora_tx_idle()) {
+        hal_tight_loop();
+    }
+}
+
+static void bench_settle_trace() {
+    // Keep the buffer from overflowing, which takes a shorter path
+    while (trace_drain() != 0) {
+    }
+}
+
+static void bench_motor_step_single() { motor_step_single(); }
+
+static void bench_step() { step(); }
+
+static void bench_calibrate() { calibrate(true); }
+
+static void bench_eeprom_read_byte() { eeprom_read_byte(BENCH_EEPROM_ADDR); }
+
+static void bench_eeprom_read_long() { eeprom_read_long(BENCH_EEPROM_ADDR); }
+
+static void bench_eeprom_write_long() {
+    eeprom_write_long(BENCH_EEPROM_ADDR, bench_eeprom_value);
+}
+
+static void bench_lora_send_command() {
+    lora_send_command(LORA_BASIC_COMMAND, NULL);
+}
+
+static void bench_timer_expired() { timer_expired(); }
+
+static void bench_timer_add_cancel() {
+    timer_cancel(timer_add(US_IN_SECOND, 0, bench_timer_callback, NULL));
+}
+
+static void bench_feed_watchdog() { feed_watchdog(WATCHDOG_FEED_OTHER); }
+
+static void bench_watchdog_update() { hal_watchdog_update(); }
+
+static void bench_trace_record() {
+    trace_record(TRACE_EVENT_WATCHDOG_FED, WATCHDOG_FEED_OTHER, 0);
+}
+
+static void bench_log_line() {
+    // As long as a typical debug print
+    printf("Fed watchdog for reason %d\n", WATCHDOG_FEED_OTHER);
+}
+
+static void bench_timer_callback(timer_id_t id, void* user_data) {}
+
+int main(void) {
+    int64_t value;
+    size_t i;
+
+    hal_init();
+    printf("Serial port initialized\n");
+
+    init_trace();
+    init_watchdog();
+    init_settings();
+    init_timers();
+    init_lora();
+    init_stepper();
+
+    value = eeprom_read_long(BENCH_EEPROM_ADDR);
+    if (value >= 0) {
+        bench_eeprom_value = (uint32_t)value;
+        bench_eeprom_read = true;
+    }
+
+    printf(BENCH_LINE_PREFIX "# format %d, built " __DATE__ " " __TIME__
+                             ", LOG_LEVEL %d\n",
+           BENCH_FORMAT_VERSION, LOG_LEVEL);
+    printf(BENCH_LINE_PREFIX
+           "name,samples,batch,min_ns,mean_ns,p50_ns,p90_ns,p99_ns,max_ns\n");
+
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); ++i) {
+        // Writing anything but what the EEPROM held would corrupt it
+        if (benches[i].run == bench_eeprom_write_long && !bench_eeprom_read) {
+            printf(BENCH_LINE_PREFIX "# skipped %s, could not read the "
+                                     "EEPROM\n",
+                   benches[i].name);
+            continue;
+        }
+
+        bench_run(&benches[i]);
+    }
+
+    printf(BENCH_LINE_PREFIX "# done\n");
+
+    while (true) {
+        feed_watchdog(WATCHDOG_FEED_OTHER);
+        hal_sleep_ms(BENCH_SETTLE_MS * 100);
+    }
+}
+
+#undef BENCH_LINE_PREFIX
+#undef BENCH_FORMAT_VERSION
+#undef BENCH_MAX_SAMPLES
+#undef BENCH_SETTLE_MS
+#undef BENCH_LORA_SETTLE_MS
+#undef BENCH_EEPROM_ADDR
+#undef BENCH_NS_PER_US
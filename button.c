@@ -1,43 +1,209 @@
-#include "hardware/gpio.h"
-#include "pico/stdlib.h"
+#include <stddef.h>
 
 #include "button.h"
+#include "hal.h"
+#include "trace.h"
+
+#define BTN_IRQ_EVENT_MASK (HAL_GPIO_EDGE_FALL | HAL_GPIO_EDGE_RISE)
+#define BTN_COUNT 3
+
+typedef struct {
+    /// Debounced state
+    bool pressed;
+    /// Whether changes are ignored until the button has settled
+    bool settling;
+    /// Whether the last press already made a double press
+    bool doubled;
+    uint64_t released_us;
+    hal_alarm_id_t long_press_alarm;
+} button_state_t;
+
+/// Handles the edges of a button
+static void button_irq_handler(uint32_t pin, uint32_t edges);
+
+/// Accepts a debounced change of a button and queues its events
+static void button_change(btn_t btn, bool pressed);
+
+/// Ignores further edges of a button until it has settled
+static void button_settle_start(btn_t btn);
+
+/// Alarm callback that takes in a change missed while the button settled
+static int64_t button_settle_callback(hal_alarm_id_t id, void* user_data);
+
+/// Alarm callback that queues a long press if the button is still held down
+static int64_t button_long_press_callback(hal_alarm_id_t id, void* user_data);
+
+/// Queues an event and tells the handler. Runs in interrupt context
+static void button_queue_event(btn_t btn, button_event_type_t type,
+                               uint64_t time_us);
 
 static bool buttons_initialized = false;
 
+static button_handler_t button_handler = NULL;
+
+static const uint32_t button_pins[BTN_COUNT] = {BTN_0_PIN, BTN_1_PIN,
+                                                BTN_2_PIN};
+
+/// Only touched by the GPIO and alarm interrupts, which do not preempt each
+/// other
+static button_state_t button_states[BTN_COUNT];
+
+/// Single producer (interrupts), single consumer ring of events. Each side
+/// only ever writes its own index
+static button_event_t button_events[BUTTON_EVENT_QUEUE_SIZE];
+volatile static uint32_t button_event_head = 0;
+volatile static uint32_t button_event_tail = 0;
+volatile static uint32_t button_drops = 0;
+
 void init_buttons() {
     if (!buttons_initialized) {
-        // Init gpio pins
-        gpio_init(BTN_0_PIN);
-        gpio_init(BTN_1_PIN);
-        gpio_init(BTN_2_PIN);
+        // Buttons pull their pulled up pin low when pushed down, and both
+        // edges are needed to tell presses from releases
+        for (btn_t btn = BTN_0; btn <= BTN_2; ++btn) {
+            hal_gpio_init_input(button_pins[btn]);
+            hal_gpio_set_irq(button_pins[btn], BTN_IRQ_EVENT_MASK,
+                             button_irq_handler);
+        }
+
+        buttons_initialized = true;
+    }
+}
 
-        // Configure button pins as inputs
-        gpio_set_dir(BTN_0_PIN, GPIO_IN);
-        gpio_set_dir(BTN_1_PIN, GPIO_IN);
-        gpio_set_dir(BTN_2_PIN, GPIO_IN);
+void button_set_handler(button_handler_t handler) { button_handler = handler; }
 
-        // Pull button pins up
-        gpio_pull_up(BTN_0_PIN);
-        gpio_pull_up(BTN_1_PIN);
-        gpio_pull_up(BTN_2_PIN);
+static void button_irq_handler(uint32_t pin, uint32_t edges) {
+    bool pressed;
 
-        buttons_initialized = true;
+    for (btn_t btn = BTN_0; btn <= BTN_2; ++btn) {
+        // Bounces are ignored until the button settles, when the level is
+        // checked again
+        if (button_pins[btn] != pin || button_states[btn].settling) {
+            continue;
+        }
+
+        // The first edge counts right away. A glitch that is already over
+        // leaves the level where it was
+        pressed = !hal_gpio_get(pin);
+        if (pressed != button_states[btn].pressed) {
+            button_change(btn, pressed);
+            button_settle_start(btn);
+        }
     }
 }
 
-bool btn_pressed(btn_t btn) {
-    switch (btn) {
-    case BTN_0:
-        return gpio_get(BTN_0_PIN) == 0;
+static void button_change(btn_t btn, bool pressed) {
+    button_state_t* state = &button_states[btn];
+    uint64_t now = hal_time_us();
+
+    state->pressed = pressed;
+
+    if (pressed) {
+        button_queue_event(btn, BUTTON_EVENT_PRESS, now);
+
+        if (!state->doubled && state->released_us != 0 &&
+            now - state->released_us <= BUTTON_DOUBLE_PRESS_US) {
+            state->doubled = true;
+            button_queue_event(btn, BUTTON_EVENT_DOUBLE_PRESS, now);
+        } else {
+            state->doubled = false;
+        }
+
+        state->long_press_alarm =
+            hal_alarm_add(BUTTON_LONG_PRESS_US, button_long_press_callback,
+                          (void*)(uintptr_t)btn);
+    } else {
+        if (state->long_press_alarm > 0) {
+            hal_alarm_cancel(state->long_press_alarm);
+            state->long_press_alarm = 0;
+        }
+
+        // A third quick press starts over instead of making another double
+        state->released_us = state->doubled ? 0 : now;
+
+        button_queue_event(btn, BUTTON_EVENT_RELEASE, now);
+    }
+}
+
+static void button_settle_start(btn_t btn) {
+    if (hal_alarm_add(BUTTON_DEBOUNCE_US, button_settle_callback,
+                      (void*)(uintptr_t)btn) > 0) {
+        button_states[btn].settling = true;
+    }
+}
 
-    case BTN_1:
-        return gpio_get(BTN_1_PIN) == 0;
+static int64_t button_settle_callback(hal_alarm_id_t id, void* user_data) {
+    btn_t btn = (btn_t)(uintptr_t)user_data;
+    bool pressed;
 
-    case BTN_2:
-        return gpio_get(BTN_2_PIN) == 0;
+    button_states[btn].settling = false;
 
-    default:
+    pressed = !hal_gpio_get(button_pins[btn]);
+    if (pressed != button_states[btn].pressed) {
+        button_change(btn, pressed);
+        button_settle_start(btn);
+    }
+
+    return 0;
+}
+
+static int64_t button_long_press_callback(hal_alarm_id_t id, void* user_data) {
+    btn_t btn = (btn_t)(uintptr_t)user_data;
+
+    button_states[btn].long_press_alarm = 0;
+
+    if (button_states[btn].pressed) {
+        button_queue_event(btn, BUTTON_EVENT_LONG_PRESS, hal_time_us());
+    }
+
+    return 0;
+}
+
+static void button_queue_event(btn_t btn, button_event_type_t type,
+                               uint64_t time_us) {
+    uint32_t head = button_event_head;
+    button_event_t* event;
+
+    if (head - button_event_tail >= BUTTON_EVENT_QUEUE_SIZE) {
+        // Full, keep the oldest events
+        ++button_drops;
+        return;
+    }
+
+    event = &button_events[head % BUTTON_EVENT_QUEUE_SIZE];
+    event->btn = btn;
+    event->type = type;
+    event->time_us = time_us;
+    button_event_head = head + 1;
+
+    TRACE(TRACE_EVENT_BUTTON, btn, type);
+
+    if (button_handler != NULL) {
+        button_handler();
+    }
+}
+
+bool button_pop_event(button_event_t* event) {
+    uint32_t tail = button_event_tail;
+
+    if (tail == button_event_head) {
         return false;
     }
-}
\ No newline at end of file
+
+    *event = button_events[tail % BUTTON_EVENT_QUEUE_SIZE];
+    button_event_tail = tail + 1;
+
+    return true;
+}
+
+uint32_t button_dropped_events() { return button_drops; }
+
+bool btn_pressed(btn_t btn) {
+    if (btn < BTN_0 || btn > BTN_2) {
+        return false;
+    }
+
+    return button_states[btn].pressed;
+}
+
+#undef BTN_IRQ_EVENT_MASK
+#undef BTN_COUNT
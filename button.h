@@ -2,6 +2,7 @@
 #define BUTTON_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 /// Left button
 #define BTN_0_PIN 9
@@ -12,16 +13,56 @@
 /// Right button
 #define BTN_2_PIN 7
 
+/// Time a button has to settle after a change before the next one counts
+#define BUTTON_DEBOUNCE_US (20 * 1000)
+
+/// Time a button has to be held down for a long press
+#define BUTTON_LONG_PRESS_US (1000 * 1000)
+
+/// Longest time from releasing a button to pressing it again that still makes
+/// a double press
+#define BUTTON_DOUBLE_PRESS_US (300 * 1000)
+
+/// Number of events buffered until they are consumed. Power of two
+#define BUTTON_EVENT_QUEUE_SIZE 16
+
 typedef enum {
     BTN_0,
     BTN_1,
     BTN_2,
 } btn_t;
 
+typedef enum {
+    BUTTON_EVENT_PRESS,
+    BUTTON_EVENT_RELEASE,
+    /// Still held down BUTTON_LONG_PRESS_US after the press
+    BUTTON_EVENT_LONG_PRESS,
+    /// Follows the press event of the second press
+    BUTTON_EVENT_DOUBLE_PRESS,
+} button_event_type_t;
+
+typedef struct {
+    btn_t btn;
+    button_event_type_t type;
+    uint64_t time_us;
+} button_event_t;
+
+/// Called from interrupt context whenever an event has been queued
+typedef void (*button_handler_t)(void);
+
 /// Initializes board buttons
 void init_buttons(void);
 
-/// Checks whether a button is pressed
+/// Sets the handler run whenever an event has been queued, or NULL for none
+void button_set_handler(button_handler_t handler);
+
+/// Pops the oldest button event. Returns false if there is none
+bool button_pop_event(button_event_t* event);
+
+/// Gets the number of events dropped because the queue was full
+uint32_t button_dropped_events(void);
+
+/// Checks whether a button is pressed, after debouncing
 bool btn_pressed(btn_t btn);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+"""Compares the results of pill-dispenser-bench from two firmware versions.
+
+Usage:
+    compare_bench.py [--column COLUMN] old.log new.log
+    compare_bench.py --test
+
+Reads the serial logs the benchmark printed, among any other output, and
+prints a column of every benchmark side by side with the change between them,
+p50_ns by default. The output format is documented in bench/bench.c.
+"""
+
+import sys
+
+PREFIX = "#B"
+
+FORMAT_VERSION = 1
+
+DEFAULT_COLUMN = "p50_ns"
+
+
+def parse(lines):
+    """Gets the results in a log as a dict of benchmark name to a dict of
+    column name to value. Raises ValueError if the log has none or is of
+    another format version."""
+    columns = None
+    results = {}
+
+    for line in lines:
+        line = line.rstrip("\r\n")
+        if not line.startswith(PREFIX):
+            continue
+        line = line[len(PREFIX):]
+
+        if line.startswith("#"):
+            words = line[1:].replace(",", " ").split()
+            if words[:1] == ["format"] and int(words[1]) != FORMAT_VERSION:
+                raise ValueError("format %s, expected %d" %
+                                 (words[1], FORMAT_VERSION))
+            continue
+
+        fields = line.split(",")
+        if columns is None:
+            columns = fields
+            continue
+
+        if len(fields) != len(columns):
+            raise ValueError("expected %d fields, got %d" %
+                             (len(columns), len(fields)))
+        results[fields[0]] = dict(zip(columns[1:],
+                                      (int(field) for field in fields[1:])))
+
+    if not results:
+        raise ValueError("no results")
+
+    return results
+
+
+def compare(old, new, column):
+    """Formats the given column of two sets of results as table rows."""
+    rows = ["%-20s %14s %14s %8s" % ("benchmark", "old " + column,
+                                     "new " + column, "change")]
+
+    names = list(old) + [name for name in new if name not in old]
+    for name in names:
+        before = old.get(name, {}).get(column)
+        after = new.get(name, {}).get(column)
+
+        if before is None or after is None:
+            change = ""
+        elif before == 0:
+            change = "n/a" if after != 0 else "0.0%"
+        else:
+            change = "%+.1f%%" % ((after - before) * 100 / before)
+
+        rows.append("%-20s %14s %14s %8s" %
+                    (name, "-" if before is None else before,
+                     "-" if after is None else after, change))
+
+    return rows
+
+
+TEST_OLD = [
+    "Serial port initialized",
+    "#B# format 1, built Jan  1 2024 00:00:00, LOG_LEVEL 5",
+    "#Bname,samples,batch,min_ns,mean_ns,p50_ns,p90_ns,p99_ns,max_ns",
+    "#T000f4240 01 00000005 00000000",
+    "#Btimer_expired,100,1000,200,250,250,300,300,300",
+    "#Beeprom_read_byte,100,1,118000,120000,120000,121000,125000,125000",
+    "#Bstep,8,1,0,0,0,0,0,0",
+    "#B# done",
+]
+
+TEST_NEW = [
+    "#B# format 1, built Feb  1 2024 00:00:00, LOG_LEVEL 2",
+    "#Bname,samples,batch,min_ns,mean_ns,p50_ns,p90_ns,p99_ns,max_ns",
+    "#Btimer_expired,100,1000,180,200,200,250,250,250",
+    "#Beeprom_read_byte,100,1,118000,126000,126000,127000,130000,130000",
+    "#Bcalibrate,3,1,1,1,1,1,1,1",
+]
+
+TEST_EXPECTED = [
+    "benchmark                old p50_ns     new p50_ns   change",
+    "timer_expired                   250            200   -20.0%",
+    "eeprom_read_byte             120000         126000    +5.0%",
+    "step                              0              -         ",
+    "calibrate                         -              1         ",
+]
+
+
+def self_test():
+    failures = 0
+
+    got = compare(parse(TEST_OLD), parse(TEST_NEW), DEFAULT_COLUMN)
+    for got_row, expected_row in zip(got, TEST_EXPECTED):
+        if got_row != expected_row:
+            print("FAIL: got %r, expected %r" % (got_row, expected_row))
+            failures += 1
+    if len(got) != len(TEST_EXPECTED):
+        print("FAIL: got %d rows, expected %d" %
+              (len(got), len(TEST_EXPECTED)))
+        failures += 1
+
+    for log in (["#B# format 2"] + TEST_OLD[2:], TEST_OLD[:3],
+                TEST_OLD[:3] + ["#Bstep,8,1"]):
+        try:
+            parse(log)
+            print("FAIL: parsed %r" % log)
+            failures += 1
+        except ValueError:
+            pass
+
+    print("passed" if failures == 0 else "%d failed" % failures)
+    return failures == 0
+
+
+def main(args):
+    column = DEFAULT_COLUMN
+
+    if args == ["--test"]:
+        return 0 if self_test() else 1
+
+    if len(args) == 4 and args[0] == "--column":
+        column = args[1]
+        args = args[2:]
+
+    if len(args) != 2:
+        print(__doc__.strip())
+        return 1
+
+    try:
+        results = []
+        for path in args:
+            with open(path, errors="replace") as log:
+                results.append(parse(log))
+    except ValueError as err:
+        print("%s: %s" % (path, err))
+        return 1
+
+    for row in compare(results[0], results[1], column):
+        print(row)
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
@@ -1,21 +1,72 @@
 #ifndef DEBUG_H
 #define DEBUG_H
 
-/**/
-#define ENABLE_DEBUG_PRINTS
-/**/
+/// Log levels, each including the ones before it. Messages above the
+/// threshold of their module compile to nothing, format string included
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+/// Binary trace records, see trace.h
+#define LOG_LEVEL_TRACE 5
 
-#ifdef ENABLE_DEBUG_PRINTS
+/// Most verbose level compiled in, set with the LOG_LEVEL CMake option
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_TRACE
+#endif
+
+/// Threshold of the module being compiled. A module can only be made quieter
+/// than LOG_LEVEL, with its LOG_LEVEL_<MODULE> CMake option or by defining
+/// LOG_MODULE_LEVEL before its first include
+#if defined(LOG_MODULE_LEVEL) && LOG_MODULE_LEVEL < LOG_LEVEL
+#define LOG_THRESHOLD LOG_MODULE_LEVEL
+#else
+#define LOG_THRESHOLD LOG_LEVEL
+#endif
+
+#if LOG_THRESHOLD >= LOG_LEVEL_ERROR
 #include <stdio.h>
+#endif
+
+#define LOG_DISCARD(format, ...)                                               \
+    do {                                                                       \
+    } while (0)
+
+#if LOG_THRESHOLD >= LOG_LEVEL_ERROR
+#define LOG_ERROR(format, ...)                                                 \
+    do {                                                                       \
+        printf("Error: " format, ##__VA_ARGS__);                               \
+    } while (0)
+#else
+#define LOG_ERROR LOG_DISCARD
+#endif
+
+#if LOG_THRESHOLD >= LOG_LEVEL_WARN
+#define LOG_WARN(format, ...)                                                  \
+    do {                                                                       \
+        printf("Warning: " format, ##__VA_ARGS__);                             \
+    } while (0)
+#else
+#define LOG_WARN LOG_DISCARD
+#endif
 
-#define DBG(format, ...)                                                       \
+#if LOG_THRESHOLD >= LOG_LEVEL_INFO
+#define LOG_INFO(format, ...)                                                  \
     do {                                                                       \
         printf(format, ##__VA_ARGS__);                                         \
     } while (0)
 #else
-#define DBG(format, ...)                                                       \
+#define LOG_INFO LOG_DISCARD
+#endif
+
+#if LOG_THRESHOLD >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(format, ...)                                                 \
     do {                                                                       \
+        printf(format, ##__VA_ARGS__);                                         \
     } while (0)
+#else
+#define LOG_DEBUG LOG_DISCARD
 #endif
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+"""Decodes the binary uplinks the dispenser sends with AT+MSGHEX.
+
+Usage:
+    decode_telemetry.py <hex payload>...
+    decode_telemetry.py --test
+
+The layout is documented in telemetry.h.
+"""
+
+import sys
+
+EVENTS = [
+    "boot",
+    "drop_start",
+    "drop",
+    "calibration_start",
+    "calibrated",
+    "finished",
+    "ready",
+]
+
+FLAGS = [
+    (1 << 0, "detected"),
+    (1 << 1, "watchdog_reset"),
+    (1 << 2, "last_pill"),
+]
+
+HEADER_BYTES = 4
+
+# Events followed by a 16 bit value, and what it is called
+VALUES = {
+    EVENTS.index("calibrated"): ("steps_per_rotation", 1),
+    EVENTS.index("ready"): ("ready_s", 0.1),
+}
+
+
+def decode_record(payload):
+    """Decodes the record at the start of a payload into a dict and returns it
+    with its length. Raises ValueError if it is malformed."""
+    if len(payload) < HEADER_BYTES:
+        raise ValueError("record too short: %d bytes" % len(payload))
+
+    code = payload[0] >> 4
+    if code >= len(EVENTS):
+        raise ValueError("unknown event code %d" % code)
+
+    event = {
+        "event": EVENTS[code],
+        "flags": [name for bit, name in FLAGS if payload[0] & bit],
+        "slot": payload[1],
+        "delta_s": int.from_bytes(payload[2:4], "big"),
+    }
+    length = HEADER_BYTES
+
+    if code in VALUES:
+        name, scale = VALUES[code]
+        if len(payload) < HEADER_BYTES + 2:
+            raise ValueError("%s missing" % name)
+        value = int.from_bytes(payload[4:6], "big")
+        event[name] = value if scale == 1 else round(value * scale, 1)
+        length += 2
+
+    return event, length
+
+
+def decode(payload):
+    """Decodes an uplink into its list of events. Raises ValueError if it is
+    malformed."""
+    if not payload:
+        raise ValueError("empty payload")
+
+    events = []
+    while payload:
+        event, length = decode_record(payload)
+        events.append(event)
+        payload = payload[length:]
+
+    return events
+
+
+# Uplinks as telemetry_encode() and the batching in telemetry_report()
+# produce them, and what they decode to
+TEST_VECTORS = [
+    ("0000000C", [{"event": "boot", "flags": [], "slot": 0, "delta_s": 12}]),
+    ("02000005",
+     [{"event": "boot", "flags": ["watchdog_reset"], "slot": 0,
+       "delta_s": 5}]),
+    ("3000001E",
+     [{"event": "calibration_start", "flags": [], "slot": 0, "delta_s": 30}]),
+    ("40000009080A",
+     [{"event": "calibrated", "flags": [], "slot": 0, "delta_s": 9,
+       "steps_per_rotation": 2058}]),
+    ("10010E10",
+     [{"event": "drop_start", "flags": [], "slot": 1, "delta_s": 3600}]),
+    ("21020003",
+     [{"event": "drop", "flags": ["detected"], "slot": 2, "delta_s": 3}]),
+    ("2407FFFF",
+     [{"event": "drop", "flags": ["last_pill"], "slot": 7,
+       "delta_s": 65535}]),
+    ("50000001",
+     [{"event": "finished", "flags": [], "slot": 0, "delta_s": 1}]),
+    ("60000007004B",
+     [{"event": "ready", "flags": [], "slot": 0, "delta_s": 7,
+       "ready_s": 7.5}]),
+    # Calibration and the first drop batched into one uplink
+    ("3000000040000014080A1000000221010004",
+     [{"event": "calibration_start", "flags": [], "slot": 0, "delta_s": 0},
+      {"event": "calibrated", "flags": [], "slot": 0, "delta_s": 20,
+       "steps_per_rotation": 2058},
+      {"event": "drop_start", "flags": [], "slot": 0, "delta_s": 2},
+      {"event": "drop", "flags": ["detected"], "slot": 1, "delta_s": 4}]),
+]
+
+# Payloads that must be rejected
+BAD_VECTORS = ["", "000000", "F0000000", "00000000FF", "4000000908",
+               "0000000C21", "60000007"]
+
+
+def self_test():
+    failures = 0
+
+    for payload, expected in TEST_VECTORS:
+        got = decode(bytes.fromhex(payload))
+        if got != expected:
+            print("FAIL %s: got %s, expected %s" % (payload, got, expected))
+            failures += 1
+
+    for payload in BAD_VECTORS:
+        try:
+            decode(bytes.fromhex(payload))
+        except ValueError:
+            continue
+        print("FAIL %s: decoded a malformed payload" % payload)
+        failures += 1
+
+    total = len(TEST_VECTORS) + len(BAD_VECTORS)
+    print("%d/%d vectors passed" % (total - failures, total))
+    return failures == 0
+
+
+def main(args):
+    if not args:
+        print(__doc__.strip())
+        return 1
+
+    if args == ["--test"]:
+        return 0 if self_test() else 1
+
+    status = 0
+    for arg in args:
+        try:
+            for event in decode(bytes.fromhex(arg)):
+                print("%s: %s" % (arg, event))
+        except ValueError as err:
+            print("%s: %s" % (arg, err))
+            status = 1
+
+    return status
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
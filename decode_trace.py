@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+"""Decodes the trace records the dispenser prints among its debug output.
+
+Usage:
+    decode_trace.py [log file]
+    decode_trace.py --test
+
+Reads the serial log from the file or stdin and prints it with every trace
+line turned back into text. Other lines are passed through as they are. The
+record layout is documented in trace.h.
+"""
+
+import sys
+
+PREFIX = "#T"
+
+WATCHDOG_REASONS = [
+    "other",
+    "waiting for input",
+    "fed in main",
+    "blinking",
+    "calibrating",
+    "rotating",
+    "lora",
+]
+
+BUTTONS = ["BTN_0", "BTN_1", "BTN_2"]
+
+BUTTON_EVENTS = ["press", "release", "long press", "double press"]
+
+
+def name(names, index):
+    return names[index] if index < len(names) else "unknown %d" % index
+
+
+# Formats the arguments of each event, indexed by trace_event_t
+EVENTS = [
+    ("lost", lambda a0, a1: "%d records" % a0),
+    ("watchdog fed", lambda a0, a1: name(WATCHDOG_REASONS, a0)),
+    ("piezo hit", lambda a0, a1: "#%d" % a0),
+    ("opto edge", lambda a0, a1: "%s at step %.2f" %
+     ("blocked" if a0 else "clear", a1 / 256)),
+    ("motor done", lambda a0, a1: "%d steps, at step %d" % (a0, a1)),
+    ("button", lambda a0, a1: "%s %s" % (name(BUTTONS, a0),
+                                          name(BUTTON_EVENTS, a1))),
+]
+
+
+class Decoder:
+    """Turns trace lines into text, unwrapping their 32 bit timestamps."""
+
+    def __init__(self):
+        self.last_us = None
+        self.wraps = 0
+
+    def decode(self, line):
+        """Decodes a trace line. Raises ValueError if it is malformed."""
+        fields = line[len(PREFIX):].split()
+        if len(fields) != 4:
+            raise ValueError("expected 4 fields, got %d" % len(fields))
+
+        time_us, event, arg0, arg1 = (int(field, 16) for field in fields)
+        if event >= len(EVENTS):
+            raise ValueError("unknown event %d" % event)
+
+        if self.last_us is not None and time_us < self.last_us:
+            self.wraps += 1
+        self.last_us = time_us
+        time_us += self.wraps << 32
+
+        label, describe = EVENTS[event]
+        return "[%12.6f] %s: %s" % (time_us / 1e6, label, describe(arg0, arg1))
+
+    def feed(self, line):
+        """Decodes a line of the log if it is a trace line."""
+        if not line.startswith(PREFIX):
+            return line
+
+        try:
+            return self.decode(line)
+        except ValueError as err:
+            return "%s (%s)" % (line, err)
+
+
+# Log lines and what they decode to
+TEST_VECTORS = [
+    ("Serial port initialized", "Serial port initialized"),
+    ("#T000f4240 01 00000005 00000000",
+     "[    1.000000] watchdog fed: rotating"),
+    ("#T000f4a10 03 00000001 00001280",
+     "[    1.002000] opto edge: blocked at step 18.50"),
+    ("#T000f51e0 04 00000104 00000412",
+     "[    1.004000] motor done: 260 steps, at step 1042"),
+    ("#T000f59b0 02 00000003 00000000", "[    1.006000] piezo hit: #3"),
+    ("#T000f6180 05 00000000 00000003",
+     "[    1.008000] button: BTN_0 double press"),
+    ("#T000f6950 00 00000007 00000000", "[    1.010000] lost: 7 records"),
+    # The timestamp wrapped around
+    ("#T00000010 01 00000001 00000000",
+     "[ 4294.967312] watchdog fed: waiting for input"),
+    ("#T00000020 09 00000000 00000000",
+     "#T00000020 09 00000000 00000000 (unknown event 9)"),
+    ("#T00000030 01", "#T00000030 01 (expected 4 fields, got 2)"),
+]
+
+
+def self_test():
+    decoder = Decoder()
+    failures = 0
+
+    for line, expected in TEST_VECTORS:
+        got = decoder.feed(line)
+        if got != expected:
+            print("FAIL %s: got %r, expected %r" % (line, got, expected))
+            failures += 1
+
+    total = len(TEST_VECTORS)
+    print("%d/%d vectors passed" % (total - failures, total))
+    return failures == 0
+
+
+def main(args):
+    if args == ["--test"]:
+        return 0 if self_test() else 1
+
+    if len(args) > 1:
+        print(__doc__.strip())
+        return 1
+
+    log = open(args[0], errors="replace") if args else sys.stdin
+    decoder = Decoder()
+    for line in log:
+        print(decoder.feed(line.rstrip("\r\n")), flush=True)
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
@@ -1,79 +1,407 @@
 #include "eeprom.h"
 #include "debug.h"
+#include "hal.h"
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+
+#define EEPROM_ADDR_BYTES 2
+
+#define EEPROM_WRITE_TIMEOUT_US (2 * EEPROM_WRITE_SLEEP_MS * 1000)
+
+/// Nominal write cycle time, after which the first ACK poll is made, and the
+/// time between polls after that. Polling back to back would interrupt the
+/// CPU for every NACK
+#define EEPROM_WRITE_CYCLE_US (5 * 1000)
+#define EEPROM_POLL_INTERVAL_US 500
+
+typedef enum {
+    EEPROM_OP_READ,
+    EEPROM_OP_WRITE,
+} eeprom_op_t;
+
+typedef struct {
+    eeprom_op_t op;
+    uint16_t addr;
+    size_t len;
+    uint8_t* read_buf;
+    uint8_t write_buf[EEPROM_PAGE_SIZE];
+    eeprom_callback_t callback;
+    void* user_data;
+} eeprom_queued_t;
+
+typedef enum {
+    /// Nothing on the bus
+    EEPROM_PHASE_IDLE,
+    /// Sending the address and data of a write, or reading data
+    EEPROM_PHASE_TRANSFER,
+    /// Waiting for the write cycle to finish by polling for an ACK
+    EEPROM_PHASE_POLL,
+} eeprom_phase_t;
+
+/// Queues a request. Returns false if the queue is full
+static bool eeprom_enqueue(const eeprom_queued_t* queued,
+                           eeprom_request_t* request);
+
+/// Starts the request at the tail of the queue, if there is one
+static void eeprom_start_next(void);
+
+/// Starts transferring the current write chunk or read
+static void eeprom_start_transfer(void);
+
+/// Starts a single ACK poll
+static void eeprom_start_poll(void);
+
+/// Makes the next ACK poll in `delay_us` microseconds
+static void eeprom_schedule_poll(uint64_t delay_us);
+
+/// Starts the ACK poll scheduled by eeprom_schedule_poll(). Runs in interrupt
+/// context
+static int64_t eeprom_poll_alarm_callback(hal_alarm_id_t id, void* user_data);
+
+/// Finishes the current request and moves on to the next
+static void eeprom_finish(bool success);
+
+/// Advances the current request once a transfer has ended. Runs in interrupt
+/// context
+static void eeprom_transfer_done(bool success);
+
+/// Records the result of a request waited on synchronously
+static void eeprom_sync_callback(bool success, void* user_data);
+
+/// Waits for a request queued with eeprom_sync_callback to finish
+static bool eeprom_sync_wait(volatile int8_t* result);
 
 static bool eeprom_initialized = false;
 
+/// Requests between tail and head are queued, with the one at tail running.
+/// Head is only written by the submitting side, tail only by the IRQ
+static eeprom_queued_t eeprom_queue[EEPROM_QUEUE_SIZE];
+volatile static uint32_t eeprom_queue_head = 0;
+volatile static uint32_t eeprom_queue_tail = 0;
+
+static eeprom_phase_t eeprom_phase = EEPROM_PHASE_IDLE;
+/// Bytes of the current write that have been written, or 0 while reading
+static size_t eeprom_done;
+/// Length of the current write chunk or read
+static size_t eeprom_chunk;
+static uint64_t eeprom_deadline;
+
+/// Address and data of the current transfer, and the byte read by ACK polls
+static uint8_t eeprom_tx[EEPROM_ADDR_BYTES + EEPROM_PAGE_SIZE];
+static uint8_t eeprom_poll_byte;
+
 void init_eeprom() {
     if (!eeprom_initialized) {
-        i2c_init(EEPROM_I2C, EEPROM_BAUD_RATE);
-        gpio_set_function(EEPROM_I2C_SDA_PIN, GPIO_FUNC_I2C);
-        gpio_set_function(EEPROM_I2C_SCL_PIN, GPIO_FUNC_I2C);
-        gpio_pull_up(EEPROM_I2C_SDA_PIN);
-        gpio_pull_up(EEPROM_I2C_SCL_PIN);
+        hal_i2c_init(EEPROM_BAUD_RATE, EEPROM_I2C_SDA_PIN, EEPROM_I2C_SCL_PIN,
+                     EEPROM_DEVICE_ADDR);
 
         eeprom_initialized = true;
     }
 }
 
+static bool eeprom_enqueue(const eeprom_queued_t* queued,
+                           eeprom_request_t* request) {
+    uint32_t irq_state;
+    uint32_t head;
+
+    irq_state = hal_irq_disable();
+
+    head = eeprom_queue_head;
+    if (head - eeprom_queue_tail >= EEPROM_QUEUE_SIZE) {
+        hal_irq_restore(irq_state);
+        return false;
+    }
+
+    eeprom_queue[head % EEPROM_QUEUE_SIZE] = *queued;
+    eeprom_queue_head = head + 1;
+    if (request != NULL) {
+        *request = head;
+    }
+
+    if (eeprom_phase == EEPROM_PHASE_IDLE) {
+        eeprom_start_next();
+    }
+
+    hal_irq_restore(irq_state);
+    return true;
+}
+
+static void eeprom_start_next() {
+    eeprom_queued_t* current;
+
+    if (eeprom_queue_tail == eeprom_queue_head) {
+        eeprom_phase = EEPROM_PHASE_IDLE;
+        return;
+    }
+
+    current = &eeprom_queue[eeprom_queue_tail % EEPROM_QUEUE_SIZE];
+    eeprom_done = 0;
+    if (current->op == EEPROM_OP_WRITE) {
+        // Page writes wrap around within the page, so stop at its end
+        eeprom_chunk = EEPROM_PAGE_SIZE - (current->addr % EEPROM_PAGE_SIZE);
+        if (eeprom_chunk > current->len) {
+            eeprom_chunk = current->len;
+        }
+    } else {
+        eeprom_chunk = current->len;
+    }
+
+    eeprom_start_transfer();
+}
+
+static void eeprom_start_transfer() {
+    eeprom_queued_t* current;
+    uint16_t addr;
+
+    current = &eeprom_queue[eeprom_queue_tail % EEPROM_QUEUE_SIZE];
+    addr = current->addr + eeprom_done;
+
+    eeprom_phase = EEPROM_PHASE_TRANSFER;
+    eeprom_tx[0] = (addr >> 8) & 0xff;
+    eeprom_tx[1] = addr & 0xff;
+
+    if (current->op == EEPROM_OP_WRITE) {
+        memcpy(&eeprom_tx[EEPROM_ADDR_BYTES], &current->write_buf[eeprom_done],
+               eeprom_chunk);
+        hal_i2c_transfer(eeprom_tx, EEPROM_ADDR_BYTES + eeprom_chunk, NULL, 0,
+                         eeprom_transfer_done);
+    } else {
+        hal_i2c_transfer(eeprom_tx, EEPROM_ADDR_BYTES, current->read_buf,
+                         eeprom_chunk, eeprom_transfer_done);
+    }
+}
+
+static void eeprom_start_poll() {
+    eeprom_phase = EEPROM_PHASE_POLL;
+
+    // The EEPROM does not acknowledge anything while it is busy writing, so
+    // polling is a single byte read that may get NACKed
+    hal_i2c_transfer(NULL, 0, &eeprom_poll_byte, 1, eeprom_transfer_done);
+}
+
+static void eeprom_schedule_poll(uint64_t delay_us) {
+    eeprom_phase = EEPROM_PHASE_POLL;
+
+    // Without an alarm to spare, poll right away rather than stall
+    if (hal_alarm_add(delay_us, eeprom_poll_alarm_callback, NULL) < 0) {
+        eeprom_start_poll();
+    }
+}
+
+static int64_t eeprom_poll_alarm_callback(hal_alarm_id_t id, void* user_data) {
+    eeprom_start_poll();
+    return 0;
+}
+
+static void eeprom_finish(bool success) {
+    eeprom_queued_t* current;
+
+    current = &eeprom_queue[eeprom_queue_tail % EEPROM_QUEUE_SIZE];
+    if (current->callback != NULL) {
+        current->callback(success, current->user_data);
+    }
+
+    ++eeprom_queue_tail;
+    eeprom_start_next();
+}
+
+static void eeprom_transfer_done(bool success) {
+    eeprom_queued_t* current;
+
+    current = &eeprom_queue[eeprom_queue_tail % EEPROM_QUEUE_SIZE];
+
+    if (eeprom_phase == EEPROM_PHASE_TRANSFER) {
+        if (!success || current->op == EEPROM_OP_READ) {
+            eeprom_finish(success);
+        } else {
+            eeprom_deadline = hal_time_us() + EEPROM_WRITE_TIMEOUT_US;
+            eeprom_schedule_poll(EEPROM_WRITE_CYCLE_US);
+        }
+    } else if (eeprom_phase == EEPROM_PHASE_POLL) {
+        if (!success) {
+            // Still writing
+            if (hal_time_us() > eeprom_deadline) {
+                eeprom_finish(false);
+            } else {
+                eeprom_schedule_poll(EEPROM_POLL_INTERVAL_US);
+            }
+            return;
+        }
+
+        eeprom_done += eeprom_chunk;
+        if (eeprom_done < current->len) {
+            eeprom_chunk = current->len - eeprom_done;
+            if (eeprom_chunk > EEPROM_PAGE_SIZE) {
+                eeprom_chunk = EEPROM_PAGE_SIZE;
+            }
+            eeprom_start_transfer();
+        } else {
+            eeprom_finish(true);
+        }
+    }
+}
+
+bool eeprom_read_async(uint16_t addr, uint8_t* buf, size_t len,
+                       eeprom_callback_t callback, void* user_data,
+                       eeprom_request_t* request) {
+    eeprom_queued_t queued;
+
+    if (len == 0) {
+        return false;
+    }
+
+    queued.op = EEPROM_OP_READ;
+    queued.addr = addr;
+    queued.len = len;
+    queued.read_buf = buf;
+    queued.callback = callback;
+    queued.user_data = user_data;
+
+    return eeprom_enqueue(&queued, request);
+}
+
+bool eeprom_write_async(uint16_t addr, const uint8_t* buf, size_t len,
+                        eeprom_callback_t callback, void* user_data,
+                        eeprom_request_t* request) {
+    eeprom_queued_t queued;
+
+    if (len == 0 || len > EEPROM_PAGE_SIZE) {
+        return false;
+    }
+
+    queued.op = EEPROM_OP_WRITE;
+    queued.addr = addr;
+    queued.len = len;
+    queued.read_buf = NULL;
+    memcpy(queued.write_buf, buf, len);
+    queued.callback = callback;
+    queued.user_data = user_data;
+
+    return eeprom_enqueue(&queued, request);
+}
+
+bool eeprom_request_done(eeprom_request_t request) {
+    return (int32_t)(eeprom_queue_tail - request) > 0;
+}
+
+bool eeprom_busy() { return eeprom_queue_tail != eeprom_queue_head; }
+
+static void eeprom_sync_callback(bool success, void* user_data) {
+    *(volatile int8_t*)user_data = success;
+}
+
+static bool eeprom_sync_wait(volatile int8_t* result) {
+    while (*result < 0) {
+        hal_tight_loop();
+    }
+
+    return *result;
+}
+
+bool eeprom_read(uint16_t addr, uint8_t* buf, size_t len) {
+    volatile int8_t result = -1;
+
+    if (len == 0) {
+        return true;
+    }
+
+    while (!eeprom_read_async(addr, buf, len, eeprom_sync_callback,
+                              (void*)&result, NULL)) {
+        hal_tight_loop();
+    }
+
+    if (!eeprom_sync_wait(&result)) {
+        LOG_ERROR("Encountered an error while reading from EEPROM\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool eeprom_write(uint16_t addr, const uint8_t* buf, size_t len) {
+    volatile int8_t result;
+    size_t chunk;
+
+    while (len > 0) {
+        chunk = EEPROM_PAGE_SIZE - (addr % EEPROM_PAGE_SIZE);
+        if (chunk > len) {
+            chunk = len;
+        }
+
+        result = -1;
+        while (!eeprom_write_async(addr, buf, chunk, eeprom_sync_callback,
+                                   (void*)&result, NULL)) {
+            hal_tight_loop();
+        }
+
+        if (!eeprom_sync_wait(&result)) {
+            LOG_ERROR("Encountered an error while writing to EEPROM\n");
+            return false;
+        }
+
+        addr += chunk;
+        buf += chunk;
+        len -= chunk;
+    }
+
+    return true;
+}
+
+uint16_t eeprom_crc16(const uint8_t* data, size_t len) {
+    uint16_t crc = 0xffff;
+
+    for (size_t i = 0; i < len; ++i) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (uint8_t bit = 0; bit < 8; ++bit) {
+            if (crc & 0x8000) {
+                crc = (crc << 1) ^ 0x1021;
+            } else {
+                crc <<= 1;
+            }
+        }
+    }
+
+    return crc;
+}
+
 int16_t eeprom_read_byte(uint16_t addr) {
     uint8_t response;
-    uint8_t msg[2] = {0};
-    msg[0] = (addr >> 8) & 0xff;
-    msg[1] = addr & 0xff;
 
-    if (i2c_write_blocking(EEPROM_I2C, EEPROM_DEVICE_ADDR, msg, 2, true) ==
-        PICO_ERROR_GENERIC) {
-        DBG("Encountered an error while sending a message to EEPROM\n");
+    if (!eeprom_read(addr, &response, 1)) {
         return -1;
     }
 
-    i2c_read_blocking(EEPROM_I2C, EEPROM_DEVICE_ADDR, &response, 1, false);
-
     return response;
 }
 
 int64_t eeprom_read_long(uint16_t addr) {
-    int16_t tmp;
-    uint32_t res = 0;
-    uint8_t bytes[4] __attribute__((aligned(4))) = {0};
-
-    for (uint8_t i = 0; i < 4; ++i) {
-        tmp = eeprom_read_byte(addr + i);
-        if (tmp == -1) {
-            return -1;
-        }
-        bytes[i] = (uint8_t)tmp;
+    uint32_t res;
+    uint8_t bytes[4] = {0};
+
+    if (!eeprom_read(addr, bytes, sizeof(bytes))) {
+        return -1;
     }
 
-    // Treat 4 element byte array as pointer to 4 byte int and deref
-    res = *((uint32_t*)bytes);
+    // Stored in the byte order of the Pico
+    memcpy(&res, bytes, sizeof(res));
 
     return res;
 }
 
 bool eeprom_write_byte(uint16_t addr, uint8_t byte) {
-    uint8_t msg[3] = {0};
-    msg[0] = (addr >> 8) & 0xff;
-    msg[1] = addr & 0xff;
-    msg[2] = byte;
-
-    DBG("Writing byte 0x%02x\n", byte);
-    if (i2c_write_blocking(EEPROM_I2C, EEPROM_DEVICE_ADDR, msg, 3, false) ==
-        PICO_ERROR_GENERIC) {
-        DBG("Encountered an error while writing to EEPROM\n");
-        return false;
-    }
-    sleep_ms(EEPROM_WRITE_SLEEP_MS);
+    LOG_DEBUG("Writing byte 0x%02x\n", byte);
+
+    return eeprom_write(addr, &byte, 1);
 }
 
 void eeprom_write_long(uint16_t addr, uint32_t unsigned_int) {
-    uint8_t* bytes = (uint8_t*)(&unsigned_int);
-
-    eeprom_write_byte(addr, bytes[0]);
-    eeprom_write_byte(addr + 1, bytes[1]);
-    eeprom_write_byte(addr + 2, bytes[2]);
-    eeprom_write_byte(addr + 3, bytes[3]);
+    eeprom_write(addr, (uint8_t*)(&unsigned_int), sizeof(unsigned_int));
 }
+
+#undef EEPROM_ADDR_BYTES
+#undef EEPROM_WRITE_TIMEOUT_US
+#undef EEPROM_WRITE_CYCLE_US
+#undef EEPROM_POLL_INTERVAL_US
@@ -2,36 +2,76 @@
 #define EEPROM_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-#include "pico/stdlib.h"
-#include "hardware/i2c.h"
-
+/// Longest time a write cycle may take according to the datasheet
 #define EEPROM_WRITE_SLEEP_MS 10
 #define EEPROM_PAGE_SIZE 64
 #define EEPROM_NUM_PAGES 512
 
 #define EEPROM_DEVICE_ADDR 0x50
 
-/// Is long, and therefore uses addresses 0x42, 0x43, 0x44 & 0x45
-#define EEPROM_STEPPER_TRANSACTION_REMAINING_STEPS_ADDRESS 0x42
+/// Settings block, a single page
+#define EEPROM_SETTINGS_ADDRESS 0x00
+
+/// Where the calibration was stored before the settings block. Is long, and
+/// therefore uses addresses 0x46, 0x47, 0x48 & 0x49
+#define EEPROM_LEGACY_STEPS_PER_REVOLUTION_ADDRESS 0x46
 
-/// Is long, and therefore uses addresses 0x46, 0x47, 0x48 & 0x49
-#define EEPROM_STEPPER_CACHED_STEPS_PER_REVOLUTION 0x46
+/// Pages before this one hold fixed addresses, the rest belong to the stepper
+/// journal
+#define EEPROM_JOURNAL_FIRST_PAGE 8
 
-#define EEPROM_STEPPER_TRANSACTION_ENABLED_ADDRESS 0x4a
-#define EEPROM_STEPPER_CURRENT_SLOT_ADDRESS 0x4b
+/// Long nothing else uses, for the benchmarks to write to. The last one
+/// before the journal
+#define EEPROM_SCRATCH_ADDRESS                                                 \
+    (EEPROM_JOURNAL_FIRST_PAGE * EEPROM_PAGE_SIZE - sizeof(uint32_t))
 
-#define EEPROM_I2C i2c0
+/// The 24LC256 supports 400 kHz fast mode at 2.5 V and above. Comment out for
+/// parts that only do standard mode
+#define EEPROM_FAST_MODE
 
+#ifdef EEPROM_FAST_MODE
+#define EEPROM_BAUD_RATE (400 * 1000)
+#else
 #define EEPROM_BAUD_RATE (100 * 1000)
+#endif
+
+/// Number of requests that can be queued at once
+#define EEPROM_QUEUE_SIZE 8
 
 #define EEPROM_I2C_SDA_PIN 16
 #define EEPROM_I2C_SCL_PIN 17
 
+/// Called when an asynchronous request has finished. Runs in interrupt context
+typedef void (*eeprom_callback_t)(bool success, void* user_data);
+
+/// Identifies a queued request
+typedef uint32_t eeprom_request_t;
+
 /// Initializes EEPROM
 void init_eeprom(void);
 
+/// Queues a read of `len` bytes into `buf`, which must stay valid until the
+/// request has finished. Returns false if the queue is full
+bool eeprom_read_async(uint16_t addr, uint8_t* buf, size_t len,
+                       eeprom_callback_t callback, void* user_data,
+                       eeprom_request_t* request);
+
+/// Queues a write of up to EEPROM_PAGE_SIZE bytes. The data is copied, so
+/// `buf` may be reused right away. Returns false if the queue is full or the
+/// write is too long
+bool eeprom_write_async(uint16_t addr, const uint8_t* buf, size_t len,
+                        eeprom_callback_t callback, void* user_data,
+                        eeprom_request_t* request);
+
+/// Checks whether a queued request has finished
+bool eeprom_request_done(eeprom_request_t request);
+
+/// Checks whether any requests are queued or running
+bool eeprom_busy(void);
+
 /// Reads a byte from the EEPROM
 int16_t eeprom_read_byte(uint16_t addr);
 
@@ -44,4 +84,17 @@ bool eeprom_write_byte(uint16_t addr, uint8_t byte);
 /// Writes a long to the EEPROM
 void eeprom_write_long(uint16_t addr, uint32_t unsigned_int);
 
+/// Reads `len` bytes starting from `addr` in a single sequential read and waits
+/// for it. Returns false on error
+bool eeprom_read(uint16_t addr, uint8_t* buf, size_t len);
+
+/// Writes `len` bytes starting from `addr`, using one page write per EEPROM
+/// page touched. Returns once the last write cycle has finished, or false on
+/// error
+bool eeprom_write(uint16_t addr, const uint8_t* buf, size_t len);
+
+/// Calculates the CRC-16/CCITT-FALSE checksum used to validate records stored
+/// on the EEPROM
+uint16_t eeprom_crc16(const uint8_t* data, size_t len);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,169 @@
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Everything the firmware needs from the hardware. hal_pico.c implements it
+/// with the Pico SDK, sim/hal_sim.c with simulated peripherals on a virtual
+/// clock. Interrupt context means a GPIO, alarm, UART, I2C or FIFO interrupt
+/// on the board, and a simulated event in the simulator
+
+/// GPIO edges to interrupt on. Same values as the SDK's GPIO_IRQ_EDGE_*
+#define HAL_GPIO_EDGE_FALL (1u << 2)
+#define HAL_GPIO_EDGE_RISE (1u << 3)
+
+/// Identifies a pending alarm, positive when valid
+typedef int32_t hal_alarm_id_t;
+
+/// Runs in interrupt context. Returning 0 ends the alarm, a positive value
+/// reschedules it that many microseconds after it was due and a negative one
+/// that many microseconds from now
+typedef int64_t (*hal_alarm_callback_t)(hal_alarm_id_t id, void* user_data);
+
+/// Runs in interrupt context with the edges that happened
+typedef void (*hal_gpio_handler_t)(uint32_t pin, uint32_t edges);
+
+/// Takes a word sent from the other core
+typedef void (*hal_word_handler_t)(uint32_t word);
+
+/// Runs in interrupt context once an I2C transfer has ended, with whether the
+/// device acknowledged all of it
+typedef void (*hal_i2c_callback_t)(bool success);
+
+typedef void (*hal_callback_t)(void);
+
+/// Initializes stdio and the shared lock. Called first thing in main
+void hal_init(void);
+
+/// Gets the time since boot in microseconds
+uint64_t hal_time_us(void);
+
+/// Blocks for the given time
+void hal_sleep_ms(uint32_t ms);
+
+/// Called in every iteration of a busy-wait loop
+void hal_tight_loop(void);
+
+/// Disables interrupts on the calling core and returns the previous state
+uint32_t hal_irq_disable(void);
+
+/// Restores the state returned by hal_irq_disable()
+void hal_irq_restore(uint32_t state);
+
+/// Sleeps until the next interrupt, which wakes it even if interrupts are
+/// disabled
+void hal_wait_for_interrupt(void);
+
+/// Makes everything written before it visible to the other core before
+/// anything written after it
+void hal_memory_barrier(void);
+
+/// Takes the lock shared by both cores and disables interrupts on the calling
+/// core. Returns the interrupt state to pass to hal_shared_unlock()
+uint32_t hal_shared_lock(void);
+
+/// Releases the lock taken with hal_shared_lock()
+void hal_shared_unlock(uint32_t state);
+
+/// Initializes a pin as an input pulled up
+void hal_gpio_init_input(uint32_t pin);
+
+/// Initializes the pins in `mask` as outputs driven low and pulled down
+void hal_gpio_init_outputs(uint32_t mask);
+
+/// Reads the level of a pin
+bool hal_gpio_get(uint32_t pin);
+
+/// Drives the pins in `mask` to their levels in `value`
+void hal_gpio_put_masked(uint32_t mask, uint32_t value);
+
+/// Calls `handler` on the given edges of a pin. The interrupt is taken by the
+/// core that called this
+void hal_gpio_set_irq(uint32_t pin, uint32_t edges,
+                      hal_gpio_handler_t handler);
+
+/// Drives a pin from its PWM slice, counting from 0 to `wrap`
+void hal_pwm_init(uint32_t pin, uint16_t wrap, float clkdiv);
+
+/// Sets the level a PWM pin is high for in each period, from 0 to its wrap
+void hal_pwm_set_level(uint32_t pin, uint16_t level);
+
+/// Calls `callback` in `delay_us` microseconds on the calling core. Returns a
+/// negative value if no alarm could be added
+hal_alarm_id_t hal_alarm_add(uint64_t delay_us, hal_alarm_callback_t callback,
+                             void* user_data);
+
+/// Cancels an alarm added by the calling core. Returns false if it was not
+/// pending
+bool hal_alarm_cancel(hal_alarm_id_t id);
+
+/// Claims the deadline alarm, which calls `callback` in interrupt context
+/// once it is due
+void hal_deadline_init(hal_callback_t callback);
+
+/// Points the deadline alarm at a time in microseconds since boot. Returns
+/// true, without arming it, if the time has already passed
+bool hal_deadline_set(uint64_t time_us);
+
+/// Disarms the deadline alarm
+void hal_deadline_cancel(void);
+
+/// Starts core1, which runs `setup` and then `receiver` with every word core0
+/// sends it. Alarms added from core1 fire on core1
+void hal_core1_launch(hal_callback_t setup, hal_word_handler_t receiver);
+
+/// Sends a word to core1, waiting while its FIFO is full
+void hal_core1_send(uint32_t word);
+
+/// Calls `receiver` in interrupt context on core0 with every word core1 sends
+void hal_core0_set_receiver(hal_word_handler_t receiver);
+
+/// Sends a word from core1 to core0, waiting while its FIFO is full
+void hal_core0_send(uint32_t word);
+
+/// Initializes the UART the LoRa module is on, with no parity and the receive
+/// interrupt enabled. `irq_handler` runs whenever it interrupts
+void hal_uart_init(uint32_t baud, uint32_t tx_pin, uint32_t rx_pin,
+                   uint32_t data_bits, uint32_t stop_bits,
+                   hal_callback_t irq_handler);
+
+/// Enables or disables the receive and transmit interrupts of the UART
+void hal_uart_set_irqs(bool rx, bool tx);
+
+/// Checks whether a received character is waiting
+bool hal_uart_readable(void);
+
+/// Takes a received character. Only call when hal_uart_readable()
+char hal_uart_getc(void);
+
+/// Checks whether the transmit FIFO has room
+bool hal_uart_writable(void);
+
+/// Queues a character for transmission. Only call when hal_uart_writable()
+void hal_uart_putc(char c);
+
+/// Initializes the I2C bus the EEPROM is on, with `device_addr` as the only
+/// target
+void hal_i2c_init(uint32_t baud, uint32_t sda_pin, uint32_t scl_pin,
+                  uint8_t device_addr);
+
+/// Starts writing `tx_len` bytes and then reading `rx_len` bytes after a
+/// restart, ending with a stop. Either may be empty, but not both. The
+/// buffers must stay valid until `callback` runs, and only one transfer may be
+/// underway at a time. Transfers may be started from the callback
+void hal_i2c_transfer(const uint8_t* tx, size_t tx_len, uint8_t* rx,
+                      size_t rx_len, hal_i2c_callback_t callback);
+
+/// Starts the watchdog, which resets the board unless it is updated within
+/// `timeout_ms`
+void hal_watchdog_enable(uint32_t timeout_ms);
+
+/// Restarts the watchdog timeout
+void hal_watchdog_update(void);
+
+/// Checks whether the last reset was caused by the watchdog
+bool hal_watchdog_caused_reboot(void);
+
+#endif
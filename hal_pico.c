@@ -0,0 +1,388 @@
+#include "hal.h"
+
+#include "hardware/gpio.h"
+#include "hardware/i2c.h"
+#include "hardware/irq.h"
+#include "hardware/pwm.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+#include "hardware/uart.h"
+#include "hardware/watchdog.h"
+#include "pico/multicore.h"
+#include "pico/stdlib.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Peripherals the LoRa module and the EEPROM are wired to
+#define HAL_UART uart1
+#define HAL_UART_IRQ UART1_IRQ
+#define HAL_I2C i2c0
+#define HAL_I2C_IRQ I2C0_IRQ
+
+#define HAL_I2C_FIFO_DEPTH 16
+
+#define HAL_I2C_IRQ_MASK                                                       \
+    (I2C_IC_INTR_MASK_M_TX_EMPTY_BITS | I2C_IC_INTR_MASK_M_RX_FULL_BITS |      \
+     I2C_IC_INTR_MASK_M_STOP_DET_BITS | I2C_IC_INTR_MASK_M_TX_ABRT_BITS)
+
+/// Alarms core1 can have pending at once
+#define HAL_CORE1_ALARMS 4
+
+/// Dispatches GPIO interrupts of the calling core to the pin handlers
+static void hal_gpio_callback(uint gpio, uint32_t events);
+
+/// Calls the deadline callback once the hardware alarm has gone off
+static void hal_deadline_irq(uint alarm_num);
+
+/// Creates the core1 alarm pool and runs the core1 side until reset
+static void hal_core1_main(void);
+
+/// Passes every word core1 has sent to the core0 receiver
+static void hal_core0_fifo_irq(void);
+
+/// Gets the data_cmd value for the nth command of the current transfer
+static uint32_t hal_i2c_command(size_t n);
+
+/// Pushes as many commands of the current transfer to the TX FIFO as fit
+static void hal_i2c_fill_tx(void);
+
+/// Reads everything from the RX FIFO
+static void hal_i2c_drain_rx(void);
+
+/// I2C interrupt handler driving the current transfer
+static void hal_i2c_irq(void);
+
+static spin_lock_t* hal_lock;
+
+static hal_gpio_handler_t hal_gpio_handlers[NUM_BANK0_GPIOS];
+
+static hal_callback_t hal_deadline_callback;
+static uint hal_deadline_alarm;
+
+static alarm_pool_t* hal_core1_pool;
+static hal_callback_t hal_core1_setup;
+static hal_word_handler_t hal_core1_receiver;
+static hal_word_handler_t hal_core0_receiver;
+
+/// Transfer underway. Commands pushed to the TX FIFO and bytes read from the
+/// RX FIFO are counted against the total
+static const uint8_t* hal_i2c_tx;
+static size_t hal_i2c_tx_len;
+static uint8_t* hal_i2c_rx;
+static size_t hal_i2c_rx_len;
+static hal_i2c_callback_t hal_i2c_callback;
+static size_t hal_i2c_sent;
+static size_t hal_i2c_received;
+static bool hal_i2c_aborted;
+
+void hal_init() {
+    stdio_init_all();
+
+    hal_lock = spin_lock_init(spin_lock_claim_unused(true));
+}
+
+uint64_t hal_time_us() { return time_us_64(); }
+
+void hal_sleep_ms(uint32_t ms) { sleep_ms(ms); }
+
+void hal_tight_loop() { tight_loop_contents(); }
+
+uint32_t hal_irq_disable() { return save_and_disable_interrupts(); }
+
+void hal_irq_restore(uint32_t state) { restore_interrupts(state); }
+
+void hal_wait_for_interrupt() { __wfi(); }
+
+void hal_memory_barrier() { __dmb(); }
+
+uint32_t hal_shared_lock() { return spin_lock_blocking(hal_lock); }
+
+void hal_shared_unlock(uint32_t state) { spin_unlock(hal_lock, state); }
+
+void hal_gpio_init_input(uint32_t pin) {
+    gpio_init(pin);
+    gpio_set_dir(pin, GPIO_IN);
+    gpio_pull_up(pin);
+}
+
+void hal_gpio_init_outputs(uint32_t mask) {
+    gpio_init_mask(mask);
+    gpio_set_dir_out_masked(mask);
+
+    for (uint pin = 0; pin < NUM_BANK0_GPIOS; ++pin) {
+        if (mask & (1u << pin)) {
+            gpio_pull_down(pin);
+        }
+    }
+}
+
+bool hal_gpio_get(uint32_t pin) { return gpio_get(pin); }
+
+void hal_gpio_put_masked(uint32_t mask, uint32_t value) {
+    gpio_put_masked(mask, value);
+}
+
+static void hal_gpio_callback(uint gpio, uint32_t events) {
+    if (hal_gpio_handlers[gpio] != NULL) {
+        hal_gpio_handlers[gpio](gpio, events);
+    }
+}
+
+void hal_gpio_set_irq(uint32_t pin, uint32_t edges,
+                      hal_gpio_handler_t handler) {
+    // The SDK keeps one callback per core and acknowledges the edges before
+    // calling it
+    hal_gpio_handlers[pin] = handler;
+    gpio_set_irq_enabled_with_callback(pin, edges, true, hal_gpio_callback);
+}
+
+void hal_pwm_init(uint32_t pin, uint16_t wrap, float clkdiv) {
+    pwm_config config = pwm_get_default_config();
+
+    pwm_config_set_clkdiv(&config, clkdiv);
+    pwm_config_set_wrap(&config, wrap);
+
+    gpio_set_function(pin, GPIO_FUNC_PWM);
+    pwm_set_gpio_level(pin, 0);
+    pwm_init(pwm_gpio_to_slice_num(pin), &config, true);
+}
+
+void hal_pwm_set_level(uint32_t pin, uint16_t level) {
+    pwm_set_gpio_level(pin, level);
+}
+
+hal_alarm_id_t hal_alarm_add(uint64_t delay_us, hal_alarm_callback_t callback,
+                             void* user_data) {
+    alarm_pool_t* pool;
+
+    pool = get_core_num() == 1 ? hal_core1_pool : alarm_pool_get_default();
+    return alarm_pool_add_alarm_in_us(pool, delay_us, callback, user_data,
+                                      true);
+}
+
+bool hal_alarm_cancel(hal_alarm_id_t id) {
+    alarm_pool_t* pool;
+
+    pool = get_core_num() == 1 ? hal_core1_pool : alarm_pool_get_default();
+    return alarm_pool_cancel_alarm(pool, id);
+}
+
+static void hal_deadline_irq(uint alarm_num) { hal_deadline_callback(); }
+
+void hal_deadline_init(hal_callback_t callback) {
+    hal_deadline_callback = callback;
+    hal_deadline_alarm = hardware_alarm_claim_unused(true);
+    hardware_alarm_set_callback(hal_deadline_alarm, hal_deadline_irq);
+}
+
+bool hal_deadline_set(uint64_t time_us) {
+    return hardware_alarm_set_target(hal_deadline_alarm,
+                                     from_us_since_boot(time_us));
+}
+
+void hal_deadline_cancel() { hardware_alarm_cancel(hal_deadline_alarm); }
+
+static void hal_core1_main() {
+    // Alarms fire on the core that created their pool
+    hal_core1_pool =
+        alarm_pool_create(hardware_alarm_claim_unused(true), HAL_CORE1_ALARMS);
+
+    hal_core1_setup();
+
+    // Sleeps in between words
+    while (true) {
+        hal_core1_receiver(multicore_fifo_pop_blocking());
+    }
+}
+
+void hal_core1_launch(hal_callback_t setup, hal_word_handler_t receiver) {
+    hal_core1_setup = setup;
+    hal_core1_receiver = receiver;
+
+    multicore_launch_core1(hal_core1_main);
+}
+
+void hal_core1_send(uint32_t word) { multicore_fifo_push_blocking(word); }
+
+static void hal_core0_fifo_irq() {
+    while (multicore_fifo_rvalid()) {
+        hal_core0_receiver(multicore_fifo_pop_blocking());
+    }
+
+    multicore_fifo_clear_irq();
+}
+
+void hal_core0_set_receiver(hal_word_handler_t receiver) {
+    hal_core0_receiver = receiver;
+
+    irq_set_exclusive_handler(SIO_IRQ_PROC0, hal_core0_fifo_irq);
+    irq_set_enabled(SIO_IRQ_PROC0, true);
+}
+
+void hal_core0_send(uint32_t word) { multicore_fifo_push_blocking(word); }
+
+void hal_uart_init(uint32_t baud, uint32_t tx_pin, uint32_t rx_pin,
+                   uint32_t data_bits, uint32_t stop_bits,
+                   hal_callback_t irq_handler) {
+    uart_init(HAL_UART, baud);
+
+    gpio_set_function(tx_pin, GPIO_FUNC_UART);
+    gpio_set_function(rx_pin, GPIO_FUNC_UART);
+    uart_set_format(HAL_UART, data_bits, stop_bits, UART_PARITY_NONE);
+
+    irq_set_exclusive_handler(HAL_UART_IRQ, irq_handler);
+    irq_set_enabled(HAL_UART_IRQ, true);
+    uart_set_irq_enables(HAL_UART, true, false);
+}
+
+void hal_uart_set_irqs(bool rx, bool tx) {
+    uart_set_irq_enables(HAL_UART, rx, tx);
+}
+
+bool hal_uart_readable() { return uart_is_readable(HAL_UART); }
+
+char hal_uart_getc() { return uart_getc(HAL_UART); }
+
+bool hal_uart_writable() { return uart_is_writable(HAL_UART); }
+
+void hal_uart_putc(char c) { uart_putc_raw(HAL_UART, c); }
+
+void hal_i2c_init(uint32_t baud, uint32_t sda_pin, uint32_t scl_pin,
+                  uint8_t device_addr) {
+    i2c_hw_t* hw = i2c_get_hw(HAL_I2C);
+
+    i2c_init(HAL_I2C, baud);
+    gpio_set_function(sda_pin, GPIO_FUNC_I2C);
+    gpio_set_function(scl_pin, GPIO_FUNC_I2C);
+    gpio_pull_up(sda_pin);
+    gpio_pull_up(scl_pin);
+
+    // Only one device on the bus, so the target address never changes. It
+    // can only be set while the block is disabled
+    hw->enable = 0;
+    hw->tar = device_addr;
+    hw->enable = 1;
+
+    // Interrupt as soon as a byte is received and when the TX FIFO is half
+    // empty
+    hw->rx_tl = 0;
+    hw->tx_tl = HAL_I2C_FIFO_DEPTH / 2;
+    hw->intr_mask = 0;
+
+    irq_set_exclusive_handler(HAL_I2C_IRQ, hal_i2c_irq);
+    irq_set_enabled(HAL_I2C_IRQ, true);
+}
+
+void hal_i2c_transfer(const uint8_t* tx, size_t tx_len, uint8_t* rx,
+                      size_t rx_len, hal_i2c_callback_t callback) {
+    hal_i2c_tx = tx;
+    hal_i2c_tx_len = tx_len;
+    hal_i2c_rx = rx;
+    hal_i2c_rx_len = rx_len;
+    hal_i2c_callback = callback;
+    hal_i2c_sent = 0;
+    hal_i2c_received = 0;
+    hal_i2c_aborted = false;
+
+    i2c_get_hw(HAL_I2C)->intr_mask = HAL_I2C_IRQ_MASK;
+    hal_i2c_fill_tx();
+}
+
+static uint32_t hal_i2c_command(size_t n) {
+    uint32_t cmd;
+
+    if (n < hal_i2c_tx_len) {
+        cmd = hal_i2c_tx[n];
+    } else {
+        cmd = I2C_IC_DATA_CMD_CMD_BITS;
+        if (n == hal_i2c_tx_len && hal_i2c_tx_len != 0) {
+            cmd |= I2C_IC_DATA_CMD_RESTART_BITS;
+        }
+    }
+
+    if (n == hal_i2c_tx_len + hal_i2c_rx_len - 1) {
+        cmd |= I2C_IC_DATA_CMD_STOP_BITS;
+    }
+
+    return cmd;
+}
+
+static void hal_i2c_fill_tx() {
+    i2c_hw_t* hw = i2c_get_hw(HAL_I2C);
+    size_t total = hal_i2c_tx_len + hal_i2c_rx_len;
+
+    while (hal_i2c_sent < total && hw->txflr < HAL_I2C_FIFO_DEPTH) {
+        // Every read command produces a byte, which must fit in the RX FIFO
+        if (hal_i2c_sent >= hal_i2c_tx_len &&
+            hal_i2c_sent - hal_i2c_tx_len - hal_i2c_received >=
+                HAL_I2C_FIFO_DEPTH) {
+            break;
+        }
+
+        hw->data_cmd = hal_i2c_command(hal_i2c_sent);
+        ++hal_i2c_sent;
+    }
+
+    if (hal_i2c_sent == total) {
+        hw->intr_mask = HAL_I2C_IRQ_MASK & ~I2C_IC_INTR_MASK_M_TX_EMPTY_BITS;
+    }
+}
+
+static void hal_i2c_drain_rx() {
+    i2c_hw_t* hw = i2c_get_hw(HAL_I2C);
+    uint8_t byte;
+
+    while (hw->rxflr > 0) {
+        byte = (uint8_t)hw->data_cmd;
+
+        if (hal_i2c_received < hal_i2c_rx_len) {
+            hal_i2c_rx[hal_i2c_received] = byte;
+        }
+        ++hal_i2c_received;
+    }
+}
+
+static void hal_i2c_irq() {
+    i2c_hw_t* hw = i2c_get_hw(HAL_I2C);
+    uint32_t status = hw->intr_stat;
+
+    // The hardware flushes both FIFOs and sends a STOP after an abort, so the
+    // transfer only ends once the STOP has been seen
+    if (status & I2C_IC_INTR_STAT_R_TX_ABRT_BITS) {
+        (void)hw->clr_tx_abrt;
+        hal_i2c_aborted = true;
+    }
+
+    hal_i2c_drain_rx();
+
+    if (!hal_i2c_aborted) {
+        hal_i2c_fill_tx();
+    }
+
+    if (status & I2C_IC_INTR_STAT_R_STOP_DET_BITS) {
+        (void)hw->clr_stop_det;
+
+        // Quiet until the callback starts the next transfer, if it does
+        hw->intr_mask = 0;
+        hal_i2c_callback(!hal_i2c_aborted &&
+                         hal_i2c_received == hal_i2c_rx_len);
+    }
+}
+
+void hal_watchdog_enable(uint32_t timeout_ms) {
+    watchdog_enable(timeout_ms, true);
+}
+
+void hal_watchdog_update() { watchdog_update(); }
+
+bool hal_watchdog_caused_reboot() { return watchdog_caused_reboot(); }
+
+#undef HAL_UART
+#undef HAL_UART_IRQ
+#undef HAL_I2C
+#undef HAL_I2C_IRQ
+#undef HAL_I2C_FIFO_DEPTH
+#undef HAL_I2C_IRQ_MASK
+#undef HAL_CORE1_ALARMS
@@ -0,0 +1,155 @@
+#include "journal.h"
+#include "debug.h"
+#include "eeprom.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define JOURNAL_RECORD_SIZE 16
+
+#define JOURNAL_START_ADDR (EEPROM_JOURNAL_FIRST_PAGE * EEPROM_PAGE_SIZE)
+#define JOURNAL_NUM_RECORDS                                                    \
+    ((EEPROM_NUM_PAGES - EEPROM_JOURNAL_FIRST_PAGE) * EEPROM_PAGE_SIZE /       \
+     JOURNAL_RECORD_SIZE)
+
+#define JOURNAL_FLAG_IN_TRANSACTION (1 << 0)
+
+/// Records never straddle a page, so each append is a single page write.
+/// Erased cells read as 0xff, which never passes the CRC
+typedef struct __attribute__((packed)) {
+    uint32_t seq;
+    uint32_t remaining_steps;
+    uint8_t slot;
+    uint8_t flags;
+    uint8_t reserved[4];
+    uint16_t crc;
+} journal_record_t;
+
+_Static_assert(sizeof(journal_record_t) == JOURNAL_RECORD_SIZE,
+               "Journal records must be JOURNAL_RECORD_SIZE bytes");
+_Static_assert(EEPROM_PAGE_SIZE % JOURNAL_RECORD_SIZE == 0,
+               "Journal records must not straddle EEPROM pages");
+
+/// Reads a record and checks its CRC. Returns false if it is not valid
+static bool journal_read(uint32_t idx, journal_record_t* record);
+
+/// Checks whether the record at idx was written in the same lap around the
+/// journal as the first one
+static bool journal_in_first_run(uint32_t idx, uint32_t first_seq);
+
+static bool journal_initialized = false;
+
+static bool journal_empty = true;
+static journal_record_t journal_newest;
+
+/// Index the next record is written to
+static uint32_t journal_head = 0;
+
+static bool journal_read(uint32_t idx, journal_record_t* record) {
+    if (!eeprom_read(JOURNAL_START_ADDR + idx * JOURNAL_RECORD_SIZE,
+                     (uint8_t*)record, sizeof(*record))) {
+        return false;
+    }
+
+    return record->crc ==
+           eeprom_crc16((uint8_t*)record, offsetof(journal_record_t, crc));
+}
+
+static bool journal_in_first_run(uint32_t idx, uint32_t first_seq) {
+    journal_record_t record;
+
+    return journal_read(idx, &record) && record.seq == first_seq + idx;
+}
+
+void init_journal() {
+    journal_record_t first;
+    uint32_t lo;
+    uint32_t hi;
+    uint32_t mid;
+
+    if (journal_initialized) {
+        return;
+    }
+
+    init_eeprom();
+
+    // Records are written in order and wrap around, so the ones with
+    // consecutive sequence numbers from the first record form a prefix that
+    // ends with the newest record. Binary search for its end instead of
+    // reading the whole journal
+    if (journal_read(0, &first)) {
+        lo = 0;
+        hi = JOURNAL_NUM_RECORDS;
+        while (hi - lo > 1) {
+            mid = lo + (hi - lo) / 2;
+            if (journal_in_first_run(mid, first.seq)) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+
+        journal_read(lo, &journal_newest);
+        journal_head = (lo + 1) % JOURNAL_NUM_RECORDS;
+        journal_empty = false;
+    } else if (journal_read(JOURNAL_NUM_RECORDS - 1, &journal_newest)) {
+        // Power was lost while wrapping around
+        journal_head = 0;
+        journal_empty = false;
+    } else {
+        journal_head = 0;
+        journal_empty = true;
+        journal_newest.seq = 0;
+    }
+
+    LOG_DEBUG("Journal head at %d, newest sequence number %d\n",
+              journal_head, journal_newest.seq);
+
+    journal_initialized = true;
+}
+
+bool journal_latest(journal_state_t* state) {
+    if (journal_empty) {
+        return false;
+    }
+
+    state->remaining_steps = journal_newest.remaining_steps;
+    state->slot = journal_newest.slot;
+    state->in_transaction =
+        journal_newest.flags & JOURNAL_FLAG_IN_TRANSACTION;
+
+    return true;
+}
+
+bool journal_append(const journal_state_t* state) {
+    journal_record_t record;
+
+    memset(&record, 0, sizeof(record));
+    record.seq = journal_empty ? 0 : journal_newest.seq + 1;
+    record.remaining_steps = state->remaining_steps;
+    record.slot = state->slot;
+    record.flags = state->in_transaction ? JOURNAL_FLAG_IN_TRANSACTION : 0;
+    record.crc =
+        eeprom_crc16((uint8_t*)&record, offsetof(journal_record_t, crc));
+
+    // Queued in the background so that journaling never holds up a move
+    if (!eeprom_write_async(
+            JOURNAL_START_ADDR + journal_head * JOURNAL_RECORD_SIZE,
+            (uint8_t*)&record, sizeof(record), NULL, NULL, NULL)) {
+        LOG_ERROR("EEPROM queue full, could not append to journal\n");
+        return false;
+    }
+
+    journal_newest = record;
+    journal_empty = false;
+    journal_head = (journal_head + 1) % JOURNAL_NUM_RECORDS;
+
+    return true;
+}
+
+#undef JOURNAL_RECORD_SIZE
+#undef JOURNAL_START_ADDR
+#undef JOURNAL_NUM_RECORDS
+#undef JOURNAL_FLAG_IN_TRANSACTION
@@ -0,0 +1,29 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/// How many steps a transaction may progress before its remaining step count
+/// is journaled again
+#define JOURNAL_STEP_INTERVAL 16
+
+typedef struct {
+    /// Steps left in the transaction
+    uint32_t remaining_steps;
+    /// Slot the transaction is moving to
+    uint8_t slot;
+    bool in_transaction;
+} journal_state_t;
+
+/// Initializes the journal and locates its newest record
+void init_journal(void);
+
+/// Gets the newest journaled state. Returns false if the journal is empty
+bool journal_latest(journal_state_t* state);
+
+/// Queues appending a state to the journal. Returns false if it could not be
+/// queued
+bool journal_append(const journal_state_t* state);
+
+#endif
@@ -1,79 +1,179 @@
-#include "hardware/gpio.h"
-#include "pico/stdlib.h"
-
 #include <stdbool.h>
+#include <stdint.h>
 
+#include "hal.h"
 #include "led.h"
+#include "timer.h"
+
+#define LED_COUNT 3
+
+/// Runs the PWM counter at about 120 kHz, well above any visible flicker
+#define LED_PWM_CLKDIV 4.0f
+
+typedef struct {
+    bool state;
+    led_pattern_t pattern;
+    timer_id_t timer;
+    /// Transition within the current period
+    uint32_t step;
+    /// Periods left, if the pattern does not repeat forever
+    uint32_t periods_left;
+    /// Whether the LED goes off for good once the timer fires
+    bool finishing;
+} led_status_t;
+
+/// Sets the PWM level of a LED
+static void led_set_level(led_t led, uint16_t level);
+
+/// Applies the current transition of the pattern and schedules the next
+static void led_pattern_apply(led_t led);
+
+/// Moves the pattern of a LED on to its next transition
+static void led_pattern_callback(timer_id_t id, void* user_data);
 
-static bool led_0_state = false;
-static bool led_1_state = false;
-static bool led_2_state = false;
+static const uint32_t led_pins[LED_COUNT] = {LED_0_PIN, LED_1_PIN, LED_2_PIN};
+
+static led_status_t led_status[LED_COUNT];
 
 static bool leds_initialized = false;
 
 void init_leds() {
     if (!leds_initialized) {
-        // Init gpio pins
-        gpio_init(LED_0_PIN);
-        gpio_init(LED_1_PIN);
-        gpio_init(LED_2_PIN);
-
-        // Configure LED pins as outputs
-        gpio_set_dir(LED_0_PIN, GPIO_OUT);
-        gpio_set_dir(LED_1_PIN, GPIO_OUT);
-        gpio_set_dir(LED_2_PIN, GPIO_OUT);
+        for (led_t led = LED_0; led <= LED_2; ++led) {
+            led_status[led].timer = TIMER_INVALID_ID;
 
-        // Pull LED pins down
-        gpio_pull_up(LED_0_PIN);
-        gpio_pull_up(LED_1_PIN);
-        gpio_pull_up(LED_2_PIN);
+            // LED pins are driven by their PWM slice, which keeps the
+            // brightness without help from the CPU
+            hal_pwm_init(led_pins[led], LED_PWM_WRAP, LED_PWM_CLKDIV);
+        }
 
         leds_initialized = true;
     } else {
-        gpio_put(LED_0_PIN, false);
-        gpio_put(LED_1_PIN, false);
-        gpio_put(LED_2_PIN, false);
-
-        led_0_state = false;
-        led_1_state = false;
-        led_2_state = false;
+        for (led_t led = LED_0; led <= LED_2; ++led) {
+            set_led_state(led, false);
+        }
     }
 }
 
+static void led_set_level(led_t led, uint16_t level) {
+    hal_pwm_set_level(led_pins[led], level);
+}
+
 void set_led_state(led_t led, bool state) {
-    switch (led) {
-    case LED_0:
-        led_0_state = state;
-        gpio_put(LED_0_PIN, led_0_state);
-        break;
+    if (led < LED_0 || led > LED_2) {
+        return;
+    }
 
-    case LED_1:
-        led_1_state = state;
-        gpio_put(LED_1_PIN, led_1_state);
-        break;
+    led_pattern_stop(led);
 
-    case LED_2:
-        led_2_state = state;
-        gpio_put(LED_0_PIN, led_2_state);
-        break;
-    }
+    led_status[led].state = state;
+    led_set_level(led, state ? LED_PWM_WRAP : 0);
 }
 
 void toggle_led_state(led_t led) {
-    switch (led) {
-    case LED_0:
-        led_0_state = !led_0_state;
-        gpio_put(LED_0_PIN, led_0_state);
+    if (led < LED_0 || led > LED_2) {
+        return;
+    }
+
+    set_led_state(led, !led_status[led].state);
+}
+
+void led_pattern_start(led_t led, const led_pattern_t* pattern) {
+    if (led < LED_0 || led > LED_2 || pattern->period_ms == 0) {
+        return;
+    }
+
+    led_pattern_stop(led);
+
+    led_status[led].pattern = *pattern;
+    led_status[led].step = 0;
+    led_status[led].periods_left = pattern->repeat;
+    led_status[led].finishing = false;
+
+    led_pattern_apply(led);
+}
+
+void led_pattern_stop(led_t led) {
+    if (led < LED_0 || led > LED_2) {
+        return;
+    }
+
+    timer_cancel(led_status[led].timer);
+    led_status[led].timer = TIMER_INVALID_ID;
+    led_status[led].finishing = false;
+
+    led_status[led].state = false;
+    led_set_level(led, 0);
+}
+
+bool led_pattern_running(led_t led) {
+    if (led < LED_0 || led > LED_2) {
+        return false;
+    }
+
+    return led_status[led].timer != TIMER_INVALID_ID;
+}
+
+static void led_pattern_apply(led_t led) {
+    led_status_t* status = &led_status[led];
+    uint64_t period_us = (uint64_t)status->pattern.period_ms * US_IN_MS;
+    uint64_t duration_us;
+    uint32_t steps;
+    uint32_t level;
+
+    switch (status->pattern.kind) {
+    case LED_PATTERN_BLINK:
+        steps = 2;
+        duration_us = period_us / 2;
+        level = status->step == 0 ? LED_PWM_WRAP : 0;
         break;
 
-    case LED_1:
-        led_1_state = !led_1_state;
-        gpio_put(LED_1_PIN, led_1_state);
+    case LED_PATTERN_PULSE:
+        steps = 2;
+        duration_us = period_us / LED_PULSE_FRACTION;
+        if (status->step != 0) {
+            duration_us = period_us - duration_us;
+        }
+        level = status->step == 0 ? LED_PWM_WRAP : 0;
         break;
 
-    case LED_2:
-        led_2_state = !led_2_state;
-        gpio_put(LED_0_PIN, led_2_state);
+    default:
+        steps = LED_BREATHE_STEPS;
+        duration_us = period_us / LED_BREATHE_STEPS;
+
+        // Triangle wave, squared so that the fade looks even to the eye
+        level = status->step < steps / 2 ? status->step : steps - status->step;
+        level = level * LED_PWM_WRAP / (steps / 2);
+        level = level * level / LED_PWM_WRAP;
         break;
     }
-}
\ No newline at end of file
+
+    status->state = level != 0;
+    led_set_level(led, level);
+
+    // The last period ends once its final transition has had its time
+    if (++status->step >= steps) {
+        status->step = 0;
+        status->finishing =
+            status->pattern.repeat != 0 && --status->periods_left == 0;
+    }
+
+    status->timer =
+        timer_add(duration_us, 0, led_pattern_callback, (void*)(uintptr_t)led);
+}
+
+static void led_pattern_callback(timer_id_t id, void* user_data) {
+    led_t led = (led_t)(uintptr_t)user_data;
+
+    led_status[led].timer = TIMER_INVALID_ID;
+
+    if (led_status[led].finishing) {
+        led_pattern_stop(led);
+        return;
+    }
+
+    led_pattern_apply(led);
+}
+
+#undef LED_COUNT
+#undef LED_PWM_CLKDIV
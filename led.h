@@ -1,6 +1,9 @@
 #ifndef LED_H
 #define LED_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
 /// Right LED
 #define LED_0_PIN 22
 
@@ -10,13 +13,38 @@
 /// Left LED
 #define LED_2_PIN 20
 
+/// PWM counts per period. Brightness goes from 0 up to this
+#define LED_PWM_WRAP 255
+
+/// Fraction of the period a pulse stays lit for
+#define LED_PULSE_FRACTION 8
+
+/// Brightness changes per period while breathing
+#define LED_BREATHE_STEPS 32
+
 typedef enum {
     LED_0,
     LED_1,
     LED_2,
 } led_t;
 
-/// Initializes board LEDs
+typedef enum {
+    /// Lit for the first half of the period
+    LED_PATTERN_BLINK,
+    /// Lit for the first 1/LED_PULSE_FRACTION of the period
+    LED_PATTERN_PULSE,
+    /// Fades in for the first half of the period and out for the second
+    LED_PATTERN_BREATHE,
+} led_pattern_kind_t;
+
+typedef struct {
+    led_pattern_kind_t kind;
+    uint32_t period_ms;
+    /// Number of periods to run for, or 0 to run until stopped
+    uint32_t repeat;
+} led_pattern_t;
+
+/// Initializes board LEDs, or turns them all off if already initialized
 void init_leds(void);
 
 /// Set LED state
@@ -25,4 +53,15 @@ void set_led_state(led_t led, bool state);
 /// Loggles a LED on or off
 void toggle_led_state(led_t led);
 
-#endif
\ No newline at end of file
+/// Runs a pattern on a LED in the background, replacing whatever it was
+/// doing. The LED is left off once the pattern has finished. The brightness
+/// is held by PWM and only changed from timer callbacks at each transition
+void led_pattern_start(led_t led, const led_pattern_t* pattern);
+
+/// Stops the pattern running on a LED and turns it off
+void led_pattern_stop(led_t led);
+
+/// Checks whether a pattern is running on a LED
+bool led_pattern_running(led_t led);
+
+#endif
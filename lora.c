@@ -1,210 +1,859 @@
 #include "lora.h"
 #include "debug.h"
+#include "eeprom.h"
+#include "hal.h"
+#include "settings.h"
 #include "watchdog.h"
 
 #include <stdbool.h>
 #include <stddef.h>
-#include <stdlib.h>
 #include <string.h>
 
-#include "pico/stdlib.h"
-
 // #define LORA_TRACE_RESPONSE
 
-/// Sends a command with optional data to the LoRa module
-static void lora_send_command(uart_inst_t* uart, char* cmd, char* data);
+#define US_PER_S (1000 * 1000)
+
+/// LoRaWAN header, port and MIC added to every application payload
+#define LORA_FRAME_OVERHEAD_BYTES 13
+#define LORA_PREAMBLE_SYMBOLS 8
+#define LORA_SYMBOL_US                                                         \
+    ((1u << LORA_SPREADING_FACTOR) * (US_PER_S / LORA_BANDWIDTH_HZ))
+
+/// How long the UART takes for one character, with its start and stop bits
+#define LORA_CHAR_US (10 * US_PER_S / LORA_BAUD_RATE + 1)
+
+/// Everything the configuration commands set, to tell when it changes
+#define LORA_CONFIG_SIGNATURE                                                  \
+    LORA_MODE_DATA "," LORA_APPKEY_DATA "," LORA_CLASS_DATA "," LORA_PORT_DATA
+
+typedef struct {
+    const char* prefix;
+    const char* data;
+} lora_config_step_t;
+
+typedef struct {
+    char msg[LORA_MAX_MESSAGE_BYTES];
+    /// Whether `msg` holds a hex encoded binary payload
+    bool hex;
+    lora_priority_t priority;
+} lora_queued_t;
+
+/// Waits for the response line of a command, dispatching any other lines that
+/// arrive meanwhile. Returns true if the payload matches `expected`, or if any
+/// response arrived when `expected` is NULL, and false on mismatch or timeout
+static bool lora_expect_response(const char* cmd, const char* expected);
+
+/// Moves received characters from the UART FIFO into the ring buffer and
+/// feeds the line being transmitted into the TX FIFO
+static void lora_uart_irq_handler(void);
+
+/// Pushes as much of the line being transmitted into the TX FIFO as fits
+static void lora_fill_tx(void);
+
+/// Waits for the previous line to go out and starts building a new one in the
+/// TX buffer
+static void lora_line_begin(void);
+
+/// Appends a string to the line being built, truncating it once full
+static void lora_line_append(const char* str);
+
+/// Appends a message in quotes, replacing characters that would end the
+/// command or the quoted string early
+static void lora_line_append_quoted(const char* msg);
+
+/// Starts transmitting the line being built in the background
+static void lora_line_send(void);
+
+/// Starts transmitting a line in the background, waiting for the previous one
+/// to finish first
+static void lora_write(const char* line);
+
+/// Sends a queued message, text with the MSG command and hex payloads with
+/// the MSGHEX command
+static void lora_transmit_message(const lora_queued_t* queued);
+
+/// Estimates the time on air of an uplink with the given payload size
+static uint32_t lora_airtime_us(size_t len);
+
+/// Estimates the time on air of a queued message
+static uint32_t lora_queued_airtime_us(const lora_queued_t* queued);
+
+/// Adds the airtime budget earned since the last call. The budget is kept in
+/// 1/1000 us so that short intervals add up exactly
+static void lora_refill_airtime(void);
+
+/// Adds a message to the uplink queue, see lora_send_message()
+static bool lora_enqueue(const char* msg, bool hex, lora_priority_t priority);
+
+/// Sends the next queued message once the module is done with the last one
+static void lora_service_queue(void);
+
+/// Tracks when the module has finished sending a message
+static void lora_msg_handler(const char* payload);
+
+/// Sends the next configuration command, the join request or a retry when it
+/// is due
+static void lora_service_join(void);
+
+/// Starts configuring the module if its configuration changed, or else joins
+/// right away. With `warm` set, a session saved before a watchdog reset is
+/// reused without joining again
+static void lora_join_begin(bool warm);
+
+/// Sends the join request
+static void lora_join_request(void);
+
+/// Marks the module as joined
+static void lora_join_succeeded(void);
+
+/// Schedules a retry with exponential backoff and forgets the saved state
+/// that led to the failure
+static void lora_join_failed(uint8_t forget);
+
+/// Advances the configuration on responses to its commands
+static void lora_config_handler(const char* payload);
 
-/// Tries to listen to a response from the LoRa module. Returns true if the
-/// response matches and false if the response differed or timed out
-static bool lora_expect_response(uart_inst_t* uart, char* expected);
+/// Tracks the outcome of the join request
+static void lora_join_handler(const char* payload);
+
+/// Saves the module state if it changed
+static void lora_save_state(uint8_t state);
+
+/// Splits a complete line into command and payload and dispatches it
+static void lora_dispatch_line(char* line);
 
 /// Checks if the LoRa module is connected
-static bool lora_check_presence(uart_inst_t* uart);
+static bool lora_check_presence(void);
 
 static bool lora_initialized = false;
 static bool lora_present = false;
-static bool lora_connected = false;
-
-static void lora_send_command(uart_inst_t* uart, char* cmd, char* data) {
-    size_t base_len;
-    size_t cmd_len;
-    size_t data_len;
-    size_t data_sep_len;
-    char* msg;
-
-    if (cmd != NULL) {
-        base_len = strlen(LORA_COMMAND_BASE);
-        cmd_len = strlen(cmd);
-
-        if (data == NULL) {
-            data_len = 0;
-            data_sep_len = 0;
-            msg = malloc(LORA_MIN_COMMAND_BYTES + cmd_len);
-        } else {
-            data_len = strlen(data);
-            data_sep_len = strlen(LORA_DATA_SEPARATOR);
-            msg = malloc(LORA_MIN_COMMAND_BYTES + LORA_MIN_DATA_BYTES +
-                         cmd_len + data_len);
-        }
-        if (msg == NULL) {
-            DBG("Failed to allocate memory for message\n");
-            return;
-        }
 
-        memcpy(msg, LORA_COMMAND_BASE, base_len);
-        memcpy(msg + base_len, data, data_len);
-        memcpy(msg + base_len + cmd_len, LORA_DATA_SEPARATOR, data_sep_len);
-        if (data != NULL) {
-            memcpy(msg + base_len + cmd_len + data_sep_len, data, data_len);
-        }
-        memcpy(msg + base_len + cmd_len + data_sep_len + data_len,
-               LORA_COMMAND_SEPARATOR "\0", strlen(LORA_COMMAND_SEPARATOR) + 1);
+typedef struct {
+    const char* cmd;
+    lora_handler_t handler;
+} lora_handler_entry_t;
+
+static lora_handler_entry_t lora_handlers[LORA_MAX_HANDLERS];
+static size_t lora_num_handlers = 0;
+
+/// Single producer (UART IRQ), single consumer ring of received characters
+static char lora_rx_buf[LORA_RX_BUFFER_SIZE];
+volatile static uint32_t lora_rx_head = 0;
+volatile static uint32_t lora_rx_tail = 0;
+volatile static uint32_t lora_rx_overflows = 0;
+static lora_line_callback_t lora_line_callback = NULL;
+
+/// Line being assembled by the parser
+static char lora_line[LORA_LINE_MAX_BYTES];
+static size_t lora_line_len = 0;
+
+/// Line being transmitted by the UART IRQ. Commands are built straight into
+/// it once the previous line has gone out
+static char lora_tx_line[LORA_TX_LINE_BYTES];
+volatile static size_t lora_tx_len = 0;
+volatile static size_t lora_tx_pos = 0;
+static size_t lora_tx_build_len = 0;
+
+/// Messages waiting to be sent, oldest first
+static lora_queued_t lora_tx_queue[LORA_TX_QUEUE_SIZE];
+static size_t lora_tx_queue_len = 0;
+static lora_stats_t lora_stats;
+
+/// Whether the module is still busy sending a message, and until when to
+/// wait for it at most
+static bool lora_msg_in_flight = false;
+static uint64_t lora_msg_deadline;
+
+/// Commands that configure the module before joining, in order
+static const lora_config_step_t lora_config_steps[] = {
+    {LORA_COMMAND(LORA_COMMAND_MODE), LORA_MODE_DATA},
+    {LORA_COMMAND(LORA_COMMAND_APPKEY), LORA_APPKEY_DATA},
+    {LORA_COMMAND(LORA_COMMAND_CLASS), LORA_CLASS_DATA},
+    {LORA_COMMAND(LORA_COMMAND_PORT), LORA_PORT_DATA},
+};
+
+#define LORA_NUM_CONFIG_STEPS                                                  \
+    (sizeof(lora_config_steps) / sizeof(lora_config_steps[0]))
+
+/// Join state machine. The deadline is that of the outstanding command while
+/// configuring or joining, and the end of the wait while backing off
+static lora_join_state_t lora_join = LORA_JOIN_IDLE;
+static size_t lora_config_step;
+static bool lora_config_sent;
+static uint64_t lora_join_deadline;
+static uint64_t lora_join_backoff_us = LORA_JOIN_BACKOFF_MIN_US;
+static uint16_t lora_config_crc;
+
+/// Token bucket of airtime, see lora_refill_airtime()
+static uint64_t lora_airtime_budget;
+static uint64_t lora_airtime_max_budget;
+static uint64_t lora_airtime_refilled_us;
+static bool lora_throttled = false;
+
+/// Command lora_expect_response() is waiting for, and what it got
+static const char* lora_waiting_cmd = NULL;
+static bool lora_waiting_matched;
+static bool lora_waiting_received;
+static const char* lora_waiting_expected;
+
+void lora_send_command(const char* prefix, const char* data) {
+    lora_line_begin();
+    lora_line_append(prefix);
+    if (data != NULL) {
+        lora_line_append(LORA_DATA_SEPARATOR);
+        lora_line_append(data);
+    }
+    lora_line_append(LORA_COMMAND_SEPARATOR);
+    lora_line_send();
+
+    LOG_DEBUG("Sent command: '%s'", prefix);
+    if (data == NULL) {
+        LOG_DEBUG("\n");
+    } else {
+        LOG_DEBUG(" with data: '%s'\n", data);
+    }
+}
 
-        uart_puts(uart, msg);
+static void lora_line_begin() {
+    while (lora_tx_pos < lora_tx_len) {
+        hal_tight_loop();
+    }
 
-        free(msg);
+    lora_tx_build_len = 0;
+}
+
+static void lora_line_append(const char* str) {
+    while (*str != '\0' && lora_tx_build_len < LORA_TX_LINE_BYTES - 1) {
+        lora_tx_line[lora_tx_build_len++] = *str++;
+    }
+}
 
-        DBG("Sent command: '%s'", cmd);
-        if (data == NULL) {
-            DBG("\n");
+static void lora_line_append_quoted(const char* msg) {
+    // Leave room for the closing quote, the command separator and the
+    // terminator
+    const size_t end = LORA_TX_LINE_BYTES - sizeof("\"" LORA_COMMAND_SEPARATOR);
+
+    lora_line_append("\"");
+    while (*msg != '\0' && lora_tx_build_len < end) {
+        if (*msg == '\n' || *msg == '\r' || *msg == '"') {
+            lora_tx_line[lora_tx_build_len++] = '?';
         } else {
-            DBG(" with data: '%s'\n", data);
+            lora_tx_line[lora_tx_build_len++] = *msg;
         }
+        ++msg;
     }
+    lora_line_append("\"");
+}
+
+static void lora_line_send() {
+    uint32_t irq_state;
+
+    lora_tx_line[lora_tx_build_len] = '\0';
+
+    irq_state = hal_irq_disable();
+    lora_tx_len = lora_tx_build_len;
+    lora_tx_pos = 0;
+    lora_fill_tx();
+    hal_irq_restore(irq_state);
+}
+
+static void lora_write(const char* line) {
+    lora_line_begin();
+    lora_line_append(line);
+    lora_line_send();
 }
 
-static bool lora_expect_response(uart_inst_t* uart, char* expected) {
-    bool match;
+static void lora_fill_tx() {
+    while (lora_tx_pos < lora_tx_len && hal_uart_writable()) {
+        hal_uart_putc(lora_tx_line[lora_tx_pos]);
+        ++lora_tx_pos;
+    }
+
+    // The TX interrupt only fires when the FIFO drains past its threshold, so
+    // it is only needed while there is something left to send
+    hal_uart_set_irqs(true, lora_tx_pos < lora_tx_len);
+}
+
+static void lora_uart_irq_handler() {
+    uint32_t head;
     char current;
+    bool line_ended = false;
 
-    match = true;
+    lora_fill_tx();
 
-    for (size_t i = 0; expected[i] != '\0'; ++i) {
-        if (!uart_is_readable_within_us(uart, LORA_TIMEOUT_US)) {
-            return false;
+    while (hal_uart_readable()) {
+        current = hal_uart_getc();
+        line_ended |= current == '\n';
+
+        head = lora_rx_head;
+        if (head - lora_rx_tail >= LORA_RX_BUFFER_SIZE) {
+            // Drop the character, but keep the FIFO draining
+            ++lora_rx_overflows;
+            continue;
         }
-        feed_watchdog(WATCHDOG_FEED_LORA);
 
-        current = uart_getc(uart);
+        lora_rx_buf[head % LORA_RX_BUFFER_SIZE] = current;
+        lora_rx_head = head + 1;
+    }
+
+    if (line_ended && lora_line_callback != NULL) {
+        lora_line_callback();
+    }
+}
+
+void lora_set_line_callback(lora_line_callback_t callback) {
+    lora_line_callback = callback;
+}
+
+static void lora_dispatch_line(char* line) {
+    char* payload;
+
 #ifdef LORA_TRACE_RESPONSE
-        DBG("Received: '%c'\n", current);
+    LOG_DEBUG("Received: '%s'\n", line);
 #endif
 
-        if (current != expected[i]) {
-            match = false;
+    // Only "+CMD: payload" lines are responses, anything else is echo or
+    // noise
+    if (strncmp(line, LORA_RESPONSE_START, strlen(LORA_RESPONSE_START)) != 0) {
+        return;
+    }
+    line += strlen(LORA_RESPONSE_START);
+
+    payload = strstr(line, LORA_RESPONSE_DATA_SEPARATOR);
+    if (payload == NULL) {
+        return;
+    }
+    *payload = '\0';
+    payload += strlen(LORA_RESPONSE_DATA_SEPARATOR);
+
+    if (lora_waiting_cmd != NULL && strcmp(line, lora_waiting_cmd) == 0) {
+        lora_waiting_received = true;
+        lora_waiting_matched = lora_waiting_expected == NULL ||
+                               strcmp(payload, lora_waiting_expected) == 0;
+    }
+
+    for (size_t i = 0; i < lora_num_handlers; ++i) {
+        if (strcmp(line, lora_handlers[i].cmd) == 0) {
+            lora_handlers[i].handler(payload);
         }
+    }
+}
 
-        if (current == '\0') {
-            return expected[i] == '\0';
-        } else if (expected[i] == '\0') {
-            while (uart_is_readable_within_us(uart, LORA_TIMEOUT_US)) {
-                current = uart_getc(uart);
-#ifdef LORA_TRACE_RESPONSE
-                DBG("Received: '%c'\n", current);
-#endif
+void lora_poll() {
+    uint32_t tail;
+    char current;
+
+    lora_service_join();
+    lora_service_queue();
+
+    tail = lora_rx_tail;
+    while (tail != lora_rx_head) {
+        current = lora_rx_buf[tail % LORA_RX_BUFFER_SIZE];
+        ++tail;
+        lora_rx_tail = tail;
+
+        if (current == '\n') {
+            // Strip the '\r' of LORA_RESPONSE_END
+            if (lora_line_len > 0 && lora_line[lora_line_len - 1] == '\r') {
+                --lora_line_len;
             }
+            lora_line[lora_line_len] = '\0';
+            lora_line_len = 0;
+
+            lora_dispatch_line(lora_line);
+            lora_service_join();
+            lora_service_queue();
+        } else if (current != '\0' && lora_line_len < LORA_LINE_MAX_BYTES - 1) {
+            lora_line[lora_line_len] = current;
+            ++lora_line_len;
         }
     }
+}
+
+bool lora_register_handler(const char* cmd, lora_handler_t handler) {
+    if (lora_num_handlers >= LORA_MAX_HANDLERS) {
+        return false;
+    }
 
-    match = match && current != '\0';
+    lora_handlers[lora_num_handlers].cmd = cmd;
+    lora_handlers[lora_num_handlers].handler = handler;
+    ++lora_num_handlers;
 
-    return match;
+    return true;
 }
 
-static bool lora_check_presence(uart_inst_t* uart) {
+static bool lora_expect_response(const char* cmd, const char* expected) {
+    uint64_t deadline;
+
+    lora_waiting_cmd = cmd;
+    lora_waiting_expected = expected;
+    lora_waiting_received = false;
+    lora_waiting_matched = false;
+
+    deadline = hal_time_us() + LORA_TIMEOUT_US;
+    while (!lora_waiting_received && hal_time_us() < deadline) {
+        lora_poll();
+        hal_tight_loop();
+    }
+    feed_watchdog(WATCHDOG_FEED_LORA);
+
+    lora_waiting_cmd = NULL;
+
+    if (lora_rx_overflows != 0) {
+        LOG_WARN("Dropped %d characters from the LoRa module\n",
+                 lora_rx_overflows);
+        lora_rx_overflows = 0;
+    }
+
+    return lora_waiting_matched;
+}
+
+static bool lora_check_presence() {
     if (lora_present && lora_initialized) {
         return true;
     }
 
-    uart_puts(uart, LORA_BASIC_COMMAND LORA_COMMAND_SEPARATOR);
+    lora_write(LORA_BASIC_COMMAND LORA_COMMAND_SEPARATOR);
 
-    return lora_expect_response(uart, LORA_RESPONSE_START
-                                "AT" LORA_RESPONSE_DATA_SEPARATOR
-                                "OK" LORA_RESPONSE_END);
+    return lora_expect_response(LORA_BASIC_COMMAND, "OK");
 }
 
 void init_lora(void) {
     init_watchdog();
 
     if (!lora_initialized) {
-        uart_init(LORA_UART_ID, LORA_BAUD_RATE);
-
-        gpio_set_function(LORA_UART_TX_PIN, GPIO_FUNC_UART);
-        gpio_set_function(LORA_UART_RX_PIN, GPIO_FUNC_UART);
-        uart_set_format(LORA_UART_ID, LORA_DATA_BITS, LORA_STOP_BITS,
-                        LORA_PARITY);
+        // Start with a full airtime budget
+        lora_airtime_max_budget = (uint64_t)LORA_AIRTIME_BURST_UPLINKS *
+                                  lora_airtime_us(LORA_MAX_PAYLOAD_BYTES) *
+                                  1000;
+        lora_airtime_budget = lora_airtime_max_budget;
+        lora_airtime_refilled_us = hal_time_us();
+
+        lora_config_crc =
+            eeprom_crc16((const uint8_t*)LORA_CONFIG_SIGNATURE,
+                         sizeof(LORA_CONFIG_SIGNATURE) - 1);
+
+        lora_register_handler(LORA_COMMAND_MSG, lora_msg_handler);
+        lora_register_handler(LORA_COMMAND_MSGHEX, lora_msg_handler);
+        lora_register_handler(LORA_COMMAND_MODE, lora_config_handler);
+        lora_register_handler(LORA_COMMAND_APPKEY, lora_config_handler);
+        lora_register_handler(LORA_COMMAND_CLASS, lora_config_handler);
+        lora_register_handler(LORA_COMMAND_PORT, lora_config_handler);
+        lora_register_handler(LORA_COMMAND_JOIN, lora_join_handler);
+
+        // Receive in the background so nothing the module sends is lost
+        hal_uart_init(LORA_BAUD_RATE, LORA_UART_TX_PIN, LORA_UART_RX_PIN,
+                      LORA_DATA_BITS, LORA_STOP_BITS, lora_uart_irq_handler);
 
         lora_initialized = true;
 
         // Check LoRa module presence
-        lora_present = lora_check_presence(LORA_UART_ID);
+        lora_present = lora_check_presence();
 
         if (lora_present) {
-            DBG("LoRa module present\n");
+            LOG_INFO("LoRa module present\n");
         } else {
-            DBG("LoRa module not present\n");
+            LOG_WARN("LoRa module not present\n");
         }
     }
 }
 
 bool lora_connect() {
-    init_watchdog();
+    init_lora();
 
-    if (lora_connected && lora_present && lora_initialized) {
-        return true;
+    if (lora_join == LORA_JOIN_IDLE) {
+        lora_join_begin(hal_watchdog_caused_reboot());
     }
 
-    lora_send_command(LORA_UART_ID, LORA_COMMAND_MODE, LORA_MODE_DATA);
-    lora_expect_response(LORA_UART_ID, " "); // Discard any response
+    return lora_join == LORA_JOIN_JOINED;
+}
 
-    lora_send_command(LORA_UART_ID, LORA_COMMAND_APPKEY, LORA_APPKEY_DATA);
-    lora_expect_response(LORA_UART_ID, " "); // Discard any response
+lora_join_state_t lora_join_state() { return lora_join; }
 
-    lora_send_command(LORA_UART_ID, LORA_COMMAND_CLASS, "A");
-    lora_expect_response(LORA_UART_ID, " "); // Discard any response
+bool lora_tx_idle() { return lora_tx_pos >= lora_tx_len; }
 
-    lora_send_command(LORA_UART_ID, LORA_COMMAND_PORT, "8");
-    lora_expect_response(LORA_UART_ID, " "); // Discard any response
+uint64_t lora_next_deadline() {
+    uint64_t needed;
+    uint64_t due;
 
-    lora_send_command(LORA_UART_ID, LORA_COMMAND_JOIN, NULL);
-    lora_expect_response(LORA_UART_ID, " "); // Discard any response
+    switch (lora_join) {
+    case LORA_JOIN_CONFIGURING:
+        return lora_config_sent ? lora_join_deadline : hal_time_us();
 
-    return true;
-}
+    case LORA_JOIN_JOINING:
+    case LORA_JOIN_BACKOFF:
+        return lora_join_deadline;
 
-void lora_send_message(char* msg) {
-    char* quoted_msg;
-    size_t msg_len;
+    case LORA_JOIN_JOINED:
+        break;
 
-    // if (!(lora_connected || lora_present || lora_initialized) || msg == NULL)
-    // {
-    //     return;
-    // }
+    default:
+        return UINT64_MAX;
+    }
 
-    msg_len = strlen(msg);
+    if (lora_tx_queue_len == 0) {
+        return UINT64_MAX;
+    }
 
-    quoted_msg = malloc(msg_len + 3);
-    if (quoted_msg == NULL) {
+    if (lora_msg_in_flight) {
+        due = lora_msg_deadline;
+    } else if (lora_tx_pos < lora_tx_len) {
+        due = hal_time_us() +
+              (uint64_t)(lora_tx_len - lora_tx_pos) * LORA_CHAR_US;
+    } else {
+        // When the budget has been refilled enough for the next message
+        needed = (uint64_t)lora_queued_airtime_us(&lora_tx_queue[0]) * 1000;
+        due = lora_airtime_refilled_us;
+        if (lora_airtime_budget < needed) {
+            due += (needed - lora_airtime_budget +
+                    LORA_DUTY_CYCLE_PERMILLE - 1) /
+                   LORA_DUTY_CYCLE_PERMILLE;
+        }
+    }
+
+    return due;
+}
+
+static void lora_join_begin(bool warm) {
+    const settings_t* settings = settings_get();
+    bool configured = settings->lora_config_crc == lora_config_crc &&
+                      (settings->lora_state & LORA_STATE_CONFIGURED);
+
+    if (configured && warm && (settings->lora_state & LORA_STATE_JOINED)) {
+        LOG_INFO("Reusing LoRa session from before the reset\n");
+        lora_join_succeeded();
         return;
     }
 
-    quoted_msg[0] = '"';
-    for (size_t i = 0; i < msg_len; ++i) {
-        if (msg[i] == '\0' || msg[i] == '\n' || msg[i] == '\r' ||
-            msg[i] == '"') {
-            quoted_msg[i + 1] = '?';
+    if (configured) {
+        lora_join_request();
+        return;
+    }
+
+    LOG_INFO("Configuring LoRa module\n");
+    lora_join = LORA_JOIN_CONFIGURING;
+    lora_config_step = 0;
+    lora_config_sent = false;
+}
+
+static void lora_join_request() {
+    lora_send_command(LORA_COMMAND(LORA_COMMAND_JOIN), NULL);
+    lora_join = LORA_JOIN_JOINING;
+    lora_join_deadline = hal_time_us() + LORA_JOIN_TIMEOUT_US;
+    ++lora_stats.join_attempts;
+}
+
+static void lora_join_succeeded() {
+    lora_join = LORA_JOIN_JOINED;
+    lora_join_backoff_us = LORA_JOIN_BACKOFF_MIN_US;
+
+    if (lora_stats.ready_us == 0) {
+        lora_stats.ready_us = hal_time_us();
+        LOG_INFO("LoRa ready %lld ms after reset\n",
+                 lora_stats.ready_us / 1000);
+    }
+
+    lora_save_state(LORA_STATE_CONFIGURED | LORA_STATE_JOINED);
+}
+
+static void lora_join_failed(uint8_t forget) {
+    LOG_WARN("LoRa join failed, retrying in %lld s\n",
+             lora_join_backoff_us / US_PER_S);
+
+    lora_join = LORA_JOIN_BACKOFF;
+    lora_join_deadline = hal_time_us() + lora_join_backoff_us;
+
+    lora_join_backoff_us *= 2;
+    if (lora_join_backoff_us > LORA_JOIN_BACKOFF_MAX_US) {
+        lora_join_backoff_us = LORA_JOIN_BACKOFF_MAX_US;
+    }
+
+    lora_save_state(settings_get()->lora_state & ~forget);
+}
+
+static void lora_service_join() {
+    const lora_config_step_t* step;
+
+    switch (lora_join) {
+    case LORA_JOIN_CONFIGURING:
+        if (lora_config_sent) {
+            if (hal_time_us() >= lora_join_deadline) {
+                lora_join_failed(LORA_STATE_CONFIGURED | LORA_STATE_JOINED);
+            }
+        } else if (lora_config_step < LORA_NUM_CONFIG_STEPS) {
+            step = &lora_config_steps[lora_config_step];
+            lora_send_command(step->prefix, step->data);
+            lora_config_sent = true;
+            lora_join_deadline = hal_time_us() + LORA_TIMEOUT_US;
         } else {
-            quoted_msg[i + 1] = msg[i];
+            lora_save_state(LORA_STATE_CONFIGURED);
+            lora_join_request();
+        }
+        break;
+
+    case LORA_JOIN_JOINING:
+        if (hal_time_us() >= lora_join_deadline) {
+            lora_join_failed(LORA_STATE_JOINED);
+        }
+        break;
+
+    case LORA_JOIN_BACKOFF:
+        if (hal_time_us() >= lora_join_deadline) {
+            lora_join_begin(false);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+static void lora_config_handler(const char* payload) {
+    if (lora_join != LORA_JOIN_CONFIGURING || !lora_config_sent) {
+        return;
+    }
+
+    if (strncmp(payload, LORA_RESPONSE_ERROR, strlen(LORA_RESPONSE_ERROR)) ==
+        0) {
+        LOG_WARN("LoRa module rejected configuration: '%s'\n", payload);
+        lora_join_failed(LORA_STATE_CONFIGURED | LORA_STATE_JOINED);
+        return;
+    }
+
+    ++lora_config_step;
+    lora_config_sent = false;
+}
+
+static void lora_join_handler(const char* payload) {
+    if (lora_join != LORA_JOIN_JOINING) {
+        return;
+    }
+
+    if (strcmp(payload, LORA_JOIN_SUCCESS) == 0 ||
+        strcmp(payload, LORA_JOIN_ALREADY) == 0) {
+        lora_join_succeeded();
+    } else if (strcmp(payload, LORA_JOIN_FAILED) == 0 ||
+               strcmp(payload, LORA_MSG_DONE) == 0) {
+        // The attempt is over without the network having accepted it
+        lora_join_failed(LORA_STATE_JOINED);
+    }
+}
+
+static void lora_save_state(uint8_t state) {
+    const settings_t* settings = settings_get();
+    settings_t* edit;
+
+    if (settings->lora_state == state &&
+        settings->lora_config_crc == lora_config_crc) {
+        return;
+    }
+
+    edit = settings_edit();
+    edit->lora_state = state;
+    edit->lora_config_crc = lora_config_crc;
+    settings_flush();
+}
+
+static void lora_transmit_message(const lora_queued_t* queued) {
+    lora_line_begin();
+    if (queued->hex) {
+        lora_line_append(LORA_COMMAND(LORA_COMMAND_MSGHEX) LORA_DATA_SEPARATOR);
+    } else {
+        lora_line_append(LORA_COMMAND(LORA_COMMAND_MSG) LORA_DATA_SEPARATOR);
+    }
+    lora_line_append_quoted(queued->msg);
+    lora_line_append(LORA_COMMAND_SEPARATOR);
+    lora_line_send();
+
+    LOG_DEBUG("Sending message: '%s' to LoRa receiver\n", queued->msg);
+}
+
+static void lora_msg_handler(const char* payload) {
+    if (strcmp(payload, LORA_MSG_DONE) == 0) {
+        lora_msg_in_flight = false;
+    } else if (strcmp(payload, LORA_MSG_NOT_JOINED) == 0 &&
+               lora_join == LORA_JOIN_JOINED) {
+        // The module lost its session, so the saved one is stale
+        LOG_WARN("LoRa module is not joined anymore\n");
+        lora_msg_in_flight = false;
+        lora_save_state(settings_get()->lora_state & ~LORA_STATE_JOINED);
+        lora_join_request();
+    }
+}
+
+static uint32_t lora_airtime_us(size_t len) {
+    const int32_t sf = LORA_SPREADING_FACTOR;
+    // Low data rate optimization is mandatory for the slowest rates
+    const int32_t ldro = sf >= 11 ? 1 : 0;
+    const int32_t bits_per_block = 4 * (sf - 2 * ldro);
+    int32_t bits;
+    uint32_t symbols;
+
+    // Time on air as given in the SX1276 datasheet, for an explicit header,
+    // payload CRC and coding rate 4/5
+    bits = 8 * (int32_t)(len + LORA_FRAME_OVERHEAD_BYTES) - 4 * sf + 28 + 16;
+    symbols = 8;
+    if (bits > 0) {
+        symbols += (bits + bits_per_block - 1) / bits_per_block * 5;
+    }
+
+    // The preamble takes another 4.25 symbols on top of the programmed ones
+    return ((LORA_PREAMBLE_SYMBOLS + symbols) * 4 + 17) * LORA_SYMBOL_US / 4;
+}
+
+static uint32_t lora_queued_airtime_us(const lora_queued_t* queued) {
+    size_t len = strlen(queued->msg);
+
+    if (queued->hex) {
+        len /= 2;
+    }
+
+    return lora_airtime_us(len);
+}
+
+static void lora_refill_airtime() {
+    uint64_t now = hal_time_us();
+
+    lora_airtime_budget +=
+        (now - lora_airtime_refilled_us) * LORA_DUTY_CYCLE_PERMILLE;
+    if (lora_airtime_budget > lora_airtime_max_budget) {
+        lora_airtime_budget = lora_airtime_max_budget;
+    }
+    lora_airtime_refilled_us = now;
+}
+
+static void lora_service_queue() {
+    uint32_t airtime;
+
+    if (lora_msg_in_flight && hal_time_us() < lora_msg_deadline) {
+        return;
+    }
+    lora_msg_in_flight = false;
+
+    if (lora_join != LORA_JOIN_JOINED || lora_tx_queue_len == 0 ||
+        lora_tx_pos < lora_tx_len) {
+        return;
+    }
+
+    airtime = lora_queued_airtime_us(&lora_tx_queue[0]);
+
+    lora_refill_airtime();
+    if (lora_airtime_budget < (uint64_t)airtime * 1000) {
+        if (!lora_throttled) {
+            lora_throttled = true;
+            ++lora_stats.throttled;
         }
+        return;
     }
-    quoted_msg[msg_len + 1] = '"';
-    quoted_msg[msg_len + 2] = '\0';
+    lora_airtime_budget -= (uint64_t)airtime * 1000;
+    lora_throttled = false;
+
+    lora_transmit_message(&lora_tx_queue[0]);
+    lora_msg_in_flight = true;
+    lora_msg_deadline = hal_time_us() + LORA_MSG_TIMEOUT_US;
+    ++lora_stats.sent;
+    lora_stats.airtime_us += airtime;
+
+    --lora_tx_queue_len;
+    memmove(&lora_tx_queue[0], &lora_tx_queue[1],
+            lora_tx_queue_len * sizeof(lora_queued_t));
+}
 
-    DBG("Sending message: '%s' to LoRa receiver\n", quoted_msg);
+bool lora_send_message(const char* msg, lora_priority_t priority) {
+    if (msg == NULL) {
+        return false;
+    }
 
-    lora_send_command(LORA_UART_ID, LORA_COMMAND_MSG, quoted_msg);
+    return lora_enqueue(msg, false, priority);
+}
+
+bool lora_send_payload(const uint8_t* payload, size_t len,
+                       lora_priority_t priority) {
+    static const char hex_digits[] = "0123456789ABCDEF";
+    char msg[LORA_MAX_MESSAGE_BYTES];
+
+    if (payload == NULL || len == 0 || len > LORA_MAX_PAYLOAD_BYTES) {
+        return false;
+    }
+
+    for (size_t i = 0; i < len; ++i) {
+        msg[2 * i] = hex_digits[payload[i] >> 4];
+        msg[2 * i + 1] = hex_digits[payload[i] & 0x0f];
+    }
+    msg[2 * len] = '\0';
+
+    return lora_enqueue(msg, true, priority);
+}
+
+static bool lora_enqueue(const char* msg, bool hex, lora_priority_t priority) {
+    size_t victim;
+
+    if (lora_tx_queue_len == LORA_TX_QUEUE_SIZE) {
+        // Rather than drop anything, fold the message into an identical one
+        // that has not gone out yet. Repeats are only ever folded here, as
+        // each one may be a report of its own
+        for (size_t i = 0; i < lora_tx_queue_len; ++i) {
+            if (lora_tx_queue[i].hex == hex &&
+                strncmp(lora_tx_queue[i].msg, msg,
+                        LORA_MAX_MESSAGE_BYTES - 1) == 0) {
+                if (priority > lora_tx_queue[i].priority) {
+                    lora_tx_queue[i].priority = priority;
+                }
+                ++lora_stats.merged;
+                return true;
+            }
+        }
+
+        // Push out the oldest message of the lowest priority, if it is less
+        // important than this one
+        victim = 0;
+        for (size_t i = 1; i < lora_tx_queue_len; ++i) {
+            if (lora_tx_queue[i].priority < lora_tx_queue[victim].priority) {
+                victim = i;
+            }
+        }
+
+        ++lora_stats.dropped;
+        if (lora_tx_queue[victim].priority >= priority) {
+            LOG_WARN("LoRa queue full, dropped message: '%s'\n", msg);
+            return false;
+        }
+
+        LOG_WARN("LoRa queue full, dropped message: '%s'\n",
+                 lora_tx_queue[victim].msg);
+        --lora_tx_queue_len;
+        memmove(&lora_tx_queue[victim], &lora_tx_queue[victim + 1],
+                (lora_tx_queue_len - victim) * sizeof(lora_queued_t));
+    }
+
+    strncpy(lora_tx_queue[lora_tx_queue_len].msg, msg,
+            LORA_MAX_MESSAGE_BYTES - 1);
+    lora_tx_queue[lora_tx_queue_len].msg[LORA_MAX_MESSAGE_BYTES - 1] = '\0';
+    lora_tx_queue[lora_tx_queue_len].hex = hex;
+    lora_tx_queue[lora_tx_queue_len].priority = priority;
+    ++lora_tx_queue_len;
+
+    if (lora_tx_queue_len > lora_stats.max_queue_depth) {
+        lora_stats.max_queue_depth = lora_tx_queue_len;
+    }
+
+    lora_service_queue();
+
+    return true;
+}
+
+void lora_get_stats(lora_stats_t* stats) {
+    *stats = lora_stats;
+    stats->queue_depth = lora_tx_queue_len;
 }
 
 #ifdef LORA_TRACE_RESPONSE
 #undef LORA_TRACE_RESPONSE
-#endif
\ No newline at end of file
+#endif
+#undef US_PER_S
+#undef LORA_FRAME_OVERHEAD_BYTES
+#undef LORA_PREAMBLE_SYMBOLS
+#undef LORA_SYMBOL_US
+#undef LORA_CHAR_US
+#undef LORA_CONFIG_SIGNATURE
+#undef LORA_NUM_CONFIG_STEPS
\ No newline at end of file
@@ -1,18 +1,74 @@
 #ifndef LORA_H
 #define LORA_H
 
-#include "hardware/uart.h"
-
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// How long to wait for the module to answer a command
+#define LORA_TIMEOUT_US (500 * 1000)
+
+/// Size of the receive ring buffer. Power of two
+#define LORA_RX_BUFFER_SIZE 256
+
+/// Longest response line that is kept whole, longer ones are truncated
+#define LORA_LINE_MAX_BYTES 128
+
+/// Number of handlers that can be registered for unsolicited responses
+#define LORA_MAX_HANDLERS 8
+
+/// Number of messages waiting to be sent that fit in the uplink queue
+#define LORA_TX_QUEUE_SIZE 8
+
+/// Spreading factor uplinks are expected to go out at, 7 to 12. Sets the
+/// largest payload and how much airtime each uplink costs
+#define LORA_SPREADING_FACTOR 12
+#define LORA_BANDWIDTH_HZ (125 * 1000)
+
+/// Largest application payload at LORA_SPREADING_FACTOR on EU868
+#if LORA_SPREADING_FACTOR >= 10
+#define LORA_MAX_PAYLOAD_BYTES 51
+#elif LORA_SPREADING_FACTOR == 9
+#define LORA_MAX_PAYLOAD_BYTES 115
+#else
+#define LORA_MAX_PAYLOAD_BYTES 222
+#endif
+
+/// Longest message that can be queued, longer ones are truncated. Fits the
+/// largest payload as two hex digits per byte
+#define LORA_MAX_MESSAGE_BYTES (2 * LORA_MAX_PAYLOAD_BYTES + 1)
+
+/// Longest command line that can be sent. Fits the longest message quoted
+/// after the MSGHEX command
+#define LORA_TX_LINE_BYTES (LORA_MAX_MESSAGE_BYTES + 16)
+
+/// Share of time the radio may spend transmitting, in 1/1000. The modem
+/// rejects uplinks that would exceed it, so they are held back until the
+/// airtime budget allows them
+#define LORA_DUTY_CYCLE_PERMILLE 10
+
+/// Airtime budget that can be saved up while idle, in largest uplinks
+#define LORA_AIRTIME_BURST_UPLINKS 2
 
-#define LORA_TIMEOUT_US (10 * 1000)
+/// How long a message may take to go out before the next one is sent anyway
+#define LORA_MSG_TIMEOUT_US (10 * 1000 * 1000)
 
+/// How long the network may take to answer a join request
+#define LORA_JOIN_TIMEOUT_US (20 * 1000 * 1000)
+
+/// Wait after a failed join attempt, doubled after every further failure up
+/// to the maximum
+#define LORA_JOIN_BACKOFF_MIN_US (15 * 1000 * 1000)
+#define LORA_JOIN_BACKOFF_MAX_US (30 * 60 * 1000 * 1000ull)
+
+/// Persisted LoRa state bits. The module keeps its configuration across power
+/// cycles, but only keeps its session while it stays powered
+#define LORA_STATE_CONFIGURED (1u << 0)
+#define LORA_STATE_JOINED (1u << 1)
+
+/// No parity. The UART the pins belong to is picked in hal_pico.c
 #define LORA_DATA_BITS 8
 #define LORA_STOP_BITS 1
-#define LORA_PARITY UART_PARITY_NONE
-
-#define LORA_UART_ID uart1
-#define LORA_UART_IRQ UART1_IRQ
 
 #define LORA_BAUD_RATE 9600
 
@@ -27,38 +83,135 @@
 
 #define LORA_APPKEY "8979adfccaf0fb5e4e087ecb2f00157e"
 
-/// 'AT+' + '\n' + '\0'
-#define LORA_MIN_COMMAND_BYTES (3 + 1 + 1)
-#define LORA_MIN_DATA_BYTES 1
-
 #define LORA_COMMAND_SEPARATOR "\n"
 #define LORA_DATA_SEPARATOR "="
 
 #define LORA_BASIC_COMMAND "AT"
 
 #define LORA_COMMAND_BASE "AT+"
+/// Full command string, concatenated at compile time
+#define LORA_COMMAND(cmd) LORA_COMMAND_BASE cmd
+
 #define LORA_COMMAND_VERSION "VER"
 #define LORA_COMMAND_MODE "MODE"
 #define LORA_COMMAND_APPKEY "KEY"
-#define LORA_COMMAND_CLASS "CLASS" // A
-#define LORA_COMMAND_PORT "PORT" // 8
+#define LORA_COMMAND_CLASS "CLASS"
+#define LORA_COMMAND_PORT "PORT"
 #define LORA_COMMAND_JOIN "JOIN"
 #define LORA_COMMAND_MSG "MSG"
+#define LORA_COMMAND_MSGHEX "MSGHEX"
 
 #define LORA_MODE_DATA "LWOTAA"
 #define LORA_APPKEY_DATA "APPKEY,\"" LORA_APPKEY "\""
+#define LORA_CLASS_DATA "A"
+#define LORA_PORT_DATA "8"
 
 #define LORA_RESPONSE_START "+"
 #define LORA_RESPONSE_DATA_SEPARATOR ": "
 #define LORA_RESPONSE_END "\r\n"
 
+#define LORA_MSG_DONE "Done"
+#define LORA_RESPONSE_ERROR "ERROR"
+#define LORA_JOIN_SUCCESS "Network joined"
+#define LORA_JOIN_ALREADY "Joined already"
+#define LORA_JOIN_FAILED "Join failed"
+#define LORA_MSG_NOT_JOINED "Please join network first"
+
+typedef enum {
+    LORA_PRIORITY_LOW,
+    LORA_PRIORITY_NORMAL,
+    LORA_PRIORITY_HIGH,
+} lora_priority_t;
+
+typedef enum {
+    /// lora_connect() has not been called yet
+    LORA_JOIN_IDLE,
+    /// Sending the configuration commands
+    LORA_JOIN_CONFIGURING,
+    /// Waiting for the network to answer the join request
+    LORA_JOIN_JOINING,
+    /// Waiting to retry after a failed attempt
+    LORA_JOIN_BACKOFF,
+    LORA_JOIN_JOINED,
+} lora_join_state_t;
+
+typedef struct {
+    /// Messages currently waiting in the queue
+    uint32_t queue_depth;
+    /// Most messages that have been waiting at once
+    uint32_t max_queue_depth;
+    /// Messages that did not fit in the queue or were pushed out of it
+    uint32_t dropped;
+    /// Messages that arrived while the queue was full and were identical to
+    /// one already waiting
+    uint32_t merged;
+    uint32_t sent;
+    /// Messages that had to wait for the airtime budget
+    uint32_t throttled;
+    /// Estimated airtime of all sent messages
+    uint64_t airtime_us;
+    uint32_t join_attempts;
+    /// Time from reset until the module had joined a network, 0 until then
+    uint64_t ready_us;
+} lora_stats_t;
+
+/// Called with the payload of a "+CMD: payload" line from the module
+typedef void (*lora_handler_t)(const char* payload);
+
+/// Called from the UART interrupt whenever a complete line has arrived
+typedef void (*lora_line_callback_t)(void);
+
 /// Initializes the LoRa module
 void init_lora(void);
 
-/// Tries to connect to a network with the LoRa module. Return true on success
+/// Registers a handler for responses of the given command. Returns false if
+/// there is no room for more handlers
+bool lora_register_handler(const char* cmd, lora_handler_t handler);
+
+/// Sets the callback run whenever a complete line has arrived, so that
+/// lora_poll() only needs to run then and for timeouts. NULL for none
+void lora_set_line_callback(lora_line_callback_t callback);
+
+/// Parses whatever the module has sent since the last call, dispatches
+/// complete lines to their handlers, advances joining a network and, once
+/// joined, starts sending the next queued message. Never blocks
+void lora_poll(void);
+
+/// Gets the uplink queue statistics
+void lora_get_stats(lora_stats_t* stats);
+
+/// Starts connecting to a network in the background, which lora_poll() then
+/// carries on with. After a watchdog reset the session saved before it is
+/// reused, and the module is only configured again if its configuration
+/// changed. Returns true once joined
 bool lora_connect(void);
 
-/// Sends a message to the LoRa receiver
-void lora_send_message(char* msg);
+/// Gets how far connecting to a network has got
+lora_join_state_t lora_join_state(void);
+
+/// Checks whether the last line has been handed to the UART, so that the next
+/// one can be sent without waiting
+bool lora_tx_idle(void);
+
+/// Gets when lora_poll() next has something to do if no line arrives from the
+/// module in the meantime: a response timing out, the join backoff ending or
+/// enough airtime for the next uplink. UINT64_MAX if nothing is pending
+uint64_t lora_next_deadline(void);
+
+/// Sends a command with optional data to the LoRa module without waiting for
+/// its response, which goes to the registered handlers. `prefix` is the full
+/// command including LORA_COMMAND_BASE, see LORA_COMMAND()
+void lora_send_command(const char* prefix, const char* data);
+
+/// Queues a message to the LoRa receiver and returns right away. When the
+/// queue is full, the message is merged into an identical one that is still
+/// waiting, or else the oldest message of the lowest priority below this one
+/// is dropped to make room. Returns false if the message itself was dropped
+bool lora_send_message(const char* msg, lora_priority_t priority);
+
+/// Queues a binary payload of at most LORA_MAX_PAYLOAD_BYTES to be sent with
+/// MSGHEX, with the same queueing rules as lora_send_message()
+bool lora_send_payload(const uint8_t* payload, size_t len,
+                       lora_priority_t priority);
 
 #endif
\ No newline at end of file
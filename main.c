@@ -1,148 +1,466 @@
-#define TIMER_EXACT
-
-#include "pico/stdlib.h"
-
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
 #include "button.h"
 #include "debug.h"
+#include "hal.h"
 #include "led.h"
 #include "lora.h"
+#include "motor.h"
+#include "settings.h"
 #include "stepper.h"
+#include "task.h"
+#include "telemetry.h"
 #include "timer.h"
+#include "trace.h"
 #include "watchdog.h"
 
-#define MAIN_LOOP_SLEEP 10
-
-#define SECONDS_PER_PILL 30
 #define WATCHDOG_FEED_DELAY_US (750 * US_IN_MS)
 #define BLINK_FREQ_MS 500
-#define BLINK_FREQ_US (BLINK_FREQ_MS * US_IN_MS)
-
-#define NUM_PILLS 7
 
 #define BLINK_TIMES_WHEN_EMPTY 5
 
+/// How often moves are checked on while underway
+#define MOTOR_POLL_PERIOD_US (10 * US_IN_MS)
+
+/// How often the idle statistics are reported
+#define IDLE_REPORT_PERIOD_US (60 * US_IN_SECOND)
+
+/// Events of the dispenser task
+#define EVENT_BUTTON_0 (1u << BTN_0)
+#define EVENT_BUTTON_1 (1u << BTN_1)
+#define EVENT_BUTTON_2 (1u << BTN_2)
+#define EVENT_MOTOR (1u << 3)
+#define EVENT_PILL_DUE (1u << 4)
+/// Button events are waiting in the queue. Presses are passed on to the
+/// dispenser as EVENT_BUTTON_0..2
+#define EVENT_BUTTON (1u << 5)
+
+/// Events of the radio task
+#define EVENT_TICK (1u << 0)
+
+typedef enum {
+    /// Blinking LED_0 until BTN_0 starts the calibration
+    DISPENSER_WAIT_CALIBRATE,
+    /// Finishing the move that a reset cut short
+    DISPENSER_RESUMING,
+    DISPENSER_CALIBRATING,
+    /// LED_0 is lit until BTN_0 starts dispensing
+    DISPENSER_WAIT_START,
+    /// Waiting for the next pill to be due
+    DISPENSER_WAIT_PILL,
+    DISPENSER_DROPPING,
+} dispenser_state_t;
+
+/// Waits for input, calibrates and dispenses as the events come in
+static void dispenser_task(uint32_t events);
+
+/// Parses what the LoRa module has sent and sends what is queued
+static void radio_task(uint32_t events);
+
+/// (Re)starts the dispenser from waiting for calibration. At boot, a move
+/// that a reset cut short is finished first
+static void dispenser_restart(void);
+
+/// Blinks LED_0 until BTN_0 starts the calibration
+static void wait_for_calibration(void);
+
+/// Starts dropping a single pill
+static void drop_pill_start(void);
+
+/// Reports the dropped pill and blinks a LED if none was detected
+static void drop_pill_finish(void);
+
+/// Records that a pill was dispensed and saves the settings
+static void record_pill(bool detected);
+
+/// Feeds the watchdog with the current feed reason. While the drum moves, it
+/// is only fed if the motor has stepped since the last time
+static void feeder_callback(timer_id_t id, void* user_data);
+
+/// Starts or stops waking the dispenser task regularly while it moves the
+/// drum, to keep the progress of the move saved
+static void watch_motor(bool watch);
+
+/// Posts EVENT_MOTOR while a move is underway
+static void motor_poll_callback(timer_id_t id, void* user_data);
+
+/// Prints how much of the time was spent asleep and how often it woke up
+static void idle_report_callback(timer_id_t id, void* user_data);
+
+/// Posts EVENT_TICK once the radio task has something to do
+static void radio_timer_callback(timer_id_t id, void* user_data);
+
+/// Arms the radio timer for the next deadline of the LoRa module or the
+/// telemetry, if that changed. Lines from the module wake the radio task on
+/// their own
+static void schedule_radio(void);
+
+/// Wakes the radio task once the LoRa module has sent a line. Runs in
+/// interrupt context
+static void lora_line_callback(void);
+
+/// Posts EVENT_MOTOR once a move has ended. Runs in interrupt context
+static void motor_done_callback(void);
+
+/// Posts EVENT_BUTTON. Runs in interrupt context
+static void button_handler(void);
+
+/// Drains the button event queue and returns the button presses as events
+static uint32_t pop_button_presses(void);
+
 static bool first_run = true;
 
-/// Tries to drop a single pill. Blinks a LED and tries to report to the LoRa
-/// receiver on failure
-static void drop_pill(void);
+/// What the watchdog is fed for while main is busy with something
+static watchdog_feed_reason_t feed_reason = WATCHDOG_FEED_OTHER;
 
-static void drop_pill() {
-    lora_send_message("Dropping pill");
+/// Motor position when the watchdog was last fed for a move
+static uint32_t fed_at_position;
 
-    if (step()) {
-        lora_send_message("Pill dropped successfully");
-    } else {
-        lora_send_message("No pills dropped");
+static task_id_t dispenser_task_id;
+static task_id_t radio_task_id;
 
-        feed_watchdog(WATCHDOG_FEED_BLINKING);
-        for (uint8_t i = 0; i < BLINK_TIMES_WHEN_EMPTY; ++i) {
-            set_led_state(LED_0, true);
-            sleep_ms(BLINK_FREQ_MS / 2);
-            feed_watchdog(WATCHDOG_FEED_BLINKING);
+static dispenser_state_t dispenser_state;
 
-            set_led_state(LED_0, false);
-            sleep_ms(BLINK_FREQ_MS / 2);
-            feed_watchdog(WATCHDOG_FEED_BLINKING);
+/// Events the timers post
+static task_event_t pill_due_event;
+
+static timer_id_t rotator = TIMER_INVALID_ID;
+static timer_id_t motor_poller = TIMER_INVALID_ID;
+
+/// The radio task's next wakeup and when it is due
+static timer_id_t radio_timer = TIMER_INVALID_ID;
+static uint64_t radio_deadline = TIMER_NO_DEADLINE;
+
+/// Blinks LED_0 until stopped while waiting for calibration
+static const led_pattern_t waiting_pattern = {LED_PATTERN_BLINK,
+                                              BLINK_FREQ_MS, 0};
+
+/// Blinks LED_0 a few times when no pill was detected
+static const led_pattern_t empty_pattern = {LED_PATTERN_BLINK, BLINK_FREQ_MS,
+                                            BLINK_TIMES_WHEN_EMPTY};
+
+static void feeder_callback(timer_id_t id, void* user_data) {
+    uint32_t position;
+
+    // A move that never ends, because core1 hangs or a command to it got
+    // lost, must not keep the watchdog happy
+    if (feed_reason == WATCHDOG_FEED_ROTATING ||
+        feed_reason == WATCHDOG_FEED_CALIBRATING) {
+        position = motor_position();
+        if (position == fed_at_position) {
+            return;
         }
+        fed_at_position = position;
     }
+
+    feed_watchdog(feed_reason);
 }
 
-int main(void) {
-    recurring_timer_t* feeder;
-    recurring_timer_t* blinker;
-    recurring_timer_t* rotator;
-    uint8_t pills_dropped;
+static void watch_motor(bool watch) {
+    timer_cancel(motor_poller);
+    motor_poller = TIMER_INVALID_ID;
 
-    stdio_init_all();
-    printf("Serial port initialized\n");
+    if (watch) {
+        motor_poller = timer_add_repeating(MOTOR_POLL_PERIOD_US,
+                                           motor_poll_callback, NULL);
+    }
+}
 
-    while (true) {
-        init_watchdog();
+static void motor_poll_callback(timer_id_t id, void* user_data) {
+    if (motor_busy()) {
+        task_post(dispenser_task_id, EVENT_MOTOR);
+    }
+}
+
+static void idle_report_callback(timer_id_t id, void* user_data) {
+    task_idle_stats_t stats;
 
-        init_lora();
+    task_get_idle_stats(&stats);
+    if (stats.total_us == 0) {
+        return;
+    }
+
+    LOG_INFO("Idle %llu.%llu%% of the time, %llu wakeups/min\n",
+             stats.idle_us * 100 / stats.total_us,
+             stats.idle_us * 1000 / stats.total_us % 10,
+             (uint64_t)stats.wakeups * 60 * US_IN_SECOND / stats.total_us);
+}
 
-        init_buttons();
-        init_leds();
-        init_stepper();
+static void radio_timer_callback(timer_id_t id, void* user_data) {
+    radio_timer = TIMER_INVALID_ID;
+    radio_deadline = TIMER_NO_DEADLINE;
+    task_post(radio_task_id, EVENT_TICK);
+}
 
-        lora_connect();
+static void schedule_radio() {
+    uint64_t deadline = lora_next_deadline();
+    uint64_t telemetry_deadline = telemetry_next_deadline();
+    uint64_t now;
 
-        if (first_run) {
-            first_run = false;
-            lora_send_message("Pill dispenser turned on");
+    if (telemetry_deadline < deadline) {
+        deadline = telemetry_deadline;
+    }
+    if (deadline == radio_deadline) {
+        return;
+    }
+
+    timer_cancel(radio_timer);
+    radio_timer = TIMER_INVALID_ID;
+    radio_deadline = deadline;
+    if (deadline == TIMER_NO_DEADLINE) {
+        return;
+    }
+
+    now = hal_time_us();
+    radio_timer = timer_add(deadline > now ? deadline - now : 0, 0,
+                            radio_timer_callback, NULL);
+    if (radio_timer == TIMER_INVALID_ID) {
+        radio_deadline = TIMER_NO_DEADLINE;
+    }
+}
+
+static void lora_line_callback() { task_post(radio_task_id, EVENT_TICK); }
+
+static void motor_done_callback() { task_post(dispenser_task_id, EVENT_MOTOR); }
+
+static void button_handler() { task_post(dispenser_task_id, EVENT_BUTTON); }
+
+static uint32_t pop_button_presses() {
+    button_event_t event;
+    uint32_t presses = 0;
+
+    // Every event is traced as it happens
+    while (button_pop_event(&event)) {
+        if (event.type == BUTTON_EVENT_PRESS) {
+            presses |= 1u << event.btn;
         }
+    }
 
-        // Wait for button 0 to be pressed
-        feeder = new_timer(WATCHDOG_FEED_DELAY_US);
-        blinker = new_timer(BLINK_FREQ_US / 2);
-        while (!btn_pressed(BTN_0)) {
-            if (timeout_passed(feeder)) {
-                feed_watchdog(WATCHDOG_FEED_WAITING_FOR_INPUT);
-            }
+    return presses;
+}
 
-            if (timeout_passed(blinker)) {
-                toggle_led_state(LED_0);
+static void radio_task(uint32_t events) {
+    telemetry_poll();
+    lora_poll();
+    schedule_radio();
+}
+
+static void dispenser_restart() {
+    init_leds();
+    init_stepper();
+
+    lora_connect();
+
+    if (first_run) {
+        first_run = false;
+        ++settings_edit()->boot_count;
+        settings_flush();
+        telemetry_report(TELEMETRY_EVENT_BOOT, 0, LORA_PRIORITY_NORMAL);
+
+        // The drum is left where it was before the reset, so the move that
+        // was cut short is finished before anything else
+        if (has_saved_calibration()) {
+            calibrate_start(false);
+            if (!calibrate_poll()) {
+                feed_reason = WATCHDOG_FEED_ROTATING;
+                dispenser_state = DISPENSER_RESUMING;
+                watch_motor(true);
+                return;
             }
+        }
+    }
+
+    wait_for_calibration();
+}
+
+static void wait_for_calibration() {
+    // Wait for button 0 to be pressed
+    feed_reason = WATCHDOG_FEED_WAITING_FOR_INPUT;
+    dispenser_state = DISPENSER_WAIT_CALIBRATE;
+    led_pattern_start(LED_0, &waiting_pattern);
+}
+
+static void drop_pill_start() {
+    telemetry_report(TELEMETRY_EVENT_DROP_START, 0, LORA_PRIORITY_LOW);
+
+    feed_reason = WATCHDOG_FEED_ROTATING;
+    dispenser_state = DISPENSER_DROPPING;
+    watch_motor(true);
+
+    // Finish the drop right away, which reports it as missed
+    if (!step_start()) {
+        task_post(dispenser_task_id, EVENT_MOTOR);
+    }
+}
+
+static void drop_pill_finish() {
+    bool detected;
+    uint8_t flags = 0;
+
+    detected = step_pill_detected();
+    record_pill(detected);
+
+    if (settings_get()->pills_dropped >= settings_get()->num_pills) {
+        flags |= TELEMETRY_FLAG_LAST_PILL;
+    }
+
+    if (detected) {
+        telemetry_report(TELEMETRY_EVENT_DROP, flags | TELEMETRY_FLAG_DETECTED,
+                         LORA_PRIORITY_NORMAL);
+    } else {
+        telemetry_report(TELEMETRY_EVENT_DROP, flags, LORA_PRIORITY_HIGH);
+        led_pattern_start(LED_0, &empty_pattern);
+    }
+}
+
+static void record_pill(bool detected) {
+    settings_t* settings = settings_edit();
+
+    ++settings->pills_dropped;
+    if (detected) {
+        ++settings->total_pills_dropped;
+    }
 
-            sleep_ms(MAIN_LOOP_SLEEP);
+    settings_flush();
+}
+
+static void dispenser_task(uint32_t events) {
+    if (events & EVENT_BUTTON) {
+        events |= pop_button_presses();
+    }
+
+    switch (dispenser_state) {
+    case DISPENSER_WAIT_CALIBRATE:
+        if (events & EVENT_BUTTON_0) {
+            led_pattern_stop(LED_0);
+
+            LOG_INFO("Starting calibration\n");
+            telemetry_report(TELEMETRY_EVENT_CALIBRATION_START, 0,
+                             LORA_PRIORITY_LOW);
+
+            feed_reason = WATCHDOG_FEED_CALIBRATING;
+            dispenser_state = DISPENSER_CALIBRATING;
+            watch_motor(true);
+            calibrate_start(true);
         }
-        set_led_state(LED_0, false);
-        destroy_timer(blinker);
+        break;
 
-        DBG("Starting calibration\n");
-        lora_send_message("Starting pill dispenser calibration");
+    case DISPENSER_RESUMING:
+        if ((events & EVENT_MOTOR) && calibrate_poll()) {
+            LOG_INFO("Finished the move cut short by a reset\n");
 
-        calibrate(true);
+            watch_motor(false);
+            wait_for_calibration();
+        }
+        break;
 
-        lora_send_message("Pill dispenser calibrated");
+    case DISPENSER_CALIBRATING:
+        if ((events & EVENT_MOTOR) && calibrate_poll()) {
+            telemetry_report(TELEMETRY_EVENT_CALIBRATED, 0,
+                             LORA_PRIORITY_NORMAL);
 
-        DBG("%d steps/rotation\n", steps_per_rotation());
+            LOG_INFO("%d steps/rotation\n", steps_per_rotation());
 
-        set_led_state(LED_0, true);
-        while (!btn_pressed(BTN_0)) {
-            if (timeout_passed(feeder)) {
-                feed_watchdog(WATCHDOG_FEED_WAITING_FOR_INPUT);
-            }
+            watch_motor(false);
+            feed_reason = WATCHDOG_FEED_WAITING_FOR_INPUT;
+            dispenser_state = DISPENSER_WAIT_START;
+            set_led_state(LED_0, true);
+        }
+        break;
+
+    case DISPENSER_WAIT_START:
+        if (events & EVENT_BUTTON_0) {
+            set_led_state(LED_0, false);
 
-            sleep_ms(MAIN_LOOP_SLEEP);
+            rotator = timer_add_repeating(
+                (uint64_t)settings_get()->seconds_per_pill * US_IN_SECOND,
+                task_timer_callback, &pill_due_event);
+
+            settings_edit()->pills_dropped = 0;
+            // Drop the first pill instantly
+            drop_pill_start();
         }
-        set_led_state(LED_0, false);
-        rotator = new_timer_seconds(SECONDS_PER_PILL);
+        break;
 
-        feed_watchdog(WATCHDOG_FEED_OTHER);
-        // Drop the first pill instantly
-        drop_pill();
-        pills_dropped = 1;
+    case DISPENSER_WAIT_PILL:
+        if (events & EVENT_PILL_DUE) {
+            drop_pill_start();
+        }
+        break;
 
-        while (pills_dropped < NUM_PILLS) {
-            if (timeout_passed(feeder)) {
-                feed_watchdog(WATCHDOG_FEED_FED_IN_MAIN);
-            }
+    case DISPENSER_DROPPING:
+        if (!(events & EVENT_MOTOR) || !step_poll()) {
+            break;
+        }
 
-            if (timeout_passed(rotator)) {
-                drop_pill();
-                ++pills_dropped;
-            }
+        watch_motor(false);
+        drop_pill_finish();
 
-            if (timeout_passed(feeder)) {
-                feed_watchdog(WATCHDOG_FEED_FED_IN_MAIN);
-            }
+        feed_reason = WATCHDOG_FEED_FED_IN_MAIN;
+        dispenser_state = DISPENSER_WAIT_PILL;
+
+        if (settings_get()->pills_dropped >= settings_get()->num_pills) {
+            timer_cancel(rotator);
+            rotator = TIMER_INVALID_ID;
+
+            telemetry_report(TELEMETRY_EVENT_FINISHED, 0,
+                             LORA_PRIORITY_NORMAL);
 
-            sleep_ms(MAIN_LOOP_SLEEP);
+            feed_watchdog(WATCHDOG_FEED_OTHER);
+            dispenser_restart();
         }
+        break;
+    }
 
-        lora_send_message("All pills dispensed, starting over");
+    // Telemetry reports may have queued uplinks or started a batch
+    schedule_radio();
+}
 
-        feed_watchdog(WATCHDOG_FEED_OTHER);
+int main(void) {
+    hal_init();
+    printf("Serial port initialized\n");
 
-        /// Free timers before looping and recreating them to prevent leaking
-        /// memory
-        destroy_timer(rotator);
-        destroy_timer(feeder);
+    init_trace();
+
+    init_watchdog();
+
+    if (init_settings() == SETTINGS_READ_FAILED) {
+        LOG_WARN("Could not read settings, using defaults\n");
     }
-}
\ No newline at end of file
+
+    init_timers();
+    init_lora();
+    init_buttons();
+    init_leds();
+    init_stepper();
+
+    dispenser_task_id = task_create(dispenser_task);
+    radio_task_id = task_create(radio_task);
+
+    pill_due_event = (task_event_t){dispenser_task_id, EVENT_PILL_DUE};
+
+    button_set_handler(button_handler);
+    motor_set_done_callback(motor_done_callback);
+    lora_set_line_callback(lora_line_callback);
+
+    timer_add_repeating(WATCHDOG_FEED_DELAY_US, feeder_callback, NULL);
+    timer_add_repeating(IDLE_REPORT_PERIOD_US, idle_report_callback, NULL);
+
+    dispenser_restart();
+    schedule_radio();
+
+    // Every task runs to completion, so none of them may block. Whenever
+    // there is nothing left to do, print the trace and then sleep until the
+    // next interrupt or deadline
+    while (true) {
+        if (timer_expired()) {
+            timer_dispatch();
+        }
+
+        if (!task_run() && trace_drain() == 0) {
+            task_idle();
+        }
+    }
+}
@@ -0,0 +1,558 @@
+#include "motor.h"
+#include "debug.h"
+#include "hal.h"
+#include "stepper.h"
+#include "trace.h"
+#include "watchdog.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MOTOR_WAIT_POLL_MS 1
+
+#define WATCHDOG_FEED_FREQ 100
+
+#define US_PER_S (1000 * 1000)
+
+#define MOTOR_COIL_A (1u << STEPPER_A_PIN)
+#define MOTOR_COIL_B (1u << STEPPER_B_PIN)
+#define MOTOR_COIL_C (1u << STEPPER_C_PIN)
+#define MOTOR_COIL_D (1u << STEPPER_D_PIN)
+#define MOTOR_COIL_MASK                                                        \
+    (MOTOR_COIL_A | MOTOR_COIL_B | MOTOR_COIL_C | MOTOR_COIL_D)
+
+#define MOTOR_NUM_PHASES 8
+
+#define OPTO_IRQ_EVENT_MASK (HAL_GPIO_EDGE_RISE | HAL_GPIO_EDGE_FALL)
+#define PIEZO_IRQ_EVENT_MASK HAL_GPIO_EDGE_FALL
+
+/// The first FIFO word of a command holds the command and up to two small
+/// arguments, commands with a 32-bit argument send it as a second word
+#define MOTOR_COMMAND_WORD(command, arg0, arg1)                                \
+    ((uint32_t)(command) | (uint32_t)(arg0) << 8 | (uint32_t)(arg1) << 16)
+#define MOTOR_COMMAND_ARG0(word) (((word) >> 8) & 0xFF)
+#define MOTOR_COMMAND_ARG1(word) (((word) >> 16) & 0xFF)
+
+/// Marks a command core1 holds on to until its argument word arrives
+#define MOTOR_COMMAND_HAS_ARG (1u << 31)
+
+/// Sent from core1 to core0 once a move has ended
+#define MOTOR_EVENT_DONE 1
+
+/// Commands core0 sends to core1 through the FIFO
+typedef enum {
+    /// Speed and stop condition as arguments, followed by the step count
+    MOTOR_COMMAND_START,
+    MOTOR_COMMAND_STEP_SINGLE,
+    /// Drive mode as argument
+    MOTOR_COMMAND_DRIVE_MODE,
+    /// Followed by the cruise period
+    MOTOR_COMMAND_CRUISE_PERIOD,
+} motor_command_t;
+
+/// Sets up the step engine on core1
+static void motor_core1_setup(void);
+
+/// Runs the commands core0 sends to core1, one FIFO word at a time
+static void motor_run_command(uint32_t word);
+
+/// Calls the done callback for a move core1 has reported as ended. Runs in
+/// interrupt context on core0
+static void motor_core0_receive(uint32_t word);
+
+/// Integer square root, rounded down
+static uint32_t isqrt(uint32_t n);
+
+/// Rebuilds the ramp table for the given cruise period on core1
+static void motor_build_ramp(uint32_t period_us);
+
+/// Switches the coil sequence to the given drive mode on core1
+static void motor_apply_drive_mode(motor_drive_t mode);
+
+/// Energizes the next phase of the coil sequence on core1
+static void motor_advance(void);
+
+/// Starts a move on core1
+static void motor_begin(uint32_t steps, motor_speed_t speed,
+                        motor_stop_t stop);
+
+/// Gets the period before the next step of the current move
+static uint32_t motor_next_period(void);
+
+/// Checks whether the opto fork currently satisfies the stop condition of the
+/// current move
+static bool motor_stop_reached(void);
+
+/// Records opto fork edges and ends the current move on a matching one
+static void opto_irq_handler(uint32_t pin, uint32_t edges);
+
+/// Counts the times the piezo sensor has triggered
+static void piezo_irq_handler(uint32_t pin, uint32_t edges);
+
+/// Alarm callback that takes a single step of the current move
+static int64_t motor_alarm_callback(hal_alarm_id_t id, void* user_data);
+
+/// Ends the current move and reports it to core0
+static void motor_finish(void);
+
+/// Half-step sequence of coil states. Wave drive uses the even phases, full
+/// step drive the odd ones and half step drive all of them
+static const uint32_t motor_phases[MOTOR_NUM_PHASES] = {
+    MOTOR_COIL_A,
+    MOTOR_COIL_A | MOTOR_COIL_B,
+    MOTOR_COIL_B,
+    MOTOR_COIL_B | MOTOR_COIL_C,
+    MOTOR_COIL_C,
+    MOTOR_COIL_C | MOTOR_COIL_D,
+    MOTOR_COIL_D,
+    MOTOR_COIL_D | MOTOR_COIL_A,
+};
+
+static bool motor_initialized = false;
+
+/// Drive mode as last requested by core0
+static motor_drive_t motor_drive = MOTOR_DRIVE_WAVE;
+static motor_done_callback_t motor_on_done = NULL;
+
+/// Moves requested by core0. A move is underway until core1 has completed
+/// as many
+static uint32_t motor_requested = 0;
+
+/// Everything below is only written by core1, but for the edge ring's tail
+static uint8_t motor_phase = 0;
+static uint8_t motor_phase_stride = 2;
+
+/// First word of a command whose argument word has not arrived yet, or 0
+static uint32_t motor_command_pending = 0;
+
+/// Step periods while accelerating from standstill at MOTOR_ACCELERATION, the
+/// last entry being the cruise period. Decelerating walks the table backwards
+static uint32_t motor_ramp[MOTOR_RAMP_MAX_STEPS];
+static uint32_t motor_ramp_steps;
+
+/// Moves core1 has started and ended. The step count belongs to the newest
+/// started move and is reset before the start is published
+volatile static uint32_t motor_accepted = 0;
+volatile static uint32_t motor_completed = 0;
+volatile static uint32_t motor_steps = 0;
+
+volatile static bool motor_running = false;
+volatile static uint32_t motor_target;
+static motor_speed_t motor_speed;
+static motor_stop_t motor_stop;
+volatile static bool motor_stop_hit;
+
+volatile static uint32_t motor_pos = 0;
+volatile static uint64_t motor_last_step_us;
+volatile static uint32_t motor_period;
+
+volatile static uint32_t motor_piezo_count = 0;
+
+/// Single producer (opto IRQ on core1), single consumer (core0) ring of
+/// captured edges. Each side only ever writes its own index
+static motor_edge_t motor_edges[MOTOR_EDGE_BUFFER_SIZE];
+volatile static uint32_t motor_edge_head = 0;
+volatile static uint32_t motor_edge_tail = 0;
+
+void init_motor() {
+    if (!motor_initialized) {
+        hal_gpio_init_outputs(MOTOR_COIL_MASK);
+
+        // Opto fork is an input pulled up, with both edges captured. Piezo
+        // sensor is an input pulled up, pulled low by a falling pill
+        hal_gpio_init_input(OPTO_FORK_PIN);
+        hal_gpio_init_input(PIEZO_SENSOR_PIN);
+
+        // Their interrupts are enabled from core1 so that it handles them
+        hal_core1_launch(motor_core1_setup, motor_run_command);
+        hal_core0_set_receiver(motor_core0_receive);
+
+        motor_initialized = true;
+
+        motor_set_drive_mode(MOTOR_DEFAULT_DRIVE_MODE);
+        motor_set_cruise_period(MOTOR_CRUISE_PERIOD_US);
+    }
+}
+
+static void motor_core1_setup() {
+    // The step alarm and these fire on core1, away from the radio, EEPROM
+    // and everything else core0 does
+    hal_gpio_set_irq(OPTO_FORK_PIN, OPTO_IRQ_EVENT_MASK, opto_irq_handler);
+    hal_gpio_set_irq(PIEZO_SENSOR_PIN, PIEZO_IRQ_EVENT_MASK,
+                     piezo_irq_handler);
+}
+
+static void motor_run_command(uint32_t word) {
+    uint32_t command = motor_command_pending;
+
+    // Commands with an argument word are run once it has arrived too
+    if (command != 0) {
+        motor_command_pending = 0;
+
+        if ((command & 0xFF) == MOTOR_COMMAND_START) {
+            motor_begin(word, MOTOR_COMMAND_ARG0(command),
+                        MOTOR_COMMAND_ARG1(command));
+        } else {
+            motor_build_ramp(word);
+        }
+        return;
+    }
+
+    switch ((motor_command_t)(word & 0xFF)) {
+    case MOTOR_COMMAND_START:
+    case MOTOR_COMMAND_CRUISE_PERIOD:
+        // A start without arguments is 0, the flag keeps it apart
+        motor_command_pending = word | MOTOR_COMMAND_HAS_ARG;
+        break;
+
+    case MOTOR_COMMAND_STEP_SINGLE:
+        motor_advance();
+        break;
+
+    case MOTOR_COMMAND_DRIVE_MODE:
+        motor_apply_drive_mode(MOTOR_COMMAND_ARG0(word));
+        break;
+
+    default:
+        LOG_ERROR("Unknown motor command %d\n", word);
+        break;
+    }
+}
+
+static void motor_core0_receive(uint32_t word) {
+    if (word == MOTOR_EVENT_DONE && motor_on_done != NULL) {
+        motor_on_done();
+    }
+}
+
+static uint32_t isqrt(uint32_t n) {
+    uint32_t res = 0;
+    uint32_t bit = 1u << 30;
+
+    while (bit > n) {
+        bit >>= 2;
+    }
+
+    while (bit != 0) {
+        if (n >= res + bit) {
+            n -= res + bit;
+            res = (res >> 1) + bit;
+        } else {
+            res >>= 1;
+        }
+        bit >>= 2;
+    }
+
+    return res;
+}
+
+void motor_set_cruise_period(uint32_t period_us) {
+    if (motor_busy()) {
+        LOG_WARN("Cannot change motor speed while moving\n");
+        return;
+    }
+
+    hal_core1_send(
+        MOTOR_COMMAND_WORD(MOTOR_COMMAND_CRUISE_PERIOD, 0, 0));
+    hal_core1_send(period_us);
+}
+
+static void motor_build_ramp(uint32_t period_us) {
+    uint32_t start_speed;
+    uint32_t speed;
+    uint32_t period;
+
+    // v_n = sqrt(v_0^2 + 2an) for constant acceleration a
+    start_speed = US_PER_S / MOTOR_STEP_PERIOD_US;
+    motor_ramp_steps = 0;
+    do {
+        speed = isqrt(start_speed * start_speed +
+                      2 * MOTOR_ACCELERATION * motor_ramp_steps);
+        period = US_PER_S / speed;
+        if (period < period_us) {
+            period = period_us;
+        }
+
+        motor_ramp[motor_ramp_steps] = period;
+        ++motor_ramp_steps;
+    } while (period > period_us && motor_ramp_steps < MOTOR_RAMP_MAX_STEPS);
+
+    LOG_DEBUG("Motor ramps up to %d us/step in %d steps\n", period,
+              motor_ramp_steps);
+}
+
+void motor_set_drive_mode(motor_drive_t mode) {
+    if (motor_busy()) {
+        LOG_WARN("Cannot change drive mode while moving\n");
+        return;
+    }
+
+    motor_drive = mode;
+    hal_core1_send(
+        MOTOR_COMMAND_WORD(MOTOR_COMMAND_DRIVE_MODE, mode, 0));
+}
+
+static void motor_apply_drive_mode(motor_drive_t mode) {
+    switch (mode) {
+    case MOTOR_DRIVE_FULL:
+        motor_phase |= 1;
+        motor_phase_stride = 2;
+        break;
+
+    case MOTOR_DRIVE_HALF:
+        motor_phase_stride = 1;
+        break;
+
+    default:
+        motor_phase &= ~1;
+        motor_phase_stride = 2;
+        break;
+    }
+}
+
+motor_drive_t motor_drive_mode() { return motor_drive; }
+
+uint32_t motor_steps_per_full_step() {
+    return motor_drive == MOTOR_DRIVE_HALF ? 2 : 1;
+}
+
+void motor_step_single() {
+    hal_core1_send(
+        MOTOR_COMMAND_WORD(MOTOR_COMMAND_STEP_SINGLE, 0, 0));
+}
+
+static void motor_advance() {
+    motor_phase = (motor_phase + motor_phase_stride) % MOTOR_NUM_PHASES;
+
+    hal_gpio_put_masked(MOTOR_COIL_MASK, motor_phases[motor_phase]);
+
+    ++motor_pos;
+    motor_last_step_us = hal_time_us();
+}
+
+static bool motor_stop_reached() {
+    switch (motor_stop) {
+    case MOTOR_STOP_OPTO_LOW:
+        return !hal_gpio_get(OPTO_FORK_PIN);
+
+    case MOTOR_STOP_OPTO_HIGH:
+        return hal_gpio_get(OPTO_FORK_PIN);
+
+    default:
+        return false;
+    }
+}
+
+static void opto_irq_handler(uint32_t pin, uint32_t edges) {
+    motor_edge_t* edge;
+    uint32_t head;
+    uint32_t fraction;
+    bool rising;
+
+    // Both bits are set if the pin bounced before we got here, in which case
+    // the current level tells where it settled
+    if ((edges & OPTO_IRQ_EVENT_MASK) == OPTO_IRQ_EVENT_MASK) {
+        rising = hal_gpio_get(OPTO_FORK_PIN);
+    } else {
+        rising = edges & HAL_GPIO_EDGE_RISE;
+    }
+
+    if ((rising && motor_stop == MOTOR_STOP_OPTO_HIGH) ||
+        (!rising && motor_stop == MOTOR_STOP_OPTO_LOW)) {
+        motor_stop_hit = true;
+    }
+
+    head = motor_edge_head;
+    if (head - motor_edge_tail >= MOTOR_EDGE_BUFFER_SIZE) {
+        // Full, keep the oldest edges
+        return;
+    }
+    edge = &motor_edges[head % MOTOR_EDGE_BUFFER_SIZE];
+
+    // The edge happened somewhere between the last step and the next one
+    edge->time_us = hal_time_us();
+    fraction = 0;
+    if (motor_running && motor_period != 0) {
+        fraction = ((edge->time_us - motor_last_step_us)
+                    << MOTOR_EDGE_FRACTION_BITS) /
+                   motor_period;
+        if (fraction >= (1u << MOTOR_EDGE_FRACTION_BITS)) {
+            fraction = (1u << MOTOR_EDGE_FRACTION_BITS) - 1;
+        }
+    }
+    edge->position = (motor_pos << MOTOR_EDGE_FRACTION_BITS) + fraction;
+    edge->rising = rising;
+
+    motor_edge_head = head + 1;
+
+    TRACE(TRACE_EVENT_OPTO_EDGE, rising, edge->position);
+}
+
+static void piezo_irq_handler(uint32_t pin, uint32_t edges) {
+    ++motor_piezo_count;
+
+    TRACE(TRACE_EVENT_PIEZO_HIT, motor_piezo_count, 0);
+}
+
+bool motor_pop_edge(motor_edge_t* edge) {
+    uint32_t tail = motor_edge_tail;
+
+    if (tail == motor_edge_head) {
+        return false;
+    }
+
+    *edge = motor_edges[tail % MOTOR_EDGE_BUFFER_SIZE];
+    motor_edge_tail = tail + 1;
+
+    return true;
+}
+
+void motor_flush_edges() { motor_edge_tail = motor_edge_head; }
+
+static uint32_t motor_next_period() {
+    uint32_t idx;
+    uint32_t remaining;
+
+    if (motor_speed == MOTOR_SPEED_CRAWL) {
+        return MOTOR_STEP_PERIOD_US;
+    }
+
+    // Accelerate from the start, decelerate towards the end and cruise in
+    // between. Short moves never reach cruise and form a triangle instead
+    idx = motor_steps;
+    remaining = motor_target - motor_steps - 1;
+    if (remaining < idx) {
+        idx = remaining;
+    }
+    if (idx >= motor_ramp_steps) {
+        idx = motor_ramp_steps - 1;
+    }
+
+    return motor_ramp[idx];
+}
+
+/// Releases the coils and signals core0 that the move is done
+static void motor_finish() {
+    motor_running = false;
+
+    // Holding the rotor is not needed between moves, the gearbox keeps it in
+    // place. Stepping picks up from the phase it was left at
+    hal_gpio_put_masked(MOTOR_COIL_MASK, 0);
+
+    // Everything about the move must be visible to core0 before it ends
+    hal_memory_barrier();
+    ++motor_completed;
+
+    TRACE(TRACE_EVENT_MOTOR_DONE, motor_steps, motor_pos);
+
+    // Core0 drains its FIFO from an interrupt, so this never waits for long
+    hal_core0_send(MOTOR_EVENT_DONE);
+}
+
+/// Runs in interrupt context. Returning a positive value reschedules the alarm
+/// relative to when it was due, so the step period does not drift with the
+/// time spent in here
+static int64_t motor_alarm_callback(hal_alarm_id_t id, void* user_data) {
+    if (motor_steps >= motor_target || motor_stop_hit) {
+        motor_finish();
+        return 0;
+    }
+
+    motor_advance();
+    ++motor_steps;
+
+    if (motor_steps >= motor_target) {
+        motor_finish();
+        return 0;
+    }
+
+    motor_period = motor_next_period();
+    return motor_period;
+}
+
+bool motor_start(uint32_t steps, motor_speed_t speed, motor_stop_t stop) {
+    if (motor_busy()) {
+        LOG_WARN("Motor is already moving\n");
+        return false;
+    }
+
+    ++motor_requested;
+    hal_core1_send(
+        MOTOR_COMMAND_WORD(MOTOR_COMMAND_START, speed, stop));
+    hal_core1_send(steps);
+
+    return true;
+}
+
+static void motor_begin(uint32_t steps, motor_speed_t speed,
+                        motor_stop_t stop) {
+    motor_steps = 0;
+    motor_target = steps;
+    motor_speed = speed;
+    motor_stop = stop;
+    // An edge is only seen when the opto fork changes, so check whether the
+    // move is already where it should stop
+    motor_stop_hit = motor_stop_reached();
+    motor_period = motor_next_period();
+    motor_running = true;
+
+    hal_memory_barrier();
+    ++motor_accepted;
+
+    if (hal_alarm_add(motor_period, motor_alarm_callback, NULL) < 0) {
+        LOG_ERROR("No free alarm slots for the motor\n");
+        motor_finish();
+    }
+}
+
+void motor_set_done_callback(motor_done_callback_t callback) {
+    motor_on_done = callback;
+}
+
+bool motor_busy() { return motor_completed != motor_requested; }
+
+uint32_t motor_position() { return motor_pos; }
+
+uint32_t motor_steps_taken() {
+    // Until core1 has picked up the newest move, the count is the last one's
+    if (motor_accepted != motor_requested) {
+        return 0;
+    }
+
+    hal_memory_barrier();
+    return motor_steps;
+}
+
+uint32_t motor_piezo_hits() { return motor_piezo_count; }
+
+uint32_t motor_wait(watchdog_feed_reason_t reason) {
+    uint32_t fed_at = 0;
+
+    while (motor_busy()) {
+        if (motor_steps_taken() - fed_at >= WATCHDOG_FEED_FREQ) {
+            fed_at = motor_steps_taken();
+            feed_watchdog(reason);
+        }
+
+        hal_sleep_ms(MOTOR_WAIT_POLL_MS);
+    }
+
+    return motor_steps_taken();
+}
+
+#undef MOTOR_WAIT_POLL_MS
+#undef WATCHDOG_FEED_FREQ
+#undef US_PER_S
+#undef MOTOR_COIL_A
+#undef MOTOR_COIL_B
+#undef MOTOR_COIL_C
+#undef MOTOR_COIL_D
+#undef MOTOR_COIL_MASK
+#undef MOTOR_NUM_PHASES
+#undef OPTO_IRQ_EVENT_MASK
+#undef PIEZO_IRQ_EVENT_MASK
+#undef MOTOR_COMMAND_WORD
+#undef MOTOR_COMMAND_ARG0
+#undef MOTOR_COMMAND_ARG1
+#undef MOTOR_COMMAND_HAS_ARG
+#undef MOTOR_EVENT_DONE
@@ -0,0 +1,125 @@
+#ifndef MOTOR_H
+#define MOTOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "watchdog.h"
+
+/// Step period used when starting from standstill and for moves that end on a
+/// stop condition
+#define MOTOR_STEP_PERIOD_US (10 * 1000)
+
+/// Default step period once a move has ramped up to full speed
+#define MOTOR_CRUISE_PERIOD_US 2500
+
+/// Acceleration used for the ramps, in steps/s^2
+#define MOTOR_ACCELERATION 2000
+
+/// Maximum number of steps a ramp may take
+#define MOTOR_RAMP_MAX_STEPS 128
+
+/// Drive mode used after initialization
+#define MOTOR_DEFAULT_DRIVE_MODE MOTOR_DRIVE_FULL
+
+/// Step count used for moves that should only end on their stop condition
+#define MOTOR_UNLIMITED_STEPS UINT32_MAX
+
+/// Number of opto fork edges buffered until they are consumed. Power of two
+#define MOTOR_EDGE_BUFFER_SIZE 16
+
+/// Fractional bits of an edge position
+#define MOTOR_EDGE_FRACTION_BITS 8
+#define MOTOR_EDGE_HALF_STEP (1u << (MOTOR_EDGE_FRACTION_BITS - 1))
+
+typedef enum {
+    /// One coil at a time. Weakest torque
+    MOTOR_DRIVE_WAVE,
+    /// Two adjacent coils at a time. Same step size as wave drive
+    MOTOR_DRIVE_FULL,
+    /// Alternates between one and two coils. Twice as many steps per rotation
+    MOTOR_DRIVE_HALF,
+} motor_drive_t;
+
+typedef enum {
+    /// Ramp up to the cruise period and back down before the last step
+    MOTOR_SPEED_CRUISE,
+    /// Take every step at MOTOR_STEP_PERIOD_US
+    MOTOR_SPEED_CRAWL,
+} motor_speed_t;
+
+typedef enum {
+    MOTOR_STOP_NEVER,
+    /// Stop as soon as the opto fork sees light (pin goes low)
+    MOTOR_STOP_OPTO_LOW,
+    /// Stop as soon as the opto fork is blocked (pin goes high)
+    MOTOR_STOP_OPTO_HIGH,
+} motor_stop_t;
+
+typedef struct {
+    /// Motor position at the edge in 1/256 steps, interpolated between the
+    /// steps around it
+    uint32_t position;
+    uint64_t time_us;
+    /// Whether the fork got blocked (pin went high)
+    bool rising;
+} motor_edge_t;
+
+/// Called in interrupt context on core0 once a move has ended
+typedef void (*motor_done_callback_t)(void);
+
+/// Initializes the step engine and launches it on core1, which handles the
+/// step alarm, the opto fork and the piezo sensor on its own. The functions
+/// below are called from core0 and pass commands to core1 through the
+/// multicore FIFO, so core1 must not be used for anything else
+void init_motor(void);
+
+/// Sets the step period moves with a fixed step count ramp up to and rebuilds
+/// the ramp table. Clamped between the ramp table limits
+void motor_set_cruise_period(uint32_t period_us);
+
+/// Selects how the coils are driven from the next step on
+void motor_set_drive_mode(motor_drive_t mode);
+
+/// Gets the current drive mode
+motor_drive_t motor_drive_mode(void);
+
+/// Gets the number of steps in the current drive mode that make up a single
+/// full step
+uint32_t motor_steps_per_full_step(void);
+
+/// Turns the stepper motor by a single step right away
+void motor_step_single(void);
+
+/// Starts a background move of at most `steps` steps that ends early once the
+/// stop condition is met. Cruising moves follow a trapezoidal speed profile,
+/// unlimited ones only ramp up. The coils are switched off once the move
+/// ends. Returns false if a move is already underway
+bool motor_start(uint32_t steps, motor_speed_t speed, motor_stop_t stop);
+
+/// Sets the callback run whenever a background move ends, or NULL for none
+void motor_set_done_callback(motor_done_callback_t callback);
+
+/// Checks whether a background move is underway
+bool motor_busy(void);
+
+/// Gets the number of steps taken by the current or last move
+uint32_t motor_steps_taken(void);
+
+/// Gets the number of times the piezo sensor has triggered. Wraps around
+uint32_t motor_piezo_hits(void);
+
+/// Gets the number of steps taken since initialization. Wraps around
+uint32_t motor_position(void);
+
+/// Pops the oldest captured opto fork edge. Returns false if there is none
+bool motor_pop_edge(motor_edge_t* edge);
+
+/// Discards all captured opto fork edges
+void motor_flush_edges(void);
+
+/// Blocks until the current move has finished, feeding the watchdog with the
+/// given reason. Returns the number of steps taken
+uint32_t motor_wait(watchdog_feed_reason_t reason);
+
+#endif
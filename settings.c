@@ -0,0 +1,124 @@
+#include "settings.h"
+#include "debug.h"
+#include "eeprom.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SETTINGS_MAGIC 0x5044
+
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint8_t version;
+    /// Size of the payload as saved, which may be shorter than settings_t
+    uint8_t size;
+    settings_t payload;
+    uint16_t crc;
+} settings_block_t;
+
+_Static_assert(sizeof(settings_block_t) <= EEPROM_PAGE_SIZE,
+               "Settings must fit in a single EEPROM page");
+_Static_assert(EEPROM_SETTINGS_ADDRESS % EEPROM_PAGE_SIZE == 0,
+               "Settings must start at an EEPROM page");
+
+/// Fills the settings with their defaults
+static void settings_defaults(settings_t* defaults);
+
+static bool settings_initialized = false;
+static bool settings_dirty = false;
+
+static settings_t settings;
+
+static void settings_defaults(settings_t* defaults) {
+    int64_t legacy;
+
+    memset(defaults, 0, sizeof(*defaults));
+    defaults->seconds_per_pill = SETTINGS_DEFAULT_SECONDS_PER_PILL;
+    defaults->num_pills = SETTINGS_DEFAULT_NUM_PILLS;
+
+    // Keep the calibration of devices from before the settings block
+    legacy = eeprom_read_long(EEPROM_LEGACY_STEPS_PER_REVOLUTION_ADDRESS);
+    if (legacy != -1 && legacy != UINT32_MAX) {
+        defaults->steps_per_rotation = (uint32_t)legacy;
+    }
+}
+
+settings_status_t init_settings() {
+    settings_block_t block;
+    uint16_t crc;
+    uint8_t size;
+
+    if (settings_initialized) {
+        return SETTINGS_LOADED;
+    }
+
+    init_eeprom();
+    settings_initialized = true;
+
+    if (!eeprom_read(EEPROM_SETTINGS_ADDRESS, (uint8_t*)&block,
+                     sizeof(block))) {
+        settings_defaults(&settings);
+        return SETTINGS_READ_FAILED;
+    }
+
+    // The CRC directly follows the payload as it was saved
+    size = block.size;
+    if (block.magic != SETTINGS_MAGIC || block.version > SETTINGS_VERSION ||
+        size > sizeof(settings_t)) {
+        LOG_WARN("No valid settings found, using defaults\n");
+        settings_defaults(&settings);
+        settings_dirty = true;
+        return SETTINGS_DEFAULTED;
+    }
+
+    memcpy(&crc, (uint8_t*)&block.payload + size, sizeof(crc));
+    if (crc != eeprom_crc16((uint8_t*)&block,
+                            offsetof(settings_block_t, payload) + size)) {
+        LOG_WARN("Settings failed CRC check, using defaults\n");
+        settings_defaults(&settings);
+        settings_dirty = true;
+        return SETTINGS_DEFAULTED;
+    }
+
+    settings_defaults(&settings);
+    memcpy(&settings, &block.payload, size);
+    settings_dirty = block.version != SETTINGS_VERSION;
+
+    LOG_INFO("Loaded settings version %d\n", block.version);
+    return SETTINGS_LOADED;
+}
+
+const settings_t* settings_get() { return &settings; }
+
+settings_t* settings_edit() {
+    settings_dirty = true;
+    return &settings;
+}
+
+bool settings_flush() {
+    settings_block_t block;
+
+    if (!settings_dirty) {
+        return true;
+    }
+
+    block.magic = SETTINGS_MAGIC;
+    block.version = SETTINGS_VERSION;
+    block.size = sizeof(settings_t);
+    block.payload = settings;
+    block.crc =
+        eeprom_crc16((uint8_t*)&block, offsetof(settings_block_t, crc));
+
+    if (!eeprom_write(EEPROM_SETTINGS_ADDRESS, (uint8_t*)&block,
+                      sizeof(block))) {
+        LOG_ERROR("Failed to save settings\n");
+        return false;
+    }
+
+    settings_dirty = false;
+    return true;
+}
+
+#undef SETTINGS_MAGIC
@@ -0,0 +1,59 @@
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SETTINGS_VERSION 3
+
+#define SETTINGS_DEFAULT_SECONDS_PER_PILL 30
+#define SETTINGS_DEFAULT_NUM_PILLS 7
+
+/// Persistent settings. Fields are only ever appended, so blocks saved by an
+/// older version still load with defaults for the fields they lack
+typedef struct __attribute__((packed)) {
+    /// Full steps per rotation from the last calibration, 0 if uncalibrated
+    uint32_t steps_per_rotation;
+    /// Slot the drum was left at after the last completed move
+    uint8_t slot;
+    /// Dispensing schedule and how far along it is
+    uint16_t seconds_per_pill;
+    uint8_t num_pills;
+    uint8_t pills_dropped;
+    /// Lifetime counters
+    uint32_t boot_count;
+    uint32_t total_pills_dropped;
+    uint32_t calibration_count;
+    /// Checksum of the configuration last sent to the LoRa module and what
+    /// state it was left in, see LORA_STATE_CONFIGURED and LORA_STATE_JOINED
+    uint16_t lora_config_crc;
+    uint8_t lora_state;
+    /// Full steps across the calibration slot from the last calibration, 0 if
+    /// unknown
+    uint16_t slot_width;
+} settings_t;
+
+typedef enum {
+    /// A valid block was loaded
+    SETTINGS_LOADED,
+    /// No valid block was found, defaults are used
+    SETTINGS_DEFAULTED,
+    /// The EEPROM could not be read, defaults are used
+    SETTINGS_READ_FAILED,
+} settings_status_t;
+
+/// Loads the settings block into RAM with a single read
+settings_status_t init_settings(void);
+
+/// Gets the settings
+const settings_t* settings_get(void);
+
+/// Gets the settings for modification. They are written back on the next
+/// settings_flush()
+settings_t* settings_edit(void);
+
+/// Writes the settings back with a single page write if they were modified.
+/// Returns false on error
+bool settings_flush(void);
+
+#endif
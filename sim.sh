@@ -0,0 +1,9 @@
+#! /bin/sh
+
+# Builds the simulator and runs it with the given options, e.g. --runs 3
+(
+  cmake -S . -B ./build-sim -DPILL_DISPENSER_SIMULATOR=ON;
+  cd build-sim || exit;
+
+  make -j12 && ./pill-dispenser-sim "$@";
+);
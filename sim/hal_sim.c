@@ -0,0 +1,519 @@
+#include "hal.h"
+#include "sim.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define HAL_SIM_NUM_PINS 30
+#define HAL_SIM_MAX_ALARMS 16
+
+/// UART FIFOs are 32 characters deep, and the transmit interrupt fires once
+/// the FIFO drains to half of that
+#define HAL_SIM_UART_FIFO_DEPTH 32
+#define HAL_SIM_UART_TX_LEVEL (HAL_SIM_UART_FIFO_DEPTH / 2)
+
+/// Bits on the bus per byte, and for the start and stop conditions
+#define HAL_SIM_I2C_BYTE_BITS 9
+#define HAL_SIM_I2C_FRAME_BITS 2
+
+#define HAL_SIM_US_PER_S 1000000ull
+
+/// Time an iteration of a busy-wait loop takes
+#define HAL_SIM_TIGHT_LOOP_US 10
+
+typedef struct {
+    hal_alarm_callback_t callback;
+    void* user_data;
+    uint64_t due_us;
+    sim_event_id_t event;
+    /// Bumped on every use of the slot, so stale ids are told apart
+    uint32_t generation;
+    uint8_t core;
+    bool active;
+} hal_sim_alarm_t;
+
+typedef struct {
+    hal_gpio_handler_t handler;
+    uint32_t edges;
+    uint8_t core;
+} hal_sim_gpio_irq_t;
+
+/// Calls the handler of a pin with the edge in `value`
+static void hal_sim_gpio_event(void* arg, uint32_t value);
+
+/// Runs an alarm callback and reschedules the alarm if it asks for it
+static void hal_sim_alarm_event(void* arg, uint32_t value);
+
+/// Gets the id handed out for an alarm slot
+static hal_alarm_id_t hal_sim_alarm_id(uint32_t slot);
+
+static void hal_sim_deadline_event(void* arg, uint32_t value);
+
+/// Runs the receiver of the core in `value` with the word in `arg`
+static void hal_sim_fifo_event(void* arg, uint32_t value);
+
+/// Runs the UART interrupt handler
+static void hal_sim_uart_event(void* arg, uint32_t value);
+
+/// Shifts the next character out to the modem
+static void hal_sim_uart_tx_event(void* arg, uint32_t value);
+
+/// Ends the I2C transfer underway
+static void hal_sim_i2c_event(void* arg, uint32_t value);
+
+/// Fails the run once the watchdog timeout has passed without an update
+static void hal_sim_watchdog_event(void* arg, uint32_t value);
+
+/// Core the code running at the moment belongs to. Core1 work is invisible to
+/// core0, so its events never end a wait for an interrupt on core0
+static uint8_t hal_sim_core = 0;
+
+/// Pin levels, and the pins driven from outside rather than pulled up
+static uint32_t hal_sim_levels = 0;
+static uint32_t hal_sim_driven = 0;
+static hal_sim_gpio_irq_t hal_sim_gpio_irqs[HAL_SIM_NUM_PINS];
+static uint16_t hal_sim_pwm_levels[HAL_SIM_NUM_PINS];
+
+static hal_sim_alarm_t hal_sim_alarms[HAL_SIM_MAX_ALARMS];
+
+static hal_callback_t hal_sim_deadline_callback;
+static sim_event_id_t hal_sim_deadline = SIM_INVALID_EVENT;
+
+static hal_word_handler_t hal_sim_receivers[2];
+
+static hal_callback_t hal_sim_uart_handler;
+static bool hal_sim_uart_rx_irq = false;
+static bool hal_sim_uart_tx_irq = false;
+static char hal_sim_uart_rx[HAL_SIM_UART_FIFO_DEPTH];
+static uint32_t hal_sim_uart_rx_head = 0;
+static uint32_t hal_sim_uart_rx_tail = 0;
+static char hal_sim_uart_tx[HAL_SIM_UART_FIFO_DEPTH];
+static uint32_t hal_sim_uart_tx_head = 0;
+static uint32_t hal_sim_uart_tx_tail = 0;
+static uint32_t hal_sim_uart_overruns = 0;
+
+static uint32_t hal_sim_i2c_baud;
+static bool hal_sim_i2c_busy = false;
+static const uint8_t* hal_sim_i2c_tx;
+static size_t hal_sim_i2c_tx_len;
+static uint8_t* hal_sim_i2c_rx;
+static size_t hal_sim_i2c_rx_len;
+static hal_i2c_callback_t hal_sim_i2c_callback;
+static uint32_t hal_sim_i2c_transfers = 0;
+static uint32_t hal_sim_i2c_nacks = 0;
+
+static uint64_t hal_sim_watchdog_timeout_us = 0;
+static sim_event_id_t hal_sim_watchdog = SIM_INVALID_EVENT;
+static uint64_t hal_sim_watchdog_fed_us = 0;
+static uint64_t hal_sim_watchdog_longest_us = 0;
+
+void hal_init() {
+    // Keeps the firmware logs in order with the simulation's own
+    setvbuf(stdout, NULL, _IOLBF, 0);
+}
+
+uint64_t hal_time_us() { return sim_now(); }
+
+void hal_sleep_ms(uint32_t ms) {
+    sim_run_until(sim_now() + (uint64_t)ms * 1000);
+}
+
+void hal_tight_loop() { sim_run_until(sim_now() + HAL_SIM_TIGHT_LOOP_US); }
+
+uint32_t hal_irq_disable() {
+    // Events only run while the firmware waits, so nothing ever interrupts
+    // it in between
+    return 0;
+}
+
+void hal_irq_restore(uint32_t state) {}
+
+void hal_wait_for_interrupt() { sim_wait_for_interrupt(); }
+
+void hal_memory_barrier() {}
+
+uint32_t hal_shared_lock() { return 0; }
+
+void hal_shared_unlock(uint32_t state) {}
+
+void hal_gpio_init_input(uint32_t pin) {
+    if (!(hal_sim_driven & (1u << pin))) {
+        hal_sim_levels |= 1u << pin;
+    }
+}
+
+void hal_gpio_init_outputs(uint32_t mask) {
+    hal_sim_levels &= ~mask;
+    sim_drum_coils(hal_sim_levels);
+}
+
+bool hal_gpio_get(uint32_t pin) { return hal_sim_levels & (1u << pin); }
+
+void hal_gpio_put_masked(uint32_t mask, uint32_t value) {
+    hal_sim_levels = (hal_sim_levels & ~mask) | (value & mask);
+    sim_drum_coils(hal_sim_levels);
+}
+
+void hal_gpio_set_irq(uint32_t pin, uint32_t edges,
+                      hal_gpio_handler_t handler) {
+    hal_sim_gpio_irqs[pin].handler = handler;
+    hal_sim_gpio_irqs[pin].edges = edges;
+    hal_sim_gpio_irqs[pin].core = hal_sim_core;
+}
+
+void sim_gpio_drive(uint32_t pin, bool level) {
+    hal_sim_gpio_irq_t* irq = &hal_sim_gpio_irqs[pin];
+    uint32_t edge;
+
+    hal_sim_driven |= 1u << pin;
+    if (hal_gpio_get(pin) == level) {
+        return;
+    }
+
+    if (level) {
+        hal_sim_levels |= 1u << pin;
+        edge = HAL_GPIO_EDGE_RISE;
+    } else {
+        hal_sim_levels &= ~(1u << pin);
+        edge = HAL_GPIO_EDGE_FALL;
+    }
+
+    if (irq->handler != NULL && (irq->edges & edge)) {
+        sim_schedule(sim_now(),
+                     irq->core == 0 ? SIM_EVENT_INTERRUPT : SIM_EVENT_MODEL,
+                     hal_sim_gpio_event, irq, pin | edge << 8);
+    }
+}
+
+static void hal_sim_gpio_event(void* arg, uint32_t value) {
+    hal_sim_gpio_irq_t* irq = arg;
+
+    hal_sim_core = irq->core;
+    irq->handler(value & 0xff, value >> 8);
+    hal_sim_core = 0;
+}
+
+void hal_pwm_init(uint32_t pin, uint16_t wrap, float clkdiv) {
+    hal_pwm_set_level(pin, 0);
+}
+
+void hal_pwm_set_level(uint32_t pin, uint16_t level) {
+    if (hal_sim_pwm_levels[pin] != level) {
+        hal_sim_pwm_levels[pin] = level;
+        sim_operator_led(pin, level);
+    }
+}
+
+static hal_alarm_id_t hal_sim_alarm_id(uint32_t slot) {
+    return (hal_alarm_id_t)(hal_sim_alarms[slot].generation *
+                                HAL_SIM_MAX_ALARMS +
+                            slot + 1);
+}
+
+hal_alarm_id_t hal_alarm_add(uint64_t delay_us, hal_alarm_callback_t callback,
+                             void* user_data) {
+    hal_sim_alarm_t* alarm;
+    uint32_t slot;
+
+    for (slot = 0; slot < HAL_SIM_MAX_ALARMS; ++slot) {
+        if (!hal_sim_alarms[slot].active) {
+            break;
+        }
+    }
+    if (slot == HAL_SIM_MAX_ALARMS) {
+        return -1;
+    }
+
+    alarm = &hal_sim_alarms[slot];
+    alarm->callback = callback;
+    alarm->user_data = user_data;
+    alarm->due_us = sim_now() + delay_us;
+    alarm->core = hal_sim_core;
+    alarm->generation = (alarm->generation + 1) % (1u << 16);
+    alarm->event = sim_schedule(
+        alarm->due_us,
+        alarm->core == 0 ? SIM_EVENT_INTERRUPT : SIM_EVENT_MODEL,
+        hal_sim_alarm_event, alarm, slot);
+    if (alarm->event == SIM_INVALID_EVENT) {
+        return -1;
+    }
+    alarm->active = true;
+
+    return hal_sim_alarm_id(slot);
+}
+
+bool hal_alarm_cancel(hal_alarm_id_t id) {
+    uint32_t slot;
+
+    if (id <= 0) {
+        return false;
+    }
+
+    slot = (id - 1) % HAL_SIM_MAX_ALARMS;
+    if (!hal_sim_alarms[slot].active || hal_sim_alarm_id(slot) != id) {
+        return false;
+    }
+
+    hal_sim_alarms[slot].active = false;
+    return sim_cancel(hal_sim_alarms[slot].event);
+}
+
+static void hal_sim_alarm_event(void* arg, uint32_t value) {
+    hal_sim_alarm_t* alarm = arg;
+    int64_t next;
+
+    hal_sim_core = alarm->core;
+    next = alarm->callback(hal_sim_alarm_id(value), alarm->user_data);
+    hal_sim_core = 0;
+
+    // Cancelled from its own callback
+    if (!alarm->active) {
+        return;
+    }
+
+    if (next == 0) {
+        alarm->active = false;
+        return;
+    }
+
+    if (next > 0) {
+        alarm->due_us += next;
+    } else {
+        alarm->due_us = sim_now() - next;
+    }
+    alarm->event = sim_schedule(
+        alarm->due_us,
+        alarm->core == 0 ? SIM_EVENT_INTERRUPT : SIM_EVENT_MODEL,
+        hal_sim_alarm_event, alarm, value);
+}
+
+void hal_deadline_init(hal_callback_t callback) {
+    hal_sim_deadline_callback = callback;
+}
+
+bool hal_deadline_set(uint64_t time_us) {
+    hal_deadline_cancel();
+
+    if (time_us <= sim_now()) {
+        return true;
+    }
+
+    hal_sim_deadline = sim_schedule(time_us, SIM_EVENT_INTERRUPT,
+                                    hal_sim_deadline_event, NULL, 0);
+    return false;
+}
+
+void hal_deadline_cancel() {
+    sim_cancel(hal_sim_deadline);
+    hal_sim_deadline = SIM_INVALID_EVENT;
+}
+
+static void hal_sim_deadline_event(void* arg, uint32_t value) {
+    hal_sim_deadline = SIM_INVALID_EVENT;
+    hal_sim_deadline_callback();
+}
+
+void hal_core1_launch(hal_callback_t setup, hal_word_handler_t receiver) {
+    hal_sim_receivers[1] = receiver;
+
+    hal_sim_core = 1;
+    setup();
+    hal_sim_core = 0;
+}
+
+void hal_core1_send(uint32_t word) {
+    sim_schedule(sim_now(), SIM_EVENT_MODEL, hal_sim_fifo_event,
+                 (void*)(uintptr_t)word, 1);
+}
+
+void hal_core0_set_receiver(hal_word_handler_t receiver) {
+    hal_sim_receivers[0] = receiver;
+}
+
+void hal_core0_send(uint32_t word) {
+    sim_schedule(sim_now(), SIM_EVENT_INTERRUPT, hal_sim_fifo_event,
+                 (void*)(uintptr_t)word, 0);
+}
+
+static void hal_sim_fifo_event(void* arg, uint32_t value) {
+    if (hal_sim_receivers[value] == NULL) {
+        return;
+    }
+
+    hal_sim_core = value;
+    hal_sim_receivers[value]((uint32_t)(uintptr_t)arg);
+    hal_sim_core = 0;
+}
+
+void hal_uart_init(uint32_t baud, uint32_t tx_pin, uint32_t rx_pin,
+                   uint32_t data_bits, uint32_t stop_bits,
+                   hal_callback_t irq_handler) {
+    hal_sim_uart_handler = irq_handler;
+    hal_sim_uart_rx_irq = true;
+}
+
+void hal_uart_set_irqs(bool rx, bool tx) {
+    hal_sim_uart_rx_irq = rx;
+    hal_sim_uart_tx_irq = tx;
+}
+
+bool hal_uart_readable() {
+    return hal_sim_uart_rx_head != hal_sim_uart_rx_tail;
+}
+
+char hal_uart_getc() {
+    return hal_sim_uart_rx[hal_sim_uart_rx_tail++ % HAL_SIM_UART_FIFO_DEPTH];
+}
+
+bool hal_uart_writable() {
+    return hal_sim_uart_tx_head - hal_sim_uart_tx_tail <
+           HAL_SIM_UART_FIFO_DEPTH;
+}
+
+void hal_uart_putc(char c) {
+    // The shift register is idle, so start sending
+    if (hal_sim_uart_tx_head == hal_sim_uart_tx_tail) {
+        sim_schedule(sim_now() + SIM_UART_CHAR_US, SIM_EVENT_MODEL,
+                     hal_sim_uart_tx_event, NULL, 0);
+    }
+
+    hal_sim_uart_tx[hal_sim_uart_tx_head++ % HAL_SIM_UART_FIFO_DEPTH] = c;
+}
+
+void sim_uart_send(char c) {
+    if (hal_sim_uart_rx_head - hal_sim_uart_rx_tail >=
+        HAL_SIM_UART_FIFO_DEPTH) {
+        ++hal_sim_uart_overruns;
+        return;
+    }
+
+    hal_sim_uart_rx[hal_sim_uart_rx_head++ % HAL_SIM_UART_FIFO_DEPTH] = c;
+
+    if (hal_sim_uart_rx_irq) {
+        sim_schedule(sim_now(), SIM_EVENT_INTERRUPT, hal_sim_uart_event, NULL,
+                     0);
+    }
+}
+
+static void hal_sim_uart_event(void* arg, uint32_t value) {
+    if (hal_sim_uart_handler != NULL) {
+        hal_sim_uart_handler();
+    }
+}
+
+static void hal_sim_uart_tx_event(void* arg, uint32_t value) {
+    sim_modem_receive(
+        hal_sim_uart_tx[hal_sim_uart_tx_tail++ % HAL_SIM_UART_FIFO_DEPTH]);
+
+    if (hal_sim_uart_tx_head != hal_sim_uart_tx_tail) {
+        sim_schedule(sim_now() + SIM_UART_CHAR_US, SIM_EVENT_MODEL,
+                     hal_sim_uart_tx_event, NULL, 0);
+    }
+
+    if (hal_sim_uart_tx_irq && hal_sim_uart_tx_head - hal_sim_uart_tx_tail ==
+                                   HAL_SIM_UART_TX_LEVEL) {
+        sim_schedule(sim_now(), SIM_EVENT_INTERRUPT, hal_sim_uart_event, NULL,
+                     0);
+    }
+}
+
+void hal_i2c_init(uint32_t baud, uint32_t sda_pin, uint32_t scl_pin,
+                  uint8_t device_addr) {
+    hal_sim_i2c_baud = baud;
+}
+
+void hal_i2c_transfer(const uint8_t* tx, size_t tx_len, uint8_t* rx,
+                      size_t rx_len, hal_i2c_callback_t callback) {
+    uint64_t bits;
+
+    if (hal_sim_i2c_busy) {
+        sim_fail("I2C transfer started while another was underway\n");
+    }
+
+    hal_sim_i2c_busy = true;
+    hal_sim_i2c_tx = tx;
+    hal_sim_i2c_tx_len = tx_len;
+    hal_sim_i2c_rx = rx;
+    hal_sim_i2c_rx_len = rx_len;
+    hal_sim_i2c_callback = callback;
+
+    // Each part is addressed separately, the read after a restart
+    bits = HAL_SIM_I2C_FRAME_BITS + HAL_SIM_I2C_BYTE_BITS * tx_len;
+    if (tx_len != 0) {
+        bits += HAL_SIM_I2C_BYTE_BITS;
+    }
+    if (rx_len != 0) {
+        bits += HAL_SIM_I2C_BYTE_BITS * (rx_len + 1);
+    }
+
+    sim_schedule(sim_now() + bits * HAL_SIM_US_PER_S / hal_sim_i2c_baud,
+                 SIM_EVENT_INTERRUPT, hal_sim_i2c_event, NULL, 0);
+}
+
+static void hal_sim_i2c_event(void* arg, uint32_t value) {
+    bool success;
+
+    success = sim_eeprom_transfer(hal_sim_i2c_tx, hal_sim_i2c_tx_len,
+                                  hal_sim_i2c_rx, hal_sim_i2c_rx_len);
+
+    ++hal_sim_i2c_transfers;
+    if (!success) {
+        ++hal_sim_i2c_nacks;
+    }
+
+    hal_sim_i2c_busy = false;
+    hal_sim_i2c_callback(success);
+}
+
+void hal_watchdog_enable(uint32_t timeout_ms) {
+    hal_sim_watchdog_timeout_us = (uint64_t)timeout_ms * 1000;
+    hal_watchdog_update();
+}
+
+void hal_watchdog_update() {
+    uint64_t now = sim_now();
+
+    if (hal_sim_watchdog_timeout_us == 0) {
+        return;
+    }
+
+    if (now - hal_sim_watchdog_fed_us > hal_sim_watchdog_longest_us) {
+        hal_sim_watchdog_longest_us = now - hal_sim_watchdog_fed_us;
+    }
+    hal_sim_watchdog_fed_us = now;
+
+    sim_cancel(hal_sim_watchdog);
+    hal_sim_watchdog = sim_schedule(now + hal_sim_watchdog_timeout_us,
+                                    SIM_EVENT_MODEL, hal_sim_watchdog_event,
+                                    NULL, 0);
+}
+
+bool hal_watchdog_caused_reboot() { return false; }
+
+static void hal_sim_watchdog_event(void* arg, uint32_t value) {
+    sim_fail("Watchdog reset, last updated %llu ms ago\n",
+             (sim_now() - hal_sim_watchdog_fed_us) / 1000);
+}
+
+void sim_hal_report() {
+    sim_log("Watchdog updated at least every %llu ms, timeout %llu ms\n",
+            hal_sim_watchdog_longest_us / 1000,
+            hal_sim_watchdog_timeout_us / 1000);
+    sim_log("%u I2C transfers, %u of them NACKed\n", hal_sim_i2c_transfers,
+            hal_sim_i2c_nacks);
+    if (hal_sim_uart_overruns != 0) {
+        sim_log("%u characters from the modem overran the UART\n",
+                hal_sim_uart_overruns);
+    }
+}
+
+#undef HAL_SIM_NUM_PINS
+#undef HAL_SIM_MAX_ALARMS
+#undef HAL_SIM_UART_FIFO_DEPTH
+#undef HAL_SIM_UART_TX_LEVEL
+#undef HAL_SIM_I2C_BYTE_BITS
+#undef HAL_SIM_I2C_FRAME_BITS
+#undef HAL_SIM_US_PER_S
+#undef HAL_SIM_TIGHT_LOOP_US
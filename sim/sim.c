@@ -0,0 +1,297 @@
+#include "sim.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define SIM_HEAP_PARENT(i) (((i) - 1) / 2)
+#define SIM_HEAP_LEFT(i) (2 * (i) + 1)
+
+/// Event ids carry a generation above the slot, so that a stale id never
+/// cancels the next event in its slot
+#define SIM_SLOT_BITS 8
+#define SIM_SLOT_MASK ((1u << SIM_SLOT_BITS) - 1)
+
+typedef struct {
+    uint64_t time_us;
+    /// Breaks ties between events due at the same time
+    uint64_t seq;
+    sim_event_kind_t kind;
+    sim_handler_t handler;
+    void* arg;
+    uint32_t value;
+    uint32_t generation;
+    /// Index in the heap, only valid while pending
+    uint32_t heap_pos;
+    bool pending;
+} sim_event_t;
+
+/// Checks whether event `a` is due before event `b`
+static bool sim_before(uint32_t a, uint32_t b);
+
+/// Swaps two heap entries and updates their positions
+static void sim_heap_swap(uint32_t a, uint32_t b);
+
+/// Moves an entry up until its parent is due before it
+static void sim_heap_up(uint32_t pos);
+
+/// Moves an entry down until its children are due after it
+static void sim_heap_down(uint32_t pos);
+
+/// Removes the entry at the given heap position
+static void sim_heap_remove(uint32_t pos);
+
+/// Prints the time, and the time it took on the host
+static void sim_report(void);
+
+/// Events are allocated from a fixed pool, and the pending ones are kept in a
+/// binary min-heap of pool indices ordered by time
+static sim_event_t sim_events[SIM_MAX_EVENTS];
+static uint32_t sim_heap[SIM_MAX_EVENTS];
+static uint32_t sim_heap_len = 0;
+
+static uint64_t sim_clock_us = 0;
+static uint64_t sim_seq = 0;
+static uint32_t sim_depth = 0;
+static uint64_t sim_events_run = 0;
+static uint64_t sim_interrupts = 0;
+
+static bool sim_finished = false;
+
+uint64_t sim_now() { return sim_clock_us; }
+
+static bool sim_before(uint32_t a, uint32_t b) {
+    if (sim_events[a].time_us != sim_events[b].time_us) {
+        return sim_events[a].time_us < sim_events[b].time_us;
+    }
+
+    return sim_events[a].seq < sim_events[b].seq;
+}
+
+static void sim_heap_swap(uint32_t a, uint32_t b) {
+    uint32_t tmp = sim_heap[a];
+
+    sim_heap[a] = sim_heap[b];
+    sim_heap[b] = tmp;
+
+    sim_events[sim_heap[a]].heap_pos = a;
+    sim_events[sim_heap[b]].heap_pos = b;
+}
+
+static void sim_heap_up(uint32_t pos) {
+    while (pos > 0 &&
+           sim_before(sim_heap[pos], sim_heap[SIM_HEAP_PARENT(pos)])) {
+        sim_heap_swap(pos, SIM_HEAP_PARENT(pos));
+        pos = SIM_HEAP_PARENT(pos);
+    }
+}
+
+static void sim_heap_down(uint32_t pos) {
+    uint32_t child;
+
+    while ((child = SIM_HEAP_LEFT(pos)) < sim_heap_len) {
+        if (child + 1 < sim_heap_len &&
+            sim_before(sim_heap[child + 1], sim_heap[child])) {
+            ++child;
+        }
+
+        if (!sim_before(sim_heap[child], sim_heap[pos])) {
+            break;
+        }
+
+        sim_heap_swap(pos, child);
+        pos = child;
+    }
+}
+
+static void sim_heap_remove(uint32_t pos) {
+    uint32_t moved;
+
+    --sim_heap_len;
+    if (pos == sim_heap_len) {
+        return;
+    }
+
+    // Fill the gap with the last entry, which may belong above or below it
+    moved = sim_heap[sim_heap_len];
+    sim_heap[pos] = moved;
+    sim_events[moved].heap_pos = pos;
+    sim_heap_up(pos);
+    sim_heap_down(sim_events[moved].heap_pos);
+}
+
+sim_event_id_t sim_schedule(uint64_t time_us, sim_event_kind_t kind,
+                            sim_handler_t handler, void* arg, uint32_t value) {
+    sim_event_t* event;
+    uint32_t slot;
+
+    for (slot = 0; slot < SIM_MAX_EVENTS; ++slot) {
+        if (!sim_events[slot].pending) {
+            break;
+        }
+    }
+    if (slot == SIM_MAX_EVENTS) {
+        return SIM_INVALID_EVENT;
+    }
+
+    // Nothing happens in the past
+    if (time_us < sim_clock_us) {
+        time_us = sim_clock_us;
+    }
+
+    event = &sim_events[slot];
+    event->time_us = time_us;
+    event->seq = sim_seq++;
+    event->kind = kind;
+    event->handler = handler;
+    event->arg = arg;
+    event->value = value;
+    event->generation =
+        (event->generation + 1) & (INT32_MAX >> SIM_SLOT_BITS);
+    event->pending = true;
+
+    sim_heap[sim_heap_len] = slot;
+    event->heap_pos = sim_heap_len;
+    ++sim_heap_len;
+    sim_heap_up(event->heap_pos);
+
+    return (sim_event_id_t)(event->generation << SIM_SLOT_BITS | slot);
+}
+
+bool sim_cancel(sim_event_id_t id) {
+    sim_event_t* event;
+
+    if (id < 0 || (id & SIM_SLOT_MASK) >= SIM_MAX_EVENTS) {
+        return false;
+    }
+
+    event = &sim_events[id & SIM_SLOT_MASK];
+    if (!event->pending ||
+        event->generation != (uint32_t)id >> SIM_SLOT_BITS) {
+        return false;
+    }
+
+    event->pending = false;
+    sim_heap_remove(event->heap_pos);
+
+    return true;
+}
+
+void sim_step() {
+    sim_event_t* event;
+    sim_event_kind_t kind;
+
+    if (sim_heap_len == 0) {
+        sim_fail("Nothing left to happen, the firmware waits forever\n");
+    }
+
+    // The firmware only waits outside of interrupts, so events never nest
+    if (sim_depth != 0) {
+        sim_fail("Waited for an event in interrupt context\n");
+    }
+
+    event = &sim_events[sim_heap[0]];
+    event->pending = false;
+    sim_heap_remove(0);
+
+    // The handler may reuse the slot, so nothing is read from it afterwards
+    sim_clock_us = event->time_us;
+    kind = event->kind;
+    if (sim_clock_us >= sim_config.limit_us) {
+        sim_fail("Time limit reached\n");
+    }
+
+    ++sim_depth;
+    event->handler(event->arg, event->value);
+    --sim_depth;
+
+    ++sim_events_run;
+    if (kind == SIM_EVENT_INTERRUPT) {
+        ++sim_interrupts;
+    }
+}
+
+void sim_wait_for_interrupt() {
+    uint64_t interrupts = sim_interrupts;
+
+    while (sim_interrupts == interrupts) {
+        sim_step();
+    }
+}
+
+void sim_run_until(uint64_t time_us) {
+    if (sim_depth != 0) {
+        sim_fail("Waited for time to pass in interrupt context\n");
+    }
+
+    while (sim_heap_len > 0 && sim_events[sim_heap[0]].time_us <= time_us) {
+        sim_step();
+    }
+
+    if (sim_clock_us < time_us) {
+        sim_clock_us = time_us;
+    }
+}
+
+bool sim_in_event() { return sim_depth != 0; }
+
+void sim_log(const char* format, ...) {
+    va_list args;
+
+    printf("[sim %llu.%06llu] ", sim_clock_us / 1000000,
+           sim_clock_us % 1000000);
+
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+static void sim_report() {
+    double host_s = (double)clock() / CLOCKS_PER_SEC;
+    double virtual_s = sim_clock_us / 1e6;
+
+    sim_log("Simulated %.1f s in %.3f s of CPU time, %.0fx real time\n",
+            virtual_s, host_s, host_s > 0 ? virtual_s / host_s : 0.0);
+    sim_log("Ran %llu events, %llu of them interrupts\n", sim_events_run,
+            sim_interrupts);
+}
+
+void sim_finish(bool passed) {
+    // Failing while reporting must not report again
+    if (sim_finished) {
+        exit(EXIT_FAILURE);
+    }
+    sim_finished = true;
+
+    sim_eeprom_save();
+
+    sim_report();
+    sim_hal_report();
+    sim_drum_report();
+    sim_eeprom_report();
+    sim_modem_report();
+
+    sim_log("%s\n", passed ? "PASSED" : "FAILED");
+    fflush(stdout);
+
+    exit(passed ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+void sim_fail(const char* format, ...) {
+    va_list args;
+
+    sim_log("Failure: ");
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+
+    sim_finish(false);
+}
+
+#undef SIM_HEAP_PARENT
+#undef SIM_HEAP_LEFT
+#undef SIM_SLOT_BITS
+#undef SIM_SLOT_MASK
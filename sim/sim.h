@@ -0,0 +1,138 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/// Simulated board the firmware runs on under Linux. hal_sim.c puts the HAL
+/// on top of it. Everything that happens is an event on a virtual clock, and
+/// the clock jumps to the next event whenever the firmware waits, so a run
+/// takes as long as the firmware computes and not a microsecond more
+
+/// Most events that can be pending at once
+#define SIM_MAX_EVENTS 128
+
+/// Returned by sim_schedule() when no event could be scheduled
+#define SIM_INVALID_EVENT (-1)
+
+/// Character time of the LoRa UART, 10 bits at 9600 baud
+#define SIM_UART_CHAR_US 1042
+
+typedef int32_t sim_event_id_t;
+
+/// Runs at the time the event was scheduled for
+typedef void (*sim_handler_t)(void* arg, uint32_t value);
+
+typedef enum {
+    /// Happens within a simulated peripheral, unnoticed by the firmware
+    SIM_EVENT_MODEL,
+    /// Interrupts the firmware, which wakes it from hal_wait_for_interrupt()
+    SIM_EVENT_INTERRUPT,
+} sim_event_kind_t;
+
+typedef struct {
+    /// Number of times the drum is loaded and emptied before the run ends
+    uint32_t runs;
+    /// Compartments left empty when the drum is loaded, bit n for n
+    uint32_t empty_compartments;
+    /// Full steps per drum rotation
+    uint32_t steps_per_rotation;
+    /// Full steps the drum starts away from the opto fork gap
+    uint32_t start_position;
+    /// Whether a modem answers on the UART at all
+    bool modem_present;
+    /// Script for the modem, or NULL for the built in one
+    const char* modem_script;
+    /// Where the EEPROM contents are loaded from and saved to, or NULL
+    const char* eeprom_image;
+    /// Virtual time after which the run fails
+    uint64_t limit_us;
+} sim_config_t;
+
+extern sim_config_t sim_config;
+
+/// Gets the virtual time in microseconds since boot
+uint64_t sim_now(void);
+
+/// Schedules `handler` to run at a virtual time, after anything scheduled for
+/// the same time before it. Returns SIM_INVALID_EVENT if too many are pending
+sim_event_id_t sim_schedule(uint64_t time_us, sim_event_kind_t kind,
+                            sim_handler_t handler, void* arg, uint32_t value);
+
+/// Cancels a pending event. Returns false if it was not pending
+bool sim_cancel(sim_event_id_t id);
+
+/// Runs the next event, moving the clock forward to it. Fails the run if
+/// nothing is left to happen
+void sim_step(void);
+
+/// Runs events until one of them interrupts the firmware
+void sim_wait_for_interrupt(void);
+
+/// Runs every event due until the given time and moves the clock there.
+/// Fails the run if called from an event
+void sim_run_until(uint64_t time_us);
+
+/// Checks whether an event is running, which to the firmware is interrupt
+/// context
+bool sim_in_event(void);
+
+/// Prints a line about the simulation, prefixed with the virtual time
+void sim_log(const char* format, ...);
+
+/// Prints the report and exits, with status 0 if the run passed
+void sim_finish(bool passed);
+
+/// Ends the run as failed
+void sim_fail(const char* format, ...);
+
+/// Drives an input pin from outside, interrupting the firmware if it waits
+/// for the edge
+void sim_gpio_drive(uint32_t pin, bool level);
+
+/// Sends a character from the modem to the firmware
+void sim_uart_send(char c);
+
+/// Tells the drum the coils have changed. Called by hal_sim.c
+void sim_drum_coils(uint32_t levels);
+
+/// Sets the drum up at its start position
+void sim_drum_init(void);
+
+/// Puts a pill in every compartment that is not to be left empty
+void sim_drum_load(void);
+
+/// Gets the number of pills still in the drum
+uint32_t sim_drum_pills_left(void);
+
+void sim_drum_report(void);
+
+/// Transfers bytes to and from the EEPROM as an I2C transfer would. Returns
+/// false if the EEPROM did not acknowledge, as it does while writing
+bool sim_eeprom_transfer(const uint8_t* tx, size_t tx_len, uint8_t* rx,
+                         size_t rx_len);
+
+/// Loads the EEPROM contents from the configured image, if there is one
+void sim_eeprom_init(void);
+
+/// Saves the EEPROM contents to the configured image, if there is one
+void sim_eeprom_save(void);
+
+void sim_eeprom_report(void);
+
+/// Takes a character the firmware sent to the modem. Called by hal_sim.c
+void sim_modem_receive(char c);
+
+/// Loads the modem script
+void sim_modem_init(void);
+
+void sim_modem_report(void);
+
+/// Tells the operator a LED has changed brightness. Called by hal_sim.c
+void sim_operator_led(uint32_t pin, uint16_t level);
+
+/// Prints how the firmware used the HAL. Implemented by hal_sim.c
+void sim_hal_report(void);
+
+#endif
@@ -0,0 +1,187 @@
+#include "sim.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stepper.h"
+
+#define SIM_DRUM_COIL_A (1u << STEPPER_A_PIN)
+#define SIM_DRUM_COIL_B (1u << STEPPER_B_PIN)
+#define SIM_DRUM_COIL_C (1u << STEPPER_C_PIN)
+#define SIM_DRUM_COIL_D (1u << STEPPER_D_PIN)
+#define SIM_DRUM_COIL_MASK                                                     \
+    (SIM_DRUM_COIL_A | SIM_DRUM_COIL_B | SIM_DRUM_COIL_C | SIM_DRUM_COIL_D)
+#define SIM_DRUM_NUM_PHASES 8
+
+/// Width of the gap in the drum the opto fork sees light through, in full
+/// steps
+#define SIM_DRUM_GAP_STEPS 60
+
+/// Time a pill takes to fall onto the piezo sensor, and how long the sensor
+/// pulls its pin low when hit
+#define SIM_DRUM_FALL_US (60 * 1000)
+#define SIM_DRUM_HIT_US 1500
+
+/// Every compartment but the one at the opto fork gap
+#define SIM_DRUM_FULL (((1u << NUM_SLOTS) - 1) & ~1u)
+
+/// Checks the opto fork and the hole at the current position
+static void sim_drum_moved(void);
+
+/// Pulls the piezo sensor pin to `value`
+static void sim_drum_piezo_event(void* arg, uint32_t value);
+
+/// Same half-step sequence the firmware drives the coils with
+static const uint32_t sim_drum_phases[SIM_DRUM_NUM_PHASES] = {
+    SIM_DRUM_COIL_A,
+    SIM_DRUM_COIL_A | SIM_DRUM_COIL_B,
+    SIM_DRUM_COIL_B,
+    SIM_DRUM_COIL_B | SIM_DRUM_COIL_C,
+    SIM_DRUM_COIL_C,
+    SIM_DRUM_COIL_C | SIM_DRUM_COIL_D,
+    SIM_DRUM_COIL_D,
+    SIM_DRUM_COIL_D | SIM_DRUM_COIL_A,
+};
+
+/// Drum position in half steps, with the middle of the gap at 0 and
+/// compartment n a slot per n ahead of it
+static uint32_t sim_drum_position;
+static uint32_t sim_drum_rotation;
+
+/// Phase the coils were last energized in, or -1 before the first step
+static int32_t sim_drum_phase = -1;
+
+/// Bit n is set while compartment n holds a pill
+static uint32_t sim_drum_pills = 0;
+/// Compartment over the hole, or NUM_SLOTS if none is
+static uint32_t sim_drum_over_hole = NUM_SLOTS;
+
+static uint64_t sim_drum_forward = 0;
+static uint64_t sim_drum_backward = 0;
+static uint32_t sim_drum_dropped = 0;
+
+void sim_drum_init() {
+    sim_drum_rotation = 2 * sim_config.steps_per_rotation;
+    sim_drum_position = 2 * sim_config.start_position % sim_drum_rotation;
+
+    sim_gpio_drive(PIEZO_SENSOR_PIN, true);
+    sim_drum_moved();
+}
+
+void sim_drum_load() {
+    uint32_t pills = SIM_DRUM_FULL & ~sim_config.empty_compartments;
+
+    sim_log("Loading the drum with %u pills\n",
+            __builtin_popcount(pills & ~sim_drum_pills));
+    sim_drum_pills |= pills;
+}
+
+uint32_t sim_drum_pills_left() { return __builtin_popcount(sim_drum_pills); }
+
+void sim_drum_coils(uint32_t levels) {
+    uint32_t coils = levels & SIM_DRUM_COIL_MASK;
+    uint32_t delta;
+    int32_t phase;
+
+    // Without current the drum stays where it is
+    if (coils == 0) {
+        return;
+    }
+
+    for (phase = 0; phase < SIM_DRUM_NUM_PHASES; ++phase) {
+        if (sim_drum_phases[phase] == coils) {
+            break;
+        }
+    }
+    if (phase == SIM_DRUM_NUM_PHASES) {
+        sim_fail("Coils driven with invalid pattern 0x%x\n", coils);
+    }
+
+    // The rotor snaps to the first phase it is driven with
+    if (sim_drum_phase < 0) {
+        sim_drum_phase = phase;
+        return;
+    }
+
+    delta = (uint32_t)(phase - sim_drum_phase) % SIM_DRUM_NUM_PHASES;
+    sim_drum_phase = phase;
+
+    switch (delta) {
+    case 0:
+        return;
+
+    case 1:
+    case 2:
+        while (delta-- > 0) {
+            sim_drum_position = (sim_drum_position + 1) % sim_drum_rotation;
+            ++sim_drum_forward;
+            sim_drum_moved();
+        }
+        break;
+
+    case 6:
+    case 7:
+        while (delta++ < SIM_DRUM_NUM_PHASES) {
+            sim_drum_position = (sim_drum_position + sim_drum_rotation - 1) %
+                                sim_drum_rotation;
+            ++sim_drum_backward;
+            sim_drum_moved();
+        }
+        break;
+
+    default:
+        sim_fail("Coils skipped %u half steps, the motor lost its step\n",
+                 delta);
+    }
+}
+
+static void sim_drum_moved() {
+    uint32_t gap = 2 * SIM_DRUM_GAP_STEPS;
+    uint32_t slot = sim_drum_rotation / NUM_SLOTS;
+    uint32_t offset;
+    uint32_t compartment;
+
+    // The fork is blocked, and its pin high, except in the gap
+    offset = (sim_drum_position + gap / 2) % sim_drum_rotation;
+    sim_gpio_drive(OPTO_FORK_PIN, offset >= gap);
+
+    // A compartment is over the hole within a quarter slot of its middle
+    offset = (sim_drum_position + slot / 4) % sim_drum_rotation;
+    compartment = offset % slot < slot / 2 ? offset / slot : NUM_SLOTS;
+    if (compartment == sim_drum_over_hole) {
+        return;
+    }
+    sim_drum_over_hole = compartment;
+
+    if (compartment < NUM_SLOTS && (sim_drum_pills & (1u << compartment))) {
+        sim_drum_pills &= ~(1u << compartment);
+        ++sim_drum_dropped;
+
+        sim_schedule(sim_now() + SIM_DRUM_FALL_US, SIM_EVENT_MODEL,
+                     sim_drum_piezo_event, NULL, false);
+        sim_schedule(sim_now() + SIM_DRUM_FALL_US + SIM_DRUM_HIT_US,
+                     SIM_EVENT_MODEL, sim_drum_piezo_event, NULL, true);
+    }
+}
+
+static void sim_drum_piezo_event(void* arg, uint32_t value) {
+    sim_gpio_drive(PIEZO_SENSOR_PIN, value);
+}
+
+void sim_drum_report() {
+    sim_log("Drum turned %llu half steps forward and %llu back, %u pills "
+            "dropped and %u left\n",
+            sim_drum_forward, sim_drum_backward, sim_drum_dropped,
+            sim_drum_pills_left());
+}
+
+#undef SIM_DRUM_COIL_A
+#undef SIM_DRUM_COIL_B
+#undef SIM_DRUM_COIL_C
+#undef SIM_DRUM_COIL_D
+#undef SIM_DRUM_COIL_MASK
+#undef SIM_DRUM_NUM_PHASES
+#undef SIM_DRUM_GAP_STEPS
+#undef SIM_DRUM_FALL_US
+#undef SIM_DRUM_HIT_US
+#undef SIM_DRUM_FULL
@@ -0,0 +1,114 @@
+#include "sim.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "eeprom.h"
+
+#define SIM_EEPROM_SIZE (EEPROM_PAGE_SIZE * EEPROM_NUM_PAGES)
+#define SIM_EEPROM_ADDR_BYTES 2
+
+/// Time a page write takes, during which the EEPROM does not acknowledge
+#define SIM_EEPROM_WRITE_US (5 * 1000)
+
+static uint8_t sim_eeprom_memory[SIM_EEPROM_SIZE];
+
+/// Address the next byte is read from or written to
+static uint32_t sim_eeprom_address = 0;
+static uint64_t sim_eeprom_busy_until_us = 0;
+
+static uint32_t sim_eeprom_reads = 0;
+static uint32_t sim_eeprom_writes = 0;
+static uint32_t sim_eeprom_bytes_written = 0;
+
+void sim_eeprom_init() {
+    FILE* image;
+    size_t len = 0;
+
+    memset(sim_eeprom_memory, 0xFF, sizeof(sim_eeprom_memory));
+
+    if (sim_config.eeprom_image == NULL) {
+        return;
+    }
+
+    // A missing image is an erased EEPROM
+    image = fopen(sim_config.eeprom_image, "rb");
+    if (image != NULL) {
+        len = fread(sim_eeprom_memory, 1, sizeof(sim_eeprom_memory), image);
+        fclose(image);
+    }
+
+    sim_log("Loaded %zu bytes of EEPROM from %s\n", len,
+            sim_config.eeprom_image);
+}
+
+void sim_eeprom_save() {
+    FILE* image;
+
+    if (sim_config.eeprom_image == NULL) {
+        return;
+    }
+
+    image = fopen(sim_config.eeprom_image, "wb");
+    if (image == NULL ||
+        fwrite(sim_eeprom_memory, 1, sizeof(sim_eeprom_memory), image) !=
+            sizeof(sim_eeprom_memory)) {
+        sim_log("Could not save the EEPROM to %s\n", sim_config.eeprom_image);
+    }
+
+    if (image != NULL) {
+        fclose(image);
+    }
+}
+
+bool sim_eeprom_transfer(const uint8_t* tx, size_t tx_len, uint8_t* rx,
+                         size_t rx_len) {
+    uint32_t page;
+    size_t i;
+
+    if (sim_now() < sim_eeprom_busy_until_us) {
+        return false;
+    }
+
+    // The first two bytes written are the address, the rest is data that
+    // wraps around within the page
+    if (tx_len >= SIM_EEPROM_ADDR_BYTES) {
+        sim_eeprom_address = (tx[0] << 8 | tx[1]) % SIM_EEPROM_SIZE;
+    }
+
+    if (tx_len > SIM_EEPROM_ADDR_BYTES) {
+        page = sim_eeprom_address - sim_eeprom_address % EEPROM_PAGE_SIZE;
+        for (i = SIM_EEPROM_ADDR_BYTES; i < tx_len; ++i) {
+            sim_eeprom_memory[sim_eeprom_address] = tx[i];
+            sim_eeprom_address =
+                page + (sim_eeprom_address + 1) % EEPROM_PAGE_SIZE;
+        }
+
+        ++sim_eeprom_writes;
+        sim_eeprom_bytes_written += tx_len - SIM_EEPROM_ADDR_BYTES;
+        sim_eeprom_busy_until_us = sim_now() + SIM_EEPROM_WRITE_US;
+    }
+
+    if (rx_len > 0) {
+        for (i = 0; i < rx_len; ++i) {
+            rx[i] = sim_eeprom_memory[sim_eeprom_address];
+            sim_eeprom_address = (sim_eeprom_address + 1) % SIM_EEPROM_SIZE;
+        }
+
+        ++sim_eeprom_reads;
+    }
+
+    return true;
+}
+
+void sim_eeprom_report() {
+    sim_log("EEPROM read %u times, written %u times with %u bytes\n",
+            sim_eeprom_reads, sim_eeprom_writes, sim_eeprom_bytes_written);
+}
+
+#undef SIM_EEPROM_SIZE
+#undef SIM_EEPROM_ADDR_BYTES
+#undef SIM_EEPROM_WRITE_US
@@ -0,0 +1,289 @@
+#include "sim.h"
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "button.h"
+#include "led.h"
+#include "stepper.h"
+
+/// How long LED_0 stays lit before the operator takes it as the dispenser
+/// waiting to start
+#define SIM_OPERATOR_LIT_US (1500 * 1000)
+
+/// Blinks of LED_0 the operator takes as the dispenser waiting for
+/// calibration, at most SIM_OPERATOR_BLINK_GAP_US apart. More than the blinks
+/// of a missed pill
+#define SIM_OPERATOR_WAITING_BLINKS 8
+#define SIM_OPERATOR_BLINK_GAP_US (1000 * 1000)
+
+/// Time from seeing the LED to pressing the button, and how long it is held
+#define SIM_OPERATOR_REACTION_US (300 * 1000)
+#define SIM_OPERATOR_PRESS_US (100 * 1000)
+
+/// The contacts bounce this often when pressed and released, this far apart
+#define SIM_OPERATOR_BOUNCES 2
+#define SIM_OPERATOR_BOUNCE_US 700
+
+/// Time the firmware gets to send its last reports once every run is done
+#define SIM_OPERATOR_GRACE_US (60 * 1000 * 1000ull)
+
+#define SIM_US_PER_S (1000 * 1000ull)
+
+/// Entry point of the firmware, which main.c is renamed to for the simulator
+int firmware_main(void);
+
+/// Prints how the simulator is used
+static void sim_usage(const char* name);
+
+/// Presses BTN_0 after the operator's reaction time
+static void sim_operator_press(void);
+
+/// Drives BTN_0 to the level in `value`
+static void sim_operator_button_event(void* arg, uint32_t value);
+
+/// Loads the drum and starts dispensing if LED_0 is still lit
+static void sim_operator_lit_event(void* arg, uint32_t value);
+
+/// Checks the run that just ended and starts the next one
+static void sim_operator_waiting(void);
+
+static void sim_operator_finish_event(void* arg, uint32_t value);
+
+sim_config_t sim_config = {
+    .runs = 1,
+    .empty_compartments = 0,
+    .steps_per_rotation = 2050,
+    .start_position = 500,
+    .modem_present = true,
+    .modem_script = NULL,
+    .eeprom_image = NULL,
+    .limit_us = 60 * 60 * SIM_US_PER_S,
+};
+
+static uint16_t sim_operator_level = 0;
+static sim_event_id_t sim_operator_lit = SIM_INVALID_EVENT;
+static uint64_t sim_operator_last_blink_us = 0;
+static uint32_t sim_operator_blinks = 0;
+
+/// Runs whose dispensing has ended
+static uint32_t sim_operator_runs = 0;
+static bool sim_operator_calibrated = false;
+
+static void sim_operator_press() {
+    uint64_t time_us = sim_now() + SIM_OPERATOR_REACTION_US;
+    uint32_t i;
+
+    for (i = 0; i < SIM_OPERATOR_BOUNCES; ++i) {
+        sim_schedule(time_us, SIM_EVENT_MODEL, sim_operator_button_event, NULL,
+                     false);
+        time_us += SIM_OPERATOR_BOUNCE_US;
+        sim_schedule(time_us, SIM_EVENT_MODEL, sim_operator_button_event, NULL,
+                     true);
+        time_us += SIM_OPERATOR_BOUNCE_US;
+    }
+    sim_schedule(time_us, SIM_EVENT_MODEL, sim_operator_button_event, NULL,
+                 false);
+
+    time_us += SIM_OPERATOR_PRESS_US;
+    for (i = 0; i < SIM_OPERATOR_BOUNCES; ++i) {
+        sim_schedule(time_us, SIM_EVENT_MODEL, sim_operator_button_event, NULL,
+                     true);
+        time_us += SIM_OPERATOR_BOUNCE_US;
+        sim_schedule(time_us, SIM_EVENT_MODEL, sim_operator_button_event, NULL,
+                     false);
+        time_us += SIM_OPERATOR_BOUNCE_US;
+    }
+    sim_schedule(time_us, SIM_EVENT_MODEL, sim_operator_button_event, NULL,
+                 true);
+}
+
+static void sim_operator_button_event(void* arg, uint32_t value) {
+    sim_gpio_drive(BTN_0_PIN, value);
+}
+
+void sim_operator_led(uint32_t pin, uint16_t level) {
+    uint64_t now = sim_now();
+
+    if (pin != LED_0_PIN) {
+        return;
+    }
+
+    sim_cancel(sim_operator_lit);
+    sim_operator_lit = SIM_INVALID_EVENT;
+
+    if (level == LED_PWM_WRAP) {
+        sim_operator_lit =
+            sim_schedule(now + SIM_OPERATOR_LIT_US, SIM_EVENT_MODEL,
+                         sim_operator_lit_event, NULL, 0);
+    }
+
+    // Count the times it lights up in a row
+    if (sim_operator_level == 0 && level != 0) {
+        if (sim_operator_blinks != 0 &&
+            now - sim_operator_last_blink_us > SIM_OPERATOR_BLINK_GAP_US) {
+            sim_operator_blinks = 0;
+        }
+        sim_operator_last_blink_us = now;
+
+        if (++sim_operator_blinks == SIM_OPERATOR_WAITING_BLINKS) {
+            sim_operator_waiting();
+        }
+    }
+
+    sim_operator_level = level;
+}
+
+static void sim_operator_lit_event(void* arg, uint32_t value) {
+    sim_operator_lit = SIM_INVALID_EVENT;
+    sim_operator_calibrated = true;
+
+    sim_log("Dispenser is calibrated, starting run %u\n",
+            sim_operator_runs + 1);
+    sim_drum_load();
+    sim_operator_press();
+}
+
+static void sim_operator_waiting() {
+    uint32_t left;
+
+    if (!sim_operator_calibrated) {
+        sim_log("Dispenser waits for calibration\n");
+        sim_operator_press();
+        return;
+    }
+    sim_operator_calibrated = false;
+
+    left = sim_drum_pills_left();
+    if (left != 0) {
+        sim_fail("Run %u ended with %u pills left in the drum\n",
+                 sim_operator_runs + 1, left);
+    }
+
+    if (++sim_operator_runs < sim_config.runs) {
+        sim_log("Run %u done, calibrating again\n", sim_operator_runs);
+        sim_operator_press();
+        return;
+    }
+
+    sim_log("All %u runs done\n", sim_operator_runs);
+    sim_schedule(sim_now() + SIM_OPERATOR_GRACE_US, SIM_EVENT_MODEL,
+                 sim_operator_finish_event, NULL, 0);
+}
+
+static void sim_operator_finish_event(void* arg, uint32_t value) {
+    sim_finish(true);
+}
+
+static void sim_usage(const char* name) {
+    printf("Usage: %s [options]\n"
+           "Runs the firmware against a simulated dispenser until the drum\n"
+           "has been emptied the given number of times\n"
+           "\n"
+           "  --runs N                Times the drum is loaded and emptied\n"
+           "  --empty N               Leaves compartment N (1-7) empty, may "
+           "be repeated\n"
+           "  --steps-per-rotation N  Full steps per drum rotation\n"
+           "  --start N               Full steps the drum starts past the "
+           "opto fork gap\n"
+           "  --no-modem              Leaves the LoRa module unplugged\n"
+           "  --modem-script FILE     Answers the firmware with the rules in "
+           "FILE,\n"
+           "                          lines of 'command | delay_ms | "
+           "response'\n"
+           "  --eeprom FILE           Loads the EEPROM from FILE and saves it "
+           "back\n"
+           "  --limit S               Fails the run after S simulated "
+           "seconds\n",
+           name);
+}
+
+int main(int argc, char** argv) {
+    static const struct option options[] = {
+        {"runs", required_argument, NULL, 'r'},
+        {"empty", required_argument, NULL, 'e'},
+        {"steps-per-rotation", required_argument, NULL, 's'},
+        {"start", required_argument, NULL, 'p'},
+        {"no-modem", no_argument, NULL, 'n'},
+        {"modem-script", required_argument, NULL, 'm'},
+        {"eeprom", required_argument, NULL, 'i'},
+        {"limit", required_argument, NULL, 'l'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    uint32_t compartment;
+    int option;
+
+    while ((option = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (option) {
+        case 'r':
+            sim_config.runs = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'e':
+            compartment = strtoul(optarg, NULL, 0);
+            if (compartment < 1 || compartment >= NUM_SLOTS) {
+                fprintf(stderr, "No compartment %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            sim_config.empty_compartments |= 1u << compartment;
+            break;
+
+        case 's':
+            sim_config.steps_per_rotation = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'p':
+            sim_config.start_position = strtoul(optarg, NULL, 0);
+            break;
+
+        case 'n':
+            sim_config.modem_present = false;
+            break;
+
+        case 'm':
+            sim_config.modem_script = optarg;
+            break;
+
+        case 'i':
+            sim_config.eeprom_image = optarg;
+            break;
+
+        case 'l':
+            sim_config.limit_us = strtod(optarg, NULL) * SIM_US_PER_S;
+            break;
+
+        case 'h':
+            sim_usage(argv[0]);
+            return EXIT_SUCCESS;
+
+        default:
+            sim_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (sim_config.runs == 0 || sim_config.steps_per_rotation < NUM_SLOTS) {
+        sim_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    sim_drum_init();
+    sim_eeprom_init();
+    sim_modem_init();
+
+    return firmware_main();
+}
+
+#undef SIM_OPERATOR_LIT_US
+#undef SIM_OPERATOR_WAITING_BLINKS
+#undef SIM_OPERATOR_BLINK_GAP_US
+#undef SIM_OPERATOR_REACTION_US
+#undef SIM_OPERATOR_PRESS_US
+#undef SIM_OPERATOR_BOUNCES
+#undef SIM_OPERATOR_BOUNCE_US
+#undef SIM_OPERATOR_GRACE_US
+#undef SIM_US_PER_S
@@ -0,0 +1,272 @@
+#include "sim.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SIM_MODEM_MAX_RULES 32
+#define SIM_MODEM_LINE_BYTES 256
+#define SIM_MODEM_PATTERN_BYTES 64
+#define SIM_MODEM_RESPONSE_BYTES 128
+
+/// Responses waiting to be sent. Power of two
+#define SIM_MODEM_TX_BUFFER_SIZE 1024
+
+/// Separates the fields of a rule
+#define SIM_MODEM_FIELD_SEPARATOR '|'
+
+#define SIM_MODEM_UPLINK_PREFIX "AT+MSG"
+
+typedef struct {
+    /// Line the rule answers. A trailing '*' matches any rest of the line
+    char pattern[SIM_MODEM_PATTERN_BYTES];
+    /// Time from the previous response to the same line
+    uint32_t delay_ms;
+    char response[SIM_MODEM_RESPONSE_BYTES];
+} sim_modem_rule_t;
+
+/// Adds a rule from a line of a script. Blank lines and lines starting with
+/// '#' are skipped
+static void sim_modem_parse_rule(const char* line, uint32_t number);
+
+/// Strips whitespace from both ends of a string in place and returns it
+static char* sim_modem_trim(char* str);
+
+/// Checks whether a line matches the pattern of a rule
+static bool sim_modem_matches(const char* pattern, const char* line);
+
+/// Answers a line the firmware has sent
+static void sim_modem_answer(const char* line);
+
+/// Queues the response of the rule in `value` for sending
+static void sim_modem_respond_event(void* arg, uint32_t value);
+
+/// Sends the next queued character to the firmware
+static void sim_modem_tx_event(void* arg, uint32_t value);
+
+/// Answers the way the LoRa module does once the network accepts it
+static const char* const sim_modem_default_script[] = {
+    "AT          |    5 | +AT: OK",
+    "AT+MODE=*   |    5 | +MODE: LWOTAA",
+    "AT+KEY=*    |    5 | +KEY: APPKEY 8979ADFCCAF0FB5E4E087ECB2F00157E",
+    "AT+CLASS=*  |    5 | +CLASS: A",
+    "AT+PORT=*   |    5 | +PORT: 8",
+    "AT+JOIN     |    5 | +JOIN: Start",
+    "AT+JOIN     | 6000 | +JOIN: Network joined",
+    "AT+JOIN     |   10 | +JOIN: Done",
+    "AT+MSGHEX=* |    5 | +MSGHEX: Start",
+    "AT+MSGHEX=* | 1500 | +MSGHEX: Done",
+    "AT+MSG=*    |    5 | +MSG: Start",
+    "AT+MSG=*    | 1500 | +MSG: Done",
+};
+
+static sim_modem_rule_t sim_modem_rules[SIM_MODEM_MAX_RULES];
+static uint32_t sim_modem_num_rules = 0;
+
+/// Line being received from the firmware
+static char sim_modem_line[SIM_MODEM_LINE_BYTES];
+static uint32_t sim_modem_line_len = 0;
+
+static char sim_modem_tx[SIM_MODEM_TX_BUFFER_SIZE];
+static uint32_t sim_modem_tx_head = 0;
+static uint32_t sim_modem_tx_tail = 0;
+
+static uint32_t sim_modem_lines = 0;
+static uint32_t sim_modem_uplinks = 0;
+static uint32_t sim_modem_unanswered = 0;
+
+void sim_modem_init() {
+    char line[SIM_MODEM_LINE_BYTES];
+    uint32_t number = 0;
+    FILE* script;
+    size_t i;
+
+    if (sim_config.modem_script == NULL) {
+        for (i = 0; i < sizeof(sim_modem_default_script) /
+                            sizeof(sim_modem_default_script[0]);
+             ++i) {
+            sim_modem_parse_rule(sim_modem_default_script[i], i + 1);
+        }
+        return;
+    }
+
+    script = fopen(sim_config.modem_script, "r");
+    if (script == NULL) {
+        sim_fail("Could not open modem script %s\n", sim_config.modem_script);
+    }
+
+    while (fgets(line, sizeof(line), script) != NULL) {
+        sim_modem_parse_rule(line, ++number);
+    }
+
+    fclose(script);
+}
+
+static char* sim_modem_trim(char* str) {
+    char* end;
+
+    while (*str == ' ' || *str == '\t') {
+        ++str;
+    }
+
+    end = str + strlen(str);
+    while (end > str && (end[-1] == ' ' || end[-1] == '\t' ||
+                         end[-1] == '\r' || end[-1] == '\n')) {
+        --end;
+    }
+    *end = '\0';
+
+    return str;
+}
+
+static void sim_modem_parse_rule(const char* line, uint32_t number) {
+    char buf[SIM_MODEM_LINE_BYTES];
+    sim_modem_rule_t* rule;
+    char* fields[3];
+    char* separator;
+    uint32_t i;
+
+    strncpy(buf, line, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+
+    fields[0] = sim_modem_trim(buf);
+    if (fields[0][0] == '\0' || fields[0][0] == '#') {
+        return;
+    }
+
+    for (i = 1; i < 3; ++i) {
+        separator = strchr(fields[i - 1], SIM_MODEM_FIELD_SEPARATOR);
+        if (separator == NULL) {
+            sim_fail("Modem script line %u has fewer than 3 fields\n", number);
+        }
+
+        *separator = '\0';
+        fields[i] = separator + 1;
+    }
+
+    if (sim_modem_num_rules == SIM_MODEM_MAX_RULES) {
+        sim_fail("Modem script has more than %d rules\n", SIM_MODEM_MAX_RULES);
+    }
+
+    rule = &sim_modem_rules[sim_modem_num_rules++];
+    snprintf(rule->pattern, sizeof(rule->pattern), "%s",
+             sim_modem_trim(fields[0]));
+    rule->delay_ms = strtoul(fields[1], NULL, 10);
+    snprintf(rule->response, sizeof(rule->response), "%s",
+             sim_modem_trim(fields[2]));
+}
+
+static bool sim_modem_matches(const char* pattern, const char* line) {
+    size_t len = strlen(pattern);
+
+    if (len > 0 && pattern[len - 1] == '*') {
+        return strncmp(pattern, line, len - 1) == 0;
+    }
+
+    return strcmp(pattern, line) == 0;
+}
+
+void sim_modem_receive(char c) {
+    if (!sim_config.modem_present) {
+        return;
+    }
+
+    if (c == '\r') {
+        return;
+    }
+
+    if (c != '\n') {
+        if (sim_modem_line_len < SIM_MODEM_LINE_BYTES - 1) {
+            sim_modem_line[sim_modem_line_len++] = c;
+        }
+        return;
+    }
+
+    sim_modem_line[sim_modem_line_len] = '\0';
+    sim_modem_line_len = 0;
+
+    sim_modem_answer(sim_modem_line);
+}
+
+static void sim_modem_answer(const char* line) {
+    uint64_t time_us = sim_now();
+    bool answered = false;
+    uint32_t i;
+
+    ++sim_modem_lines;
+    if (strncmp(line, SIM_MODEM_UPLINK_PREFIX,
+                strlen(SIM_MODEM_UPLINK_PREFIX)) == 0) {
+        ++sim_modem_uplinks;
+        sim_log("Uplink %s\n", line);
+    }
+
+    // Every response comes a delay after the one before it
+    for (i = 0; i < sim_modem_num_rules; ++i) {
+        if (sim_modem_matches(sim_modem_rules[i].pattern, line)) {
+            time_us += (uint64_t)sim_modem_rules[i].delay_ms * 1000;
+            sim_schedule(time_us, SIM_EVENT_MODEL, sim_modem_respond_event,
+                         NULL, i);
+            answered = true;
+        }
+    }
+
+    if (!answered) {
+        ++sim_modem_unanswered;
+        sim_log("Modem has no answer to '%s'\n", line);
+    }
+}
+
+static void sim_modem_respond_event(void* arg, uint32_t value) {
+    const char* response = sim_modem_rules[value].response;
+    bool idle = sim_modem_tx_head == sim_modem_tx_tail;
+    size_t len = strlen(response);
+    size_t i;
+
+    if (sim_modem_tx_head - sim_modem_tx_tail + len + 2 >
+        SIM_MODEM_TX_BUFFER_SIZE) {
+        sim_fail("Modem responses piled up beyond %d characters\n",
+                 SIM_MODEM_TX_BUFFER_SIZE);
+    }
+
+    for (i = 0; i < len; ++i) {
+        sim_modem_tx[sim_modem_tx_head++ % SIM_MODEM_TX_BUFFER_SIZE] =
+            response[i];
+    }
+    sim_modem_tx[sim_modem_tx_head++ % SIM_MODEM_TX_BUFFER_SIZE] = '\r';
+    sim_modem_tx[sim_modem_tx_head++ % SIM_MODEM_TX_BUFFER_SIZE] = '\n';
+
+    if (idle) {
+        sim_schedule(sim_now() + SIM_UART_CHAR_US, SIM_EVENT_MODEL,
+                     sim_modem_tx_event, NULL, 0);
+    }
+}
+
+static void sim_modem_tx_event(void* arg, uint32_t value) {
+    sim_uart_send(
+        sim_modem_tx[sim_modem_tx_tail++ % SIM_MODEM_TX_BUFFER_SIZE]);
+
+    if (sim_modem_tx_head != sim_modem_tx_tail) {
+        sim_schedule(sim_now() + SIM_UART_CHAR_US, SIM_EVENT_MODEL,
+                     sim_modem_tx_event, NULL, 0);
+    }
+}
+
+void sim_modem_report() {
+    if (!sim_config.modem_present) {
+        sim_log("No modem\n");
+        return;
+    }
+
+    sim_log("Modem got %u lines, %u of them uplinks and %u unanswered\n",
+            sim_modem_lines, sim_modem_uplinks, sim_modem_unanswered);
+}
+
+#undef SIM_MODEM_MAX_RULES
+#undef SIM_MODEM_LINE_BYTES
+#undef SIM_MODEM_PATTERN_BYTES
+#undef SIM_MODEM_RESPONSE_BYTES
+#undef SIM_MODEM_TX_BUFFER_SIZE
+#undef SIM_MODEM_FIELD_SEPARATOR
+#undef SIM_MODEM_UPLINK_PREFIX
@@ -1,32 +1,33 @@
 #include "stepper.h"
 #include "debug.h"
-#include "eeprom.h"
+#include "hal.h"
+#include "journal.h"
+#include "motor.h"
+#include "settings.h"
 #include "watchdog.h"
 
-#include "hardware/gpio.h"
-#include "pico/stdlib.h"
-
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
-#define STEP_SLEEP_MS 10
 #define APPROX_STEPS_PER_ROTATION 2084
 
-#define PIEZO_IRQ_EVENT_MASK GPIO_IRQ_LEVEL_LOW
+/// Fraction of the expected distance to an opto fork edge that calibration
+/// crawls instead of cruising
+#define CALIBRATION_CRAWL_FRACTION 32
+
+/// Full steps the calibration slot may be off from where the saved
+/// calibration puts it before the steps per rotation are measured again
+#define CALIBRATION_CHECK_STEPS 8
 
 #define STEPPER_TRANSACTION_MASK (1 << 31)
 
+#define STEP_WAIT_POLL_MS 1
 #define WATCHDOG_FEED_FREQ 100
 
 /// Only supported backend. Uses nonpersistend somewhat working(?) solution if
 /// not defined
 #define PERSISTENCE_BACKEND_EEPROM
-// #define SAVE_STEP_TO_EEPROM
-// #define SAVE_SLOT_TO_EEPROM
-
-/// Turns the stepper motor by a single step
-static void step_single(void);
 
 /// Starts motor transaction
 static void start_transaction(uint32_t steps);
@@ -34,10 +35,21 @@ static void start_transaction(uint32_t steps);
 /// Ends motor transaction
 static void clear_transaction(void);
 
-/// Decrements the transaction step counter
+/// Journals the transaction and the current slot
+static void save_transaction(void);
+
+/// Journals the remaining steps once the transaction has progressed far enough
+/// since the last time
+static void save_transaction_progress(void);
+
+/// Restores the transaction and slot that were journaled last
+static void restore_transaction(void);
+
+/// Updates the remaining steps in the transaction from the steps the motor
+/// has taken since it was continued
 ///
 /// Important: Do not call outside of transactions, or things *WILL* break
-static bool decrement_transaction(void);
+static void update_transaction(void);
 
 /// Gets the number of steps remaining in the transaction
 static uint32_t get_transaction_remaining_steps(void);
@@ -45,20 +57,48 @@ static uint32_t get_transaction_remaining_steps(void);
 /// Checks whether a transaction is active at the moment
 static bool is_in_transaction(void);
 
-/// Tries to complete the current transaction
-static void continue_transaction(void);
+/// Starts completing the current transaction in the background. Returns false
+/// if the motor could not be started
+static bool continue_transaction(void);
+
+/// Starts moving until the stop condition is met, cruising for up to
+/// `cruise_steps` steps before crawling the rest of the way
+static void calibration_approach_start(uint32_t cruise_steps,
+                                       motor_stop_t stop);
+
+/// Carries on with the approach once the motor has stopped. Returns true
+/// when done, with the position of the opto fork edge that stopped the move
+/// in 1/256 steps
+static bool calibration_approach_poll(uint32_t* edge_position);
+
+/// Pops captured opto fork edges up to the first one in the given direction
+/// and gets its position in 1/256 steps. Returns false if there was none
+static bool calibration_pop_edge(bool rising, uint32_t* edge_position);
+
+/// Starts measuring the steps per rotation from scratch, going round to the
+/// calibration slot and then once around from its start
+static void calibration_measure_start(void);
+
+/// Starts going round to where the saved calibration puts the calibration
+/// slot, to confirm it without measuring a whole rotation
+static void calibration_check_start(void);
+
+/// Starts moving to the middle of the calibration slot, which starts at
+/// `edge` in 1/256 steps
+static void calibration_center_start(uint32_t edge);
 
 /// Tries to get the saved number of steps per rotation from a previous
 /// calibration
 static uint32_t get_saved_calibration(void);
 
-/// Saves the number of steps per rotation for future calibrations
-static void save_calibration(uint32_t calibrated_steps_per_rotation);
+/// Tries to get the width of the calibration slot saved with the last
+/// calibration, or 0 if there is none
+static uint32_t get_saved_slot_width(void);
 
-static bool coil_a = true;
-static bool coil_b = false;
-static bool coil_c = false;
-static bool coil_d = false;
+/// Saves the number of steps per rotation and the width of the calibration
+/// slot for future calibrations
+static void save_calibration(uint32_t calibrated_steps_per_rotation,
+                             uint32_t slot_width);
 
 static bool stepper_initialized = false;
 
@@ -67,74 +107,143 @@ static uint32_t num_steps_per_rotation = APPROX_STEPS_PER_ROTATION;
 
 static uint8_t current_slot = 0;
 
-volatile static bool detected_pill = false;
+/// Whether a move started by step_start() still has to be finished
+static bool step_pending = false;
+
+/// Piezo sensor hits when the last move started by step_start() began
+static uint32_t piezo_hits_at_step = 0;
+
+/// Remaining steps in the transaction when it was last continued
+static uint32_t transaction_continued_at;
+
+typedef enum {
+    CALIBRATION_IDLE,
+    /// Finishing a transaction restored from before a reset
+    CALIBRATION_RESUMING,
+    /// Cruising to just before where the saved calibration puts the slot and
+    /// crawling up to its start
+    CALIBRATION_CHECK_CRUISE,
+    CALIBRATION_CHECK_SLOT,
+    /// Cruising to the calibration slot, capturing where it starts
+    CALIBRATION_FIND_SLOT,
+    /// Cruising out of the slot the drum started in to find it again
+    CALIBRATION_LEAVE_SLOT,
+    /// Cruising across it, capturing where it ends
+    CALIBRATION_CROSS_SLOT,
+    /// Going once around and crawling up to its start again, to count the
+    /// steps in between
+    CALIBRATION_SLOT_START_AGAIN,
+    /// Moving to the middle of the slot
+    CALIBRATION_CENTER,
+} calibration_phase_t;
+
+/// State of the calibration underway. Distances are in steps, edge
+/// positions in 1/256 steps
+static calibration_phase_t calibration_phase = CALIBRATION_IDLE;
+static uint32_t calibration_prior;
+static uint32_t calibration_margin;
+static uint32_t calibration_slot_start;
+static uint32_t calibration_quarter_slot;
+static uint32_t calibration_steps;
+
+/// Where the calibration check started, and how far ahead the slot should
+/// start from there
+static uint32_t calibration_start_position;
+static uint32_t calibration_expected;
+
+/// State of the approach underway
+static uint32_t approach_cruise_steps;
+static motor_stop_t approach_stop;
+static bool approach_crawling;
 
 #ifndef PERSISTENCE_BACKEND_EEPROM
 volatile static uint32_t __scratch_x("stepper_transaction") stepper_transaction;
 volatile static uint32_t __scratch_y("last_calibration") last_calibration;
+static uint32_t last_slot_width;
 #else
 static uint8_t stepper_transaction;
-static uint32_t transaction_steps;
+volatile static uint32_t transaction_steps;
 static uint32_t last_calibration;
+static uint32_t last_slot_width;
+
+/// Remaining steps as of the newest journal record
+static uint32_t journaled_steps;
 #endif
 
 /// Marks the start of a transaction and saves how many steps should still be
 /// traversed
 static void start_transaction(uint32_t steps) {
-#ifdef PERSISTENCE_BACKEND_EEPROM
-    init_eeprom();
-#endif
-
 #ifndef PERSISTENCE_BACKEND_EEPROM
     stepper_transaction = STEPPER_TRANSACTION_MASK;
     stepper_transaction += steps;
 #else
     stepper_transaction = 1;
     transaction_steps = steps;
-
-    eeprom_write_byte(EEPROM_STEPPER_TRANSACTION_ENABLED_ADDRESS,
-                      stepper_transaction);
-#ifdef SAVE_STEP_TO_EEPROM
-    eeprom_write_byte(EEPROM_STEPPER_TRANSACTION_REMAINING_STEPS_ADDRESS,
-                      transaction_steps);
-#endif
 #endif
+
+    save_transaction();
 }
 
 /// Clears the transaction scratch register
 static void clear_transaction() {
     stepper_transaction = 0;
 #ifdef PERSISTENCE_BACKEND_EEPROM
-    eeprom_write_byte(EEPROM_STEPPER_TRANSACTION_ENABLED_ADDRESS,
-                      stepper_transaction);
-#ifdef SAVE_STEP_TO_EEPROM
-    eeprom_write_byte(EEPROM_STEPPER_TRANSACTION_REMAINING_STEPS_ADDRESS,
-                      stepper_transaction);
-#endif
+    transaction_steps = 0;
 #endif
+
+    save_transaction();
 }
 
-/// Decrements the remaining steps in the transaction and returns whether it
-/// should still continue
-static bool decrement_transaction() {
-#ifndef PERSISTENCE_BACKEND_EEPROM
-    --stepper_transaction;
+static void save_transaction() {
+#ifdef PERSISTENCE_BACKEND_EEPROM
+    journal_state_t state;
 
-    if (stepper_transaction == STEPPER_TRANSACTION_MASK) {
-#else
-    --transaction_steps;
-    if (transaction_steps == 0) {
+    state.remaining_steps = transaction_steps;
+    state.slot = current_slot;
+    state.in_transaction = stepper_transaction;
+
+    journal_append(&state);
+    journaled_steps = state.remaining_steps;
 #endif
-        clear_transaction();
-        return false;
+}
+
+static void save_transaction_progress() {
+#ifdef PERSISTENCE_BACKEND_EEPROM
+    if (journaled_steps - transaction_steps >= JOURNAL_STEP_INTERVAL) {
+        save_transaction();
     }
-#ifdef SAVE_STATE_TO_EEPROM
-    else {
-        eeprom_write_byte(EEPROM_STEPPER_TRANSACTION_REMAINING_STEPS_ADDRESS,
-                          transaction_steps);
+#endif
+}
+
+static void restore_transaction() {
+#ifdef PERSISTENCE_BACKEND_EEPROM
+    journal_state_t state;
+
+    if (journal_latest(&state)) {
+        current_slot = state.slot;
+        stepper_transaction = state.in_transaction;
+        transaction_steps = state.remaining_steps;
+        journaled_steps = state.remaining_steps;
+    } else {
+        current_slot = settings_get()->slot;
+        stepper_transaction = 0;
     }
+#else
+    current_slot = 0;
+#endif
+}
+
+/// Counts the steps core1 has taken off the remaining steps. The move ends on
+/// its own once they are all taken
+static void update_transaction() {
+    uint32_t remaining;
+
+    remaining = transaction_continued_at - motor_steps_taken();
+#ifndef PERSISTENCE_BACKEND_EEPROM
+    stepper_transaction = STEPPER_TRANSACTION_MASK + remaining;
+#else
+    transaction_steps = remaining;
 #endif
-    return true;
 }
 
 static uint32_t get_transaction_remaining_steps() {
@@ -154,246 +263,478 @@ static bool is_in_transaction() {
 #endif
 }
 
-static void continue_transaction() {
+static bool continue_transaction() {
     init_watchdog();
 
-    while (decrement_transaction()) {
-        if (get_transaction_remaining_steps() % WATCHDOG_FEED_FREQ == 0) {
-            feed_watchdog(WATCHDOG_FEED_ROTATING);
-        }
-
-        step_single();
-        sleep_ms(STEP_SLEEP_MS);
-    }
+    transaction_continued_at = get_transaction_remaining_steps();
+    return motor_start(transaction_continued_at, MOTOR_SPEED_CRUISE,
+                       MOTOR_STOP_NEVER);
 }
 
 /// Returns the number of steps per rotation calculated in an earlier
-/// calibration, or 0, if a calibration was not stored.
+/// calibration, or 0, if a calibration was not stored. Calibrations are stored
+/// in full steps and scaled to the current drive mode
 static uint32_t get_saved_calibration() {
 #ifdef PERSISTENCE_BACKEND_EEPROM
-    int64_t tmp;
-    tmp = eeprom_read_long(EEPROM_STEPPER_CACHED_STEPS_PER_REVOLUTION);
-    if (tmp != -1) {
-        last_calibration = (uint32_t)last_calibration;
-    }
+    last_calibration = settings_get()->steps_per_rotation;
 #endif
 
-    DBG("Loaded calibration data: %d\n", last_calibration);
-    return last_calibration;
+    LOG_INFO("Loaded calibration data: %d\n", last_calibration);
+    return last_calibration * motor_steps_per_full_step();
 }
 
-/// Saves a calibration into the Pi Pico's scratch registers
-static void save_calibration(uint32_t calibrated_steps_per_rotation) {
-    DBG("Saved calibration data (%d)\n", calibrated_steps_per_rotation);
-    last_calibration = calibrated_steps_per_rotation;
-
+static uint32_t get_saved_slot_width() {
 #ifdef PERSISTENCE_BACKEND_EEPROM
-    eeprom_write_long(EEPROM_STEPPER_CACHED_STEPS_PER_REVOLUTION,
-                      last_calibration);
+    last_slot_width = settings_get()->slot_width;
 #endif
-}
 
-static void piezo_sensor_callback(uint gpio, uint32_t event_mask) {
-    DBG("Piezo sensor detected dropped pill\n");
-    detected_pill = true;
+    return last_slot_width * motor_steps_per_full_step();
 }
 
-void init_stepper() {
-    current_slot = 0;
+/// Saves a calibration into the Pi Pico's scratch registers
+static void save_calibration(uint32_t calibrated_steps_per_rotation,
+                             uint32_t slot_width) {
+    uint32_t full_step;
 
-    if (!stepper_initialized) {
-        // Init gpio pins
-        gpio_init(STEPPER_A_PIN);
-        gpio_init(STEPPER_B_PIN);
-        gpio_init(STEPPER_C_PIN);
-        gpio_init(STEPPER_D_PIN);
-
-        gpio_init(OPTO_FORK_PIN);
-        gpio_init(PIEZO_SENSOR_PIN);
-
-        // Configure stepper pins as outputs
-        gpio_set_dir(STEPPER_A_PIN, GPIO_OUT);
-        gpio_set_dir(STEPPER_B_PIN, GPIO_OUT);
-        gpio_set_dir(STEPPER_C_PIN, GPIO_OUT);
-        gpio_set_dir(STEPPER_D_PIN, GPIO_OUT);
-
-        // Configure sensor pins as inputs
-        gpio_set_dir(OPTO_FORK_PIN, GPIO_IN);
-        gpio_set_dir(PIEZO_SENSOR_PIN, GPIO_IN);
-
-        // Pull stepper pins down
-        gpio_pull_down(STEPPER_A_PIN);
-        gpio_pull_down(STEPPER_B_PIN);
-        gpio_pull_down(STEPPER_C_PIN);
-        gpio_pull_down(STEPPER_D_PIN);
-
-        // Pull sensor pins up
-        gpio_pull_up(OPTO_FORK_PIN);
-        gpio_pull_up(PIEZO_SENSOR_PIN);
-
-        // Set piezo sensor callback
-        gpio_set_irq_enabled_with_callback(PIEZO_SENSOR_PIN,
-                                           PIEZO_IRQ_EVENT_MASK, true,
-                                           piezo_sensor_callback);
+    full_step = motor_steps_per_full_step();
+    last_calibration =
+        (calibrated_steps_per_rotation + full_step / 2) / full_step;
+    last_slot_width = (slot_width + full_step / 2) / full_step;
+    LOG_INFO("Saved calibration data (%d)\n", last_calibration);
 
-        stepper_initialized = true;
+#ifdef PERSISTENCE_BACKEND_EEPROM
+    settings_edit()->steps_per_rotation = last_calibration;
+    settings_edit()->slot_width = last_slot_width;
+    if (last_calibration != 0) {
+        ++settings_edit()->calibration_count;
     }
+    settings_flush();
+#endif
 }
 
-static void step_single() {
-    bool tmp = coil_d;
-
-    coil_d = coil_c; // D = C
-    coil_c = coil_b; // C = B
-    coil_b = coil_a; // B = A
-    coil_a = tmp;    // A = D
+void init_stepper() {
+    // The current slot is kept across restarts, so that the next calibration
+    // knows where the drum is
+    if (!stepper_initialized) {
+        init_motor();
+#ifdef PERSISTENCE_BACKEND_EEPROM
+        init_settings();
+        init_journal();
+#endif
+        num_steps_per_rotation =
+            APPROX_STEPS_PER_ROTATION * motor_steps_per_full_step();
 
-    gpio_put(STEPPER_A_PIN, coil_a);
-    gpio_put(STEPPER_B_PIN, coil_b);
-    gpio_put(STEPPER_C_PIN, coil_c);
-    gpio_put(STEPPER_D_PIN, coil_d);
+        stepper_initialized = true;
+    }
 }
 
-bool step() {
+bool step_start() {
+    uint8_t previous_slot = current_slot;
     uint32_t slot_steps;
 
+    if (step_pending) {
+        LOG_WARN("Previous step has not finished yet\n");
+        return false;
+    }
+
     ++current_slot;
 
     slot_steps = num_steps_per_rotation / NUM_SLOTS;
     if (current_slot % NUM_SLOTS == 0) {
-        DBG("Stepping remainder steps\n");
+        LOG_DEBUG("Stepping remainder steps\n");
         slot_steps += num_steps_per_rotation % NUM_SLOTS;
         current_slot = 0;
     }
 
-#ifdef SAVE_SLOT_TO_EEPROM
-    eeprom_write_byte(EEPROM_STEPPER_CURRENT_SLOT_ADDRESS, current_slot);
+    piezo_hits_at_step = motor_piezo_hits();
+
+    // Every one of the slot's steps is taken. The loop this replaced stopped
+    // a step short, leaving the drum NUM_SLOTS steps behind each rotation
+    start_transaction(slot_steps);
+    if (!continue_transaction()) {
+        LOG_ERROR("Could not start moving to the next slot\n");
+
+        // Nothing moved, so the drum is still where it was
+        current_slot = previous_slot;
+        clear_transaction();
+        return false;
+    }
+
+    step_pending = true;
+    return true;
+}
+
+bool step_poll() {
+    if (motor_busy()) {
+        update_transaction();
+        save_transaction_progress();
+        return false;
+    }
+
+    if (step_pending) {
+        clear_transaction();
+        step_pending = false;
+
+#ifdef PERSISTENCE_BACKEND_EEPROM
+        // Saved with the next settings flush
+        settings_edit()->slot = current_slot;
 #endif
+    }
 
-    detected_pill = false;
+    return true;
+}
 
-    start_transaction(slot_steps);
-    continue_transaction();
-    clear_transaction();
+bool step_wait() {
+    uint32_t fed_at = get_transaction_remaining_steps();
 
-    if (detected_pill) {
-        detected_pill = false;
-        return true;
-    } else {
+    while (!step_poll()) {
+        if (fed_at - get_transaction_remaining_steps() >=
+            WATCHDOG_FEED_FREQ) {
+            fed_at = get_transaction_remaining_steps();
+            feed_watchdog(WATCHDOG_FEED_ROTATING);
+        }
+
+        hal_sleep_ms(STEP_WAIT_POLL_MS);
+    }
+
+    return step_pill_detected();
+}
+
+bool step_pill_detected() {
+    return motor_piezo_hits() != piezo_hits_at_step;
+}
+
+bool step() {
+    if (!step_start()) {
         return false;
     }
+
+    return step_wait();
+}
+
+static void calibration_approach_start(uint32_t cruise_steps,
+                                       motor_stop_t stop) {
+    motor_flush_edges();
+
+    approach_cruise_steps = cruise_steps;
+    approach_stop = stop;
+    approach_crawling = cruise_steps == 0;
+
+    if (approach_crawling) {
+        motor_start(MOTOR_UNLIMITED_STEPS, MOTOR_SPEED_CRAWL, stop);
+    } else {
+        motor_start(cruise_steps, MOTOR_SPEED_CRUISE, stop);
+    }
 }
 
-void calibrate(bool force) {
+static bool calibration_approach_poll(uint32_t* edge_position) {
     uint32_t steps;
-    uint32_t quarter_slot;
-    uint32_t saved;
-    uint32_t watchog_feeding_timer;
 
-#ifdef SAVE_SLOT_TO_EEPROM
-    int16_t tmp;
-#endif
+    if (motor_busy()) {
+        return false;
+    }
+
+    if (!approach_crawling) {
+        steps = motor_steps_taken();
+        if (steps < approach_cruise_steps) {
+            LOG_DEBUG("Reached opto fork edge %d steps early\n",
+                      approach_cruise_steps - steps);
+        }
+
+        approach_crawling = true;
+        motor_start(MOTOR_UNLIMITED_STEPS, MOTOR_SPEED_CRAWL, approach_stop);
+        return false;
+    }
+
+    if (!calibration_pop_edge(approach_stop == MOTOR_STOP_OPTO_HIGH,
+                              edge_position)) {
+        LOG_WARN("Missed opto fork edge\n");
+        *edge_position = motor_position() << MOTOR_EDGE_FRACTION_BITS;
+    }
+    return true;
+}
+
+static bool calibration_pop_edge(bool rising, uint32_t* edge_position) {
+    motor_edge_t edge;
+
+    // The first edge in the wanted direction is where the fork switched,
+    // anything after it is the fork settling
+    while (motor_pop_edge(&edge)) {
+        if (edge.rising == rising) {
+            *edge_position = edge.position;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void calibration_measure_start() {
+    LOG_INFO("Measuring the steps per rotation\n");
+    save_calibration(0, 0);
+
+    motor_flush_edges();
+    motor_start(MOTOR_UNLIMITED_STEPS, MOTOR_SPEED_CRUISE,
+                MOTOR_STOP_OPTO_LOW);
+    calibration_phase = CALIBRATION_FIND_SLOT;
+}
+
+static void calibration_check_start() {
+    uint32_t width;
+
+    width = get_saved_slot_width();
+    calibration_quarter_slot = (width << MOTOR_EDGE_FRACTION_BITS) / 4;
+
+    // The drum was left in the middle of the calibration slot and has moved
+    // a whole number of slots since. A calibration is a quarter of the slot
+    // more than the rotation it measured, see CALIBRATION_SLOT_START_AGAIN
+    calibration_expected = calibration_prior - (width + 2) / 4 -
+                           current_slot * (calibration_prior / NUM_SLOTS) -
+                           width / 2;
+    calibration_start_position = motor_position();
+
+    LOG_INFO("Checking the calibration slot %d steps ahead\n",
+             calibration_expected);
+
+    // Cruise right through anything on the way, the slot can only be the
+    // edge that comes after
+    motor_start(calibration_expected > calibration_margin
+                    ? calibration_expected - calibration_margin
+                    : 0,
+                MOTOR_SPEED_CRUISE, MOTOR_STOP_NEVER);
+    calibration_phase = CALIBRATION_CHECK_CRUISE;
+}
+
+static void calibration_center_start(uint32_t edge) {
+    uint32_t correction;
+
+    // Correct for mistakes by moving to the middle of the slot, counted
+    // from where its edge actually was instead of where the motor stopped
+    correction = edge + calibration_quarter_slot * 2 -
+                 (motor_position() << MOTOR_EDGE_FRACTION_BITS);
+    if ((int32_t)correction < 0) {
+        correction = 0;
+    }
+    motor_start((correction + MOTOR_EDGE_HALF_STEP) >>
+                    MOTOR_EDGE_FRACTION_BITS,
+                MOTOR_SPEED_CRUISE, MOTOR_STOP_NEVER);
+    calibration_phase = CALIBRATION_CENTER;
+}
+
+void calibrate_start(bool force) {
+    uint32_t saved;
 
     init_watchdog();
 
-    watchog_feeding_timer = 0;
+    if (calibration_phase != CALIBRATION_IDLE) {
+        LOG_WARN("Calibration is already underway\n");
+        return;
+    }
 
     saved = get_saved_calibration();
 
     if (saved != 0 && !force) {
-        DBG("Found calibration data\n");
+        LOG_INFO("Found calibration data\n");
 
-#ifdef SAVE_SLOT_TO_EEPROM
-        tmp = eeprom_read_byte(EEPROM_STEPPER_CURRENT_SLOT_ADDRESS);
-        if (tmp == -1) {
-            current_slot = 0;
-        } else {
-            current_slot = (uint8_t)tmp;
-        }
-#else
-        current_slot = 0;
-#endif
+        restore_transaction();
 
         num_steps_per_rotation = saved;
         calibrated = true;
 
         if (is_in_transaction()) {
-            DBG("Found transaction with %d steps left\n",
-                get_transaction_remaining_steps());
-            continue_transaction();
-            clear_transaction();
+            LOG_INFO("Found transaction with %d steps left\n",
+                     get_transaction_remaining_steps());
+            // Otherwise the transaction is left for the next boot
+            if (continue_transaction()) {
+                step_pending = true;
+                calibration_phase = CALIBRATION_RESUMING;
+            }
         }
 
         return;
+    }
+
+    // Clear saved transaction, just in case
+    clear_transaction();
+
+    // The last calibration is the best guess for where the next edge is
+    calibration_prior =
+        saved != 0 ? saved
+                   : APPROX_STEPS_PER_ROTATION * motor_steps_per_full_step();
+    calibration_margin = calibration_prior / CALIBRATION_CRAWL_FRACTION;
+
+    // While the drum is where the saved calibration says it is, finding the
+    // calibration slot where expected is enough to confirm it
+    if (calibrated && saved != 0 && get_saved_slot_width() != 0) {
+        calibration_check_start();
     } else {
-        DBG("No calibration data found\n");
-        // Clear saved transaction, just in case
-        save_calibration(0);
-        clear_transaction();
+        calibration_measure_start();
     }
+}
 
-    // Step until light is sensed
-    while (gpio_get(OPTO_FORK_PIN) != 0) {
-        step_single();
-        ++watchog_feeding_timer;
-        if (watchog_feeding_timer % WATCHDOG_FEED_FREQ == 0) {
-            feed_watchdog(WATCHDOG_FEED_CALIBRATING);
+bool has_saved_calibration() {
+#ifdef PERSISTENCE_BACKEND_EEPROM
+    return settings_get()->steps_per_rotation != 0;
+#else
+    return last_calibration != 0;
+#endif
+}
+
+bool calibrate_poll() {
+    uint32_t edge;
+    uint32_t steps;
+    uint32_t width;
+    int32_t error;
+    int32_t tolerance;
+
+    switch (calibration_phase) {
+    case CALIBRATION_RESUMING:
+        if (!step_poll()) {
+            return false;
         }
-        sleep_ms(STEP_SLEEP_MS);
-    }
+        break;
 
-    // Count steps until calibration slot is over. This produces slightly
-    // incorrect results
-    DBG("Counting steps\n");
-    steps = 0;
-    while (gpio_get(OPTO_FORK_PIN) == 0) {
-        step_single();
-        ++steps;
-        ++watchog_feeding_timer;
-        if (watchog_feeding_timer % WATCHDOG_FEED_FREQ == 0) {
-            feed_watchdog(WATCHDOG_FEED_CALIBRATING);
+    case CALIBRATION_CHECK_CRUISE:
+        if (motor_busy()) {
+            return false;
         }
-        sleep_ms(STEP_SLEEP_MS);
-    }
 
-    // Calculate num of steps to correct with later
-    quarter_slot = steps / 4;
+        calibration_approach_start(0, MOTOR_STOP_OPTO_LOW);
+        calibration_phase = CALIBRATION_CHECK_SLOT;
+        return false;
+
+    case CALIBRATION_CHECK_SLOT:
+        if (!calibration_approach_poll(&edge)) {
+            return false;
+        }
 
-    // Continue step counting
-    while (gpio_get(OPTO_FORK_PIN) != 0) {
-        step_single();
-        ++steps;
-        ++watchog_feeding_timer;
-        if (watchog_feeding_timer % WATCHDOG_FEED_FREQ == 0) {
-            feed_watchdog(WATCHDOG_FEED_CALIBRATING);
+        error = (int32_t)(((edge + MOTOR_EDGE_HALF_STEP) >>
+                           MOTOR_EDGE_FRACTION_BITS) -
+                          calibration_start_position - calibration_expected);
+        tolerance = CALIBRATION_CHECK_STEPS * motor_steps_per_full_step();
+        if (error < -tolerance || error > tolerance) {
+            LOG_WARN("Calibration slot is %d steps off, measuring again\n",
+                     error);
+            calibration_measure_start();
+            return false;
+        }
+
+        LOG_INFO("Found the calibration slot %d steps off\n", error);
+        calibration_steps = calibration_prior;
+        calibration_center_start(edge);
+        return false;
+
+    case CALIBRATION_FIND_SLOT:
+        if (motor_busy()) {
+            return false;
+        }
+
+        // Starting inside the slot leaves no edge to count from, so leave it
+        // and go round to it again
+        if (calibration_pop_edge(false, &calibration_slot_start)) {
+            calibration_phase = CALIBRATION_CROSS_SLOT;
+        } else {
+            calibration_phase = CALIBRATION_LEAVE_SLOT;
+        }
+        motor_start(MOTOR_UNLIMITED_STEPS, MOTOR_SPEED_CRUISE,
+                    MOTOR_STOP_OPTO_HIGH);
+        return false;
+
+    case CALIBRATION_LEAVE_SLOT:
+        if (motor_busy()) {
+            return false;
+        }
+
+        motor_flush_edges();
+        motor_start(MOTOR_UNLIMITED_STEPS, MOTOR_SPEED_CRUISE,
+                    MOTOR_STOP_OPTO_LOW);
+        calibration_phase = CALIBRATION_FIND_SLOT;
+        return false;
+
+    case CALIBRATION_CROSS_SLOT:
+        if (motor_busy()) {
+            return false;
+        }
+
+        // Both edges of the slot were captured on the way, interpolated to
+        // well below a step, so the slot start counts from here
+        if (!calibration_pop_edge(true, &edge)) {
+            LOG_WARN("Missed opto fork edge\n");
+            edge = motor_position() << MOTOR_EDGE_FRACTION_BITS;
         }
-        sleep_ms(STEP_SLEEP_MS);
+        calibration_quarter_slot = (edge - calibration_slot_start) / 4;
+
+        // Cruise the rest of the way around and crawl up to the start of the
+        // slot again
+        LOG_DEBUG("Counting steps\n");
+        steps = motor_position() -
+                (calibration_slot_start >> MOTOR_EDGE_FRACTION_BITS) +
+                calibration_margin;
+        calibration_approach_start(
+            calibration_prior > steps ? calibration_prior - steps : 0,
+            MOTOR_STOP_OPTO_LOW);
+        calibration_phase = CALIBRATION_SLOT_START_AGAIN;
+        return false;
+
+    case CALIBRATION_SLOT_START_AGAIN:
+        if (!calibration_approach_poll(&edge)) {
+            return false;
+        }
+
+        calibration_steps =
+            ((edge - calibration_slot_start + MOTOR_EDGE_HALF_STEP) >>
+             MOTOR_EDGE_FRACTION_BITS) +
+            ((calibration_quarter_slot + MOTOR_EDGE_HALF_STEP) >>
+             MOTOR_EDGE_FRACTION_BITS);
+        calibration_center_start(edge);
+        return false;
+
+    case CALIBRATION_CENTER:
+        if (motor_busy()) {
+            return false;
+        }
+
+        width = (calibration_quarter_slot * 4 + MOTOR_EDGE_HALF_STEP) >>
+                MOTOR_EDGE_FRACTION_BITS;
+        save_calibration(calibration_steps, width);
+        get_saved_calibration();
+        calibrated = true;
+        num_steps_per_rotation = calibration_steps;
+
+        current_slot = 0;
+        save_transaction();
+        break;
+
+    default:
+        break;
     }
 
-    // Correct for mistakes
-    for (uint32_t i = 0; i < quarter_slot * 2; ++i) {
-        step_single();
-        ++watchog_feeding_timer;
-        if (watchog_feeding_timer % WATCHDOG_FEED_FREQ == 0) {
+    calibration_phase = CALIBRATION_IDLE;
+    return true;
+}
+
+void calibrate(bool force) {
+    uint32_t polls = 0;
+
+    calibrate_start(force);
+
+    while (!calibrate_poll()) {
+        if (++polls % WATCHDOG_FEED_FREQ == 0) {
             feed_watchdog(WATCHDOG_FEED_CALIBRATING);
         }
-        sleep_ms(STEP_SLEEP_MS);
+
+        hal_sleep_ms(STEP_WAIT_POLL_MS);
     }
 
     feed_watchdog(WATCHDOG_FEED_CALIBRATING);
+}
 
-    steps += quarter_slot;
-    // steps -= steps / 20;
-
-    save_calibration(steps);
-    get_saved_calibration();
-    calibrated = true;
-    num_steps_per_rotation = steps;
+void stepper_set_drive_mode(motor_drive_t mode) {
+    uint32_t full_steps;
 
-    current_slot = 0;
-#ifdef SAVE_SLOT_TO_EEPROM
-    eeprom_write_byte(EEPROM_STEPPER_CURRENT_SLOT_ADDRESS, current_slot);
-#endif
+    full_steps = num_steps_per_rotation / motor_steps_per_full_step();
+    motor_set_drive_mode(mode);
+    num_steps_per_rotation = full_steps * motor_steps_per_full_step();
 }
 
 bool is_calibrated() { return calibrated; }
@@ -414,7 +755,9 @@ uint32_t steps_per_slot() {
     }
 }
 
-#undef STEP_SLEEP_MS
 #undef APPROX_STEPS_PER_ROTATION
 #undef STEPPER_TRANSACTION_MASK
-#undef WATCHDOG_FEED_FREQ
\ No newline at end of file
+#undef STEP_WAIT_POLL_MS
+#undef WATCHDOG_FEED_FREQ
+#undef CALIBRATION_CRAWL_FRACTION
+#undef CALIBRATION_CHECK_STEPS
\ No newline at end of file
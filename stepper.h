@@ -4,6 +4,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "motor.h"
+
 #define STEPPER_A_PIN 2
 #define STEPPER_B_PIN 3
 #define STEPPER_C_PIN 6
@@ -21,9 +23,44 @@ void init_stepper(void);
 /// Returns whether a pill was detected
 bool step(void);
 
-/// Calibrates the dispenser, returns number of steps/rotation
+/// Starts moving a single slot forward in the background. Returns false if
+/// the drum could not be moved, in which case it stays on the current slot
+bool step_start(void);
+
+/// Finishes the move started with step_start() once the drum has stopped.
+/// Returns true when no move is underway anymore
+bool step_poll(void);
+
+/// Waits for the move started with step_start() to finish
+/// Returns whether a pill was detected
+bool step_wait(void);
+
+/// Checks whether a pill was detected during the last move started with
+/// step_start()
+bool step_pill_detected(void);
+
+/// Checks if a calibration from before the last reset was saved
+bool has_saved_calibration(void);
+
+/// Calibrates the dispenser, blocking until done
 void calibrate(bool force);
 
+/// Starts calibrating the dispenser in the background. Without `force`, a
+/// saved calibration is used instead, finishing any move that was cut short
+/// by a reset. With it, the drum is moved to the calibration slot. While the
+/// drum is where a saved calibration left it, that is the slot's edge being
+/// checked against the calibration, otherwise the steps per rotation are
+/// measured in about two rotations
+void calibrate_start(bool force);
+
+/// Carries on with the calibration started by calibrate_start() whenever the
+/// motor has stopped. Returns true when no calibration is underway anymore
+bool calibrate_poll(void);
+
+/// Selects how the motor coils are driven and rescales the calibration to the
+/// new step size
+void stepper_set_drive_mode(motor_drive_t mode);
+
 /// Checks if the stepper motor has been calibrated
 bool is_calibrated(void);
 
@@ -0,0 +1,107 @@
+#include "task.h"
+#include "debug.h"
+#include "hal.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+static task_handler_t task_handlers[TASK_MAX_TASKS];
+static uint8_t task_count = 0;
+
+/// Events waiting per task. Interrupts post to them too, so they are only
+/// changed with interrupts disabled
+volatile static uint32_t task_events[TASK_MAX_TASKS];
+
+/// Idle statistics since they were last read
+static uint64_t task_stats_start_us = 0;
+static uint64_t task_idle_us = 0;
+static uint32_t task_wakeups = 0;
+
+task_id_t task_create(task_handler_t handler) {
+    if (handler == NULL || task_count >= TASK_MAX_TASKS) {
+        LOG_ERROR("No free tasks\n");
+        return TASK_INVALID_ID;
+    }
+
+    task_handlers[task_count] = handler;
+    task_events[task_count] = 0;
+
+    return task_count++;
+}
+
+void task_post(task_id_t id, uint32_t events) {
+    uint32_t irq_state;
+
+    if (id < 0 || id >= task_count) {
+        return;
+    }
+
+    irq_state = hal_irq_disable();
+    task_events[id] |= events;
+    hal_irq_restore(irq_state);
+}
+
+void task_timer_callback(timer_id_t id, void* user_data) {
+    const task_event_t* event = user_data;
+
+    task_post(event->task, event->events);
+}
+
+bool task_pending() {
+    for (uint8_t i = 0; i < task_count; ++i) {
+        if (task_events[i] != 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool task_run() {
+    uint32_t irq_state;
+    uint32_t events;
+    bool ran = false;
+
+    for (uint8_t i = 0; i < task_count; ++i) {
+        irq_state = hal_irq_disable();
+        events = task_events[i];
+        task_events[i] = 0;
+        hal_irq_restore(irq_state);
+
+        if (events != 0) {
+            task_handlers[i](events);
+            ran = true;
+        }
+    }
+
+    return ran;
+}
+
+void task_idle() {
+    uint32_t irq_state;
+    uint64_t start;
+
+    // Interrupts stay masked until after the check, so one arriving in
+    // between still ends the wait: it becomes pending and wakes the core
+    irq_state = hal_irq_disable();
+    if (!task_pending() && !timer_expired()) {
+        start = hal_time_us();
+        hal_wait_for_interrupt();
+        task_idle_us += hal_time_us() - start;
+        ++task_wakeups;
+    }
+    hal_irq_restore(irq_state);
+}
+
+void task_get_idle_stats(task_idle_stats_t* stats) {
+    uint64_t now = hal_time_us();
+
+    stats->idle_us = task_idle_us;
+    stats->total_us = now - task_stats_start_us;
+    stats->wakeups = task_wakeups;
+
+    task_stats_start_us = now;
+    task_idle_us = 0;
+    task_wakeups = 0;
+}
@@ -0,0 +1,59 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "timer.h"
+
+/// Number of tasks that can be created
+#define TASK_MAX_TASKS 8
+
+/// Returned by task_create() when no task could be created
+#define TASK_INVALID_ID (-1)
+
+typedef int8_t task_id_t;
+
+/// Runs to completion with the events posted since its last run
+typedef void (*task_handler_t)(uint32_t events);
+
+/// An event to post from a timer, see task_timer_callback()
+typedef struct {
+    task_id_t task;
+    uint32_t events;
+} task_event_t;
+
+/// Creates a task. Returns TASK_INVALID_ID if all tasks are in use
+task_id_t task_create(task_handler_t handler);
+
+/// Posts events to a task, which runs with them on the next task_run().
+/// Safe to call from interrupts
+void task_post(task_id_t id, uint32_t events);
+
+/// Timer callback posting the task_event_t passed as user data
+void task_timer_callback(timer_id_t id, void* user_data);
+
+/// Checks whether any task has events waiting
+bool task_pending(void);
+
+/// Runs every task with events waiting once, in order of creation. Returns
+/// false if there was nothing to run
+bool task_run(void);
+
+typedef struct {
+    /// Time spent asleep in task_idle() and in total since the last call to
+    /// task_get_idle_stats()
+    uint64_t idle_us;
+    uint64_t total_us;
+    /// Number of times task_idle() woke up from sleep
+    uint32_t wakeups;
+} task_idle_stats_t;
+
+/// Sleeps until the next interrupt, unless a task or timer already has
+/// something to do. The timer alarm wakes it for the next deadline
+void task_idle(void);
+
+/// Gets the idle statistics gathered since the last call and starts over
+void task_get_idle_stats(task_idle_stats_t* stats);
+
+#endif
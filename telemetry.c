@@ -0,0 +1,155 @@
+#include "telemetry.h"
+#include "debug.h"
+#include "hal.h"
+#include "lora.h"
+#include "settings.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define US_PER_S (1000 * 1000)
+
+#define US_PER_DECISECOND (100 * 1000)
+
+#define TELEMETRY_CODE_SHIFT 4
+#define TELEMETRY_FLAG_MASK 0x0f
+
+/// Writes a big-endian 16 bit value, saturating anything larger
+static void put_u16(uint8_t* buf, uint32_t value);
+
+/// When the previous event was reported
+static uint64_t telemetry_last_us = 0;
+
+static bool telemetry_ready_reported = false;
+
+/// Records waiting to be sent as one uplink, with the highest priority among
+/// them and when they have to go out
+static uint8_t telemetry_batch[LORA_MAX_PAYLOAD_BYTES];
+static size_t telemetry_batch_len = 0;
+static lora_priority_t telemetry_batch_priority;
+static uint64_t telemetry_batch_deadline;
+static uint32_t telemetry_window_us = TELEMETRY_BATCH_WINDOW_MS * 1000;
+
+static void put_u16(uint8_t* buf, uint32_t value) {
+    if (value > UINT16_MAX) {
+        value = UINT16_MAX;
+    }
+
+    buf[0] = value >> 8;
+    buf[1] = value & 0xff;
+}
+
+size_t telemetry_encode(const telemetry_event_t* event, uint8_t* buf) {
+    buf[0] = (event->code << TELEMETRY_CODE_SHIFT) |
+             (event->flags & TELEMETRY_FLAG_MASK);
+    buf[1] = event->slot;
+    put_u16(&buf[2], event->delta_s);
+
+    switch (event->code) {
+    case TELEMETRY_EVENT_CALIBRATED:
+    case TELEMETRY_EVENT_READY:
+        put_u16(&buf[4], event->value);
+        return TELEMETRY_MAX_BYTES;
+
+    default:
+        break;
+    }
+
+    return TELEMETRY_HEADER_BYTES;
+}
+
+bool telemetry_report(telemetry_code_t code, uint8_t flags,
+                      lora_priority_t priority) {
+    telemetry_event_t event;
+    uint8_t payload[TELEMETRY_MAX_BYTES];
+    size_t len;
+    uint64_t now;
+    lora_stats_t stats;
+    bool sent = true;
+
+    if (code == TELEMETRY_EVENT_BOOT && hal_watchdog_caused_reboot()) {
+        flags |= TELEMETRY_FLAG_WATCHDOG_RESET;
+    }
+
+    // The first event carries the time since boot
+    now = hal_time_us();
+    event.code = code;
+    event.flags = flags;
+    event.slot = settings_get()->slot;
+    event.delta_s = (now - telemetry_last_us) / US_PER_S;
+    event.value = 0;
+    if (code == TELEMETRY_EVENT_CALIBRATED) {
+        event.value = settings_get()->steps_per_rotation;
+    } else if (code == TELEMETRY_EVENT_READY) {
+        lora_get_stats(&stats);
+        event.value = stats.ready_us / US_PER_DECISECOND;
+    }
+    telemetry_last_us = now;
+
+    len = telemetry_encode(&event, payload);
+
+    LOG_DEBUG("Reporting event %d with flags 0x%x\n", code, flags);
+
+    if (telemetry_batch_len + len > LORA_MAX_PAYLOAD_BYTES) {
+        sent = telemetry_flush();
+    }
+
+    if (telemetry_batch_len == 0) {
+        telemetry_batch_priority = priority;
+        telemetry_batch_deadline = now + telemetry_window_us;
+    } else if (priority > telemetry_batch_priority) {
+        telemetry_batch_priority = priority;
+    }
+    memcpy(&telemetry_batch[telemetry_batch_len], payload, len);
+    telemetry_batch_len += len;
+
+    if (priority == LORA_PRIORITY_HIGH || telemetry_window_us == 0) {
+        sent = telemetry_flush() && sent;
+    }
+
+    return sent;
+}
+
+void telemetry_set_batch_window(uint32_t window_ms) {
+    telemetry_window_us = window_ms * 1000;
+}
+
+void telemetry_poll() {
+    if (!telemetry_ready_reported && lora_join_state() == LORA_JOIN_JOINED) {
+        telemetry_ready_reported = true;
+        telemetry_report(TELEMETRY_EVENT_READY, 0, LORA_PRIORITY_NORMAL);
+    }
+
+    if (telemetry_batch_len != 0 && hal_time_us() >= telemetry_batch_deadline) {
+        telemetry_flush();
+    }
+}
+
+uint64_t telemetry_next_deadline() {
+    if (!telemetry_ready_reported && lora_join_state() == LORA_JOIN_JOINED) {
+        return hal_time_us();
+    }
+
+    return telemetry_batch_len != 0 ? telemetry_batch_deadline : UINT64_MAX;
+}
+
+bool telemetry_flush() {
+    bool sent;
+
+    if (telemetry_batch_len == 0) {
+        return true;
+    }
+
+    sent = lora_send_payload(telemetry_batch, telemetry_batch_len,
+                             telemetry_batch_priority);
+    telemetry_batch_len = 0;
+
+    return sent;
+}
+
+#undef US_PER_S
+#undef US_PER_DECISECOND
+#undef TELEMETRY_CODE_SHIFT
+#undef TELEMETRY_FLAG_MASK
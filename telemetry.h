@@ -0,0 +1,80 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lora.h"
+
+/// Events are batched into a single uplink until this long after the first one
+/// of the batch, see telemetry_set_batch_window()
+#define TELEMETRY_BATCH_WINDOW_MS (30 * 1000)
+
+/// Record layout, all fields big-endian. An uplink carries one or more records
+/// back to back:
+///   byte 0     event code (high nibble) and flags (low nibble)
+///   byte 1     slot the drum is at
+///   bytes 2-3  seconds since the previous event, saturating
+///   bytes 4-5  value of events that carry one, see telemetry_code_t
+/// decode_telemetry.py decodes it on the host
+#define TELEMETRY_HEADER_BYTES 4
+#define TELEMETRY_MAX_BYTES 6
+
+typedef enum {
+    TELEMETRY_EVENT_BOOT,
+    TELEMETRY_EVENT_DROP_START,
+    /// A pill drop finished, TELEMETRY_FLAG_DETECTED tells if one fell
+    TELEMETRY_EVENT_DROP,
+    TELEMETRY_EVENT_CALIBRATION_START,
+    /// Carries the full steps per rotation
+    TELEMETRY_EVENT_CALIBRATED,
+    /// All pills of the schedule have been dispensed
+    TELEMETRY_EVENT_FINISHED,
+    /// The LoRa module joined a network for the first time since the reset.
+    /// Carries the time it took in 1/10 s
+    TELEMETRY_EVENT_READY,
+} telemetry_code_t;
+
+/// The piezo sensor saw a pill fall
+#define TELEMETRY_FLAG_DETECTED (1u << 0)
+/// The device was reset by the watchdog. Set automatically on boot
+#define TELEMETRY_FLAG_WATCHDOG_RESET (1u << 1)
+/// The drop emptied the dispenser
+#define TELEMETRY_FLAG_LAST_PILL (1u << 2)
+
+typedef struct {
+    telemetry_code_t code;
+    uint8_t flags;
+    uint8_t slot;
+    uint32_t delta_s;
+    /// Only sent for events that carry a value
+    uint32_t value;
+} telemetry_event_t;
+
+/// Encodes an event into `buf`, which must hold TELEMETRY_MAX_BYTES. Returns
+/// the payload length
+size_t telemetry_encode(const telemetry_event_t* event, uint8_t* buf);
+
+/// Encodes an event with the current slot and calibration and adds it to the
+/// current batch. High priority events send the batch right away. Returns
+/// false if an uplink was dropped
+bool telemetry_report(telemetry_code_t code, uint8_t flags,
+                      lora_priority_t priority);
+
+/// Sets how long events are collected before they are sent as one uplink. 0
+/// sends every event on its own
+void telemetry_set_batch_window(uint32_t window_ms);
+
+/// Reports the LoRa module becoming ready and sends the current batch once its
+/// window has passed. Never blocks
+void telemetry_poll(void);
+
+/// Gets when telemetry_poll() next has something to do, UINT64_MAX if nothing
+/// is pending
+uint64_t telemetry_next_deadline(void);
+
+/// Sends the current batch right away. Returns false if it was dropped
+bool telemetry_flush(void);
+
+#endif
@@ -1,45 +1,240 @@
 #include "timer.h"
+#include "debug.h"
+#include "hal.h"
 
-#include "hardware/timer.h"
-#include "pico/stdlib.h"
-
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
-#include <stdlib.h>
 
-recurring_timer_t* new_timer(uint64_t freq_us) {
-    recurring_timer_t* timer = malloc(sizeof(recurring_timer_t));
+#define TIMER_HEAP_PARENT(i) (((i) - 1) / 2)
+#define TIMER_HEAP_LEFT(i) (2 * (i) + 1)
+
+typedef struct {
+    uint64_t deadline;
+    uint64_t period;
+    timer_callback_t callback;
+    void* user_data;
+    /// Index in the heap, only valid while scheduled
+    uint8_t heap_pos;
+    bool scheduled;
+} scheduled_timer_t;
+
+/// Wakes the main thread once the earliest deadline has passed
+static void timer_alarm_callback(void);
+
+/// Points the hardware alarm at the earliest deadline
+static void timer_arm(void);
+
+/// Swaps two heap entries and updates their positions
+static void timer_heap_swap(uint8_t a, uint8_t b);
+
+/// Moves an entry up until its parent is due before it
+static void timer_heap_up(uint8_t pos);
+
+/// Moves an entry down until its children are due after it
+static void timer_heap_down(uint8_t pos);
+
+/// Adds a scheduled timer to the heap
+static void timer_heap_insert(timer_id_t id);
+
+/// Removes the entry at the given heap position
+static void timer_heap_remove(uint8_t pos);
 
-    timer->freq = freq_us;
-    timer->next = time_us_64() + freq_us;
+static bool timers_initialized = false;
 
-    return timer;
+/// Timers are allocated from a fixed pool, and the scheduled ones are kept in
+/// a binary min-heap of pool indices ordered by deadline
+static scheduled_timer_t timers[TIMER_MAX_TIMERS];
+static timer_id_t timer_heap[TIMER_MAX_TIMERS];
+static uint8_t timer_heap_len = 0;
+
+volatile static bool timer_alarm_fired = false;
+
+void init_timers() {
+    if (!timers_initialized) {
+        hal_deadline_init(timer_alarm_callback);
+
+        timers_initialized = true;
+    }
 }
 
-recurring_timer_t* new_timer_seconds(uint64_t freq) {
-    return new_timer(freq * US_IN_SECOND);
+static void timer_alarm_callback() { timer_alarm_fired = true; }
+
+static void timer_arm() {
+    if (timer_heap_len == 0) {
+        hal_deadline_cancel();
+        return;
+    }
+
+    // Returns true if the deadline has already passed
+    if (hal_deadline_set(timers[timer_heap[0]].deadline)) {
+        timer_alarm_fired = true;
+    }
 }
 
-void destroy_timer(recurring_timer_t* timer) { free(timer); }
+static void timer_heap_swap(uint8_t a, uint8_t b) {
+    timer_id_t tmp = timer_heap[a];
 
-bool timeout_passed(recurring_timer_t* timer) {
-    uint64_t now;
+    timer_heap[a] = timer_heap[b];
+    timer_heap[b] = tmp;
+
+    timers[timer_heap[a]].heap_pos = a;
+    timers[timer_heap[b]].heap_pos = b;
+}
+
+static void timer_heap_up(uint8_t pos) {
+    while (pos > 0 && timers[timer_heap[pos]].deadline <
+                          timers[timer_heap[TIMER_HEAP_PARENT(pos)]].deadline) {
+        timer_heap_swap(pos, TIMER_HEAP_PARENT(pos));
+        pos = TIMER_HEAP_PARENT(pos);
+    }
+}
+
+static void timer_heap_down(uint8_t pos) {
+    uint8_t child;
+
+    while ((child = TIMER_HEAP_LEFT(pos)) < timer_heap_len) {
+        if (child + 1 < timer_heap_len &&
+            timers[timer_heap[child + 1]].deadline <
+                timers[timer_heap[child]].deadline) {
+            ++child;
+        }
+
+        if (timers[timer_heap[pos]].deadline <=
+            timers[timer_heap[child]].deadline) {
+            break;
+        }
+
+        timer_heap_swap(pos, child);
+        pos = child;
+    }
+}
+
+static void timer_heap_insert(timer_id_t id) {
+    timer_heap[timer_heap_len] = id;
+    timers[id].heap_pos = timer_heap_len;
+    ++timer_heap_len;
+
+    timer_heap_up(timers[id].heap_pos);
+}
+
+static void timer_heap_remove(uint8_t pos) {
+    timer_id_t moved;
+
+    --timer_heap_len;
+    if (pos == timer_heap_len) {
+        return;
+    }
+
+    // Fill the gap with the last entry, which may belong above or below it
+    moved = timer_heap[timer_heap_len];
+    timer_heap[pos] = moved;
+    timers[moved].heap_pos = pos;
+    timer_heap_up(pos);
+    timer_heap_down(timers[moved].heap_pos);
+}
+
+timer_id_t timer_add(uint64_t delay_us, uint64_t period_us,
+                     timer_callback_t callback, void* user_data) {
+    timer_id_t id;
+
+    if (callback == NULL) {
+        return TIMER_INVALID_ID;
+    }
+
+    for (id = 0; id < TIMER_MAX_TIMERS; ++id) {
+        if (!timers[id].scheduled) {
+            break;
+        }
+    }
+    if (id == TIMER_MAX_TIMERS) {
+        LOG_ERROR("No free timers\n");
+        return TIMER_INVALID_ID;
+    }
+
+    timers[id].deadline = hal_time_us() + delay_us;
+    timers[id].period = period_us;
+    timers[id].callback = callback;
+    timers[id].user_data = user_data;
+    timers[id].scheduled = true;
+    timer_heap_insert(id);
+
+    if (timer_heap[0] == id) {
+        timer_arm();
+    }
+
+    return id;
+}
+
+timer_id_t timer_add_repeating(uint64_t period_us, timer_callback_t callback,
+                               void* user_data) {
+    return timer_add(period_us, period_us, callback, user_data);
+}
 
-#ifdef TIMER_EXACT
-    uint64_t num_passed;
-#endif
-
-    now = time_us_64();
-    if (now >= timer->next) {
-#ifdef TIMER_EXACT
-        // How many times the timeout has passed
-        num_passed = ((now - timer->next) / timer->freq) + 1;
-
-        timer->next += timer->freq * num_passed;
-#else
-        timer->next = now + timer->freq;
-#endif
-        return true;
-    } else {
+bool timer_cancel(timer_id_t id) {
+    bool was_first;
+
+    if (id < 0 || id >= TIMER_MAX_TIMERS || !timers[id].scheduled) {
         return false;
     }
-}
\ No newline at end of file
+
+    was_first = timers[id].heap_pos == 0;
+    timers[id].scheduled = false;
+    timer_heap_remove(timers[id].heap_pos);
+
+    if (was_first) {
+        timer_arm();
+    }
+
+    return true;
+}
+
+uint64_t timer_next_deadline() {
+    if (timer_heap_len == 0) {
+        return TIMER_NO_DEADLINE;
+    }
+
+    return timers[timer_heap[0]].deadline;
+}
+
+bool timer_expired() { return timer_alarm_fired; }
+
+uint32_t timer_dispatch() {
+    timer_id_t id;
+    scheduled_timer_t* timer;
+    timer_callback_t callback;
+    void* user_data;
+    uint64_t now;
+    uint32_t fired = 0;
+
+    timer_alarm_fired = false;
+    now = hal_time_us();
+
+    while (timer_heap_len > 0 && timers[timer_heap[0]].deadline <= now) {
+        id = timer_heap[0];
+        timer = &timers[id];
+        callback = timer->callback;
+        user_data = timer->user_data;
+
+        // Reschedule before running the callback so that it may cancel the
+        // timer
+        if (timer->period != 0) {
+            timer->deadline +=
+                ((now - timer->deadline) / timer->period + 1) * timer->period;
+            timer_heap_down(0);
+        } else {
+            timer->scheduled = false;
+            timer_heap_remove(0);
+        }
+
+        callback(id, user_data);
+        ++fired;
+    }
+
+    timer_arm();
+
+    return fired;
+}
+
+#undef TIMER_HEAP_PARENT
+#undef TIMER_HEAP_LEFT
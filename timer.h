@@ -9,21 +9,48 @@
 
 #define US_IN_SECOND (US_IN_MS * MS_IN_SECOND)
 
-typedef struct {
-    uint64_t freq;
-    uint64_t next;
-} recurring_timer_t;
+/// Number of timers that can be scheduled at once
+#define TIMER_MAX_TIMERS 16
 
-/// Creates a new timer with the given frequency in microseconds
-recurring_timer_t* new_timer(uint64_t freq_us);
+/// Returned by timer_add() when no timer could be scheduled
+#define TIMER_INVALID_ID (-1)
 
-/// Creates a new timer with the given frequency in seconds
-recurring_timer_t* new_timer_seconds(uint64_t freq_us);
+/// Deadline reported while no timer is scheduled
+#define TIMER_NO_DEADLINE UINT64_MAX
 
-/// Destroys a timer and frees the used memory
-void destroy_timer(recurring_timer_t* timer);
+typedef int8_t timer_id_t;
 
-/// Checks if the timer's timout has passed and refreshes the timer if it has
-bool timeout_passed(recurring_timer_t* timer);
+/// Called from timer_dispatch() once the timer has expired
+typedef void (*timer_callback_t)(timer_id_t id, void* user_data);
 
-#endif
\ No newline at end of file
+/// Initializes the scheduler and claims the hardware alarm it wakes up with
+void init_timers(void);
+
+/// Schedules a callback in `delay_us` microseconds, repeating every
+/// `period_us` microseconds afterwards unless that is 0. Repeating timers
+/// skip periods that were missed instead of firing for each of them. Returns
+/// TIMER_INVALID_ID if all timers are in use
+timer_id_t timer_add(uint64_t delay_us, uint64_t period_us,
+                     timer_callback_t callback, void* user_data);
+
+/// Schedules a callback repeating every `period_us` microseconds
+timer_id_t timer_add_repeating(uint64_t period_us, timer_callback_t callback,
+                               void* user_data);
+
+/// Cancels a scheduled timer. Returns false if it was not scheduled
+bool timer_cancel(timer_id_t id);
+
+/// Gets the earliest deadline of all scheduled timers in microseconds since
+/// boot, or TIMER_NO_DEADLINE if there is none
+uint64_t timer_next_deadline(void);
+
+/// Checks whether the hardware alarm has gone off since the last dispatch
+bool timer_expired(void);
+
+/// Runs the callbacks of all expired timers and rearms the hardware alarm for
+/// the next deadline. Returns the number of callbacks run. The scheduler is
+/// not interrupt safe, so timers are only ever added, cancelled and
+/// dispatched from the main thread
+uint32_t timer_dispatch(void);
+
+#endif
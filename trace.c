@@ -0,0 +1,89 @@
+#include "trace.h"
+#include "debug.h"
+#include "hal.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+static bool trace_initialized = false;
+
+/// Multiple producer, single consumer ring. Producers reserve their slot and
+/// write it under the lock, the consumer only ever moves the tail
+static trace_record_t trace_buffer[TRACE_BUFFER_SIZE];
+volatile static uint32_t trace_head = 0;
+volatile static uint32_t trace_tail = 0;
+volatile static uint32_t trace_lost = 0;
+
+void init_trace() {
+    // Producers on both cores take the lock shared through the HAL, which
+    // hal_init() has set up
+    trace_initialized = true;
+}
+
+void trace_record(trace_event_t event, uint32_t arg0, uint32_t arg1) {
+    uint32_t irq_state;
+    uint32_t head;
+    trace_record_t* record;
+
+    if (!trace_initialized) {
+        return;
+    }
+
+    irq_state = hal_shared_lock();
+
+    head = trace_head;
+    if (head - trace_tail >= TRACE_BUFFER_SIZE) {
+        // Full, keep the oldest records
+        ++trace_lost;
+    } else {
+        record = &trace_buffer[head % TRACE_BUFFER_SIZE];
+        record->time_us = (uint32_t)hal_time_us();
+        record->event = event;
+        record->arg0 = arg0;
+        record->arg1 = arg1;
+        trace_head = head + 1;
+    }
+
+    hal_shared_unlock(irq_state);
+}
+
+uint32_t trace_drain() {
+    trace_record_t record;
+    uint32_t tail;
+    uint32_t irq_state;
+    uint32_t lost;
+    uint32_t drained = 0;
+
+    if (!trace_initialized) {
+        return 0;
+    }
+
+    irq_state = hal_shared_lock();
+    lost = trace_lost;
+    trace_lost = 0;
+    hal_shared_unlock(irq_state);
+
+    if (lost != 0) {
+        printf(TRACE_LINE_PREFIX "%08x %02x %08x %08x\n",
+               (uint32_t)hal_time_us(), TRACE_EVENT_LOST, lost, 0);
+        ++drained;
+    }
+
+    while (drained < TRACE_DRAIN_BATCH) {
+        tail = trace_tail;
+        if (tail == trace_head) {
+            break;
+        }
+
+        // Copied out first so that printing does not hold up the producers
+        record = trace_buffer[tail % TRACE_BUFFER_SIZE];
+        trace_tail = tail + 1;
+
+        printf(TRACE_LINE_PREFIX "%08x %02x %08x %08x\n", record.time_us,
+               record.event, record.arg0, record.arg1);
+        ++drained;
+    }
+
+    return drained;
+}
@@ -0,0 +1,63 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "debug.h"
+
+/// Number of records buffered until they are drained. Power of two
+#define TRACE_BUFFER_SIZE 128
+
+/// Records printed per call to trace_drain(), to keep each call short
+#define TRACE_DRAIN_BATCH 4
+
+/// Prefix of a drained record, see decode_trace.py
+#define TRACE_LINE_PREFIX "#T"
+
+/// What a record is about, and what its arguments are. Keep in sync with
+/// decode_trace.py
+typedef enum {
+    /// Records were lost because the buffer was full. arg0: count
+    TRACE_EVENT_LOST,
+    /// arg0: watchdog_feed_reason_t
+    TRACE_EVENT_WATCHDOG_FED,
+    /// arg0: hits since boot
+    TRACE_EVENT_PIEZO_HIT,
+    /// arg0: whether the fork got blocked, arg1: position in 1/256 steps
+    TRACE_EVENT_OPTO_EDGE,
+    /// arg0: steps taken, arg1: position in steps
+    TRACE_EVENT_MOTOR_DONE,
+    /// arg0: btn_t, arg1: button_event_type_t
+    TRACE_EVENT_BUTTON,
+} trace_event_t;
+
+typedef struct {
+    /// Lower 32 bits of the time since boot
+    uint32_t time_us;
+    uint32_t event;
+    uint32_t arg0;
+    uint32_t arg1;
+} trace_record_t;
+
+/// Records an event if the module logs at LOG_LEVEL_TRACE, see debug.h
+#if LOG_THRESHOLD >= LOG_LEVEL_TRACE
+#define TRACE(event, arg0, arg1) trace_record((event), (arg0), (arg1))
+#else
+#define TRACE(event, arg0, arg1)                                               \
+    do {                                                                       \
+    } while (0)
+#endif
+
+/// Initializes the trace buffer. Records made before this are lost
+void init_trace(void);
+
+/// Records an event in the trace buffer. Safe to call from either core and
+/// from interrupts, takes a few microseconds and never blocks on output
+void trace_record(trace_event_t event, uint32_t arg0, uint32_t arg1);
+
+/// Prints up to TRACE_DRAIN_BATCH buffered records as hex lines. Meant for
+/// when there is nothing else to do. Returns the number printed
+uint32_t trace_drain(void);
+
+#endif